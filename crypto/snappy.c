@@ -0,0 +1,139 @@
+/*
+ * Cryptographic API.
+ *
+ * Snappy compression, built on the csnappy library in drivers/staging.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/crypto.h>
+#include <linux/vmalloc.h>
+
+#include "../drivers/staging/snappy/csnappy.h"
+
+/*
+ * The output is a raw snappy stream without the leading uncompressed length;
+ * the callers of the compression API already know how big the data is.
+ * Snappy fragments are limited to 32KiB of input, bigger buffers are
+ * compressed as a sequence of fragments which decompress as one stream.
+ */
+#define SNAPPY_FRAGMENT_SIZE	(1 << 15)
+
+struct snappy_ctx {
+	void *snappy_comp_mem;
+};
+
+static int snappy_init(struct crypto_tfm *tfm)
+{
+	struct snappy_ctx *ctx = crypto_tfm_ctx(tfm);
+
+	ctx->snappy_comp_mem = vmalloc(CSNAPPY_WORKMEM_BYTES);
+	if (!ctx->snappy_comp_mem)
+		return -ENOMEM;
+
+	return 0;
+}
+
+static void snappy_exit(struct crypto_tfm *tfm)
+{
+	struct snappy_ctx *ctx = crypto_tfm_ctx(tfm);
+
+	vfree(ctx->snappy_comp_mem);
+}
+
+/*
+ * Small fragments only need a small hash table, and clearing a smaller
+ * table is a noticeable part of compressing a single page.
+ */
+static int snappy_workmem_log(unsigned int len)
+{
+	int log;
+
+	for (log = 9; log < CSNAPPY_WORKMEM_BYTES_POWER_OF_TWO; log++)
+		if ((1 << (log - 1)) >= len)
+			break;
+
+	return log;
+}
+
+static int snappy_compress(struct crypto_tfm *tfm, const u8 *src,
+			   unsigned int slen, u8 *dst, unsigned int *dlen)
+{
+	struct snappy_ctx *ctx = crypto_tfm_ctx(tfm);
+	char *out = (char *)dst;
+	unsigned int len, used;
+
+	while (slen > 0) {
+		len = min_t(unsigned int, slen, SNAPPY_FRAGMENT_SIZE);
+		used = out - (char *)dst;
+		if (csnappy_max_compressed_length(len) > *dlen - used)
+			return -EINVAL;
+
+		out = csnappy_compress_fragment((const char *)src, len, out,
+						ctx->snappy_comp_mem,
+						snappy_workmem_log(len));
+		src += len;
+		slen -= len;
+	}
+
+	*dlen = out - (char *)dst;
+	return 0;
+}
+
+static int snappy_decompress(struct crypto_tfm *tfm, const u8 *src,
+			     unsigned int slen, u8 *dst, unsigned int *dlen)
+{
+	uint32_t tmp_len = *dlen;
+	int err;
+
+	err = csnappy_decompress_noheader((const char *)src, slen,
+					  (char *)dst, &tmp_len);
+	if (err != CSNAPPY_E_OK)
+		return -EINVAL;
+
+	*dlen = tmp_len;
+	return 0;
+}
+
+static struct crypto_alg alg = {
+	.cra_name		= "snappy",
+	.cra_flags		= CRYPTO_ALG_TYPE_COMPRESS,
+	.cra_ctxsize		= sizeof(struct snappy_ctx),
+	.cra_module		= THIS_MODULE,
+	.cra_list		= LIST_HEAD_INIT(alg.cra_list),
+	.cra_init		= snappy_init,
+	.cra_exit		= snappy_exit,
+	.cra_u			= { .compress = {
+	.coa_compress		= snappy_compress,
+	.coa_decompress		= snappy_decompress } }
+};
+
+static int __init snappy_mod_init(void)
+{
+	return crypto_register_alg(&alg);
+}
+
+static void __exit snappy_mod_fini(void)
+{
+	crypto_unregister_alg(&alg);
+}
+
+module_init(snappy_mod_init);
+module_exit(snappy_mod_fini);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("Snappy Compression Algorithm");
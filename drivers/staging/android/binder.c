@@ -20,6 +20,7 @@
 #include <linux/fdtable.h>
 #include <linux/file.h>
 #include <linux/fs.h>
+#include <linux/ktime.h>
 #include <linux/list.h>
 #include <linux/miscdevice.h>
 #include <linux/mm.h>
@@ -36,9 +37,26 @@
 
 #include "binder.h"
 
+/*
+ * binder_lock is still one global lock over the whole object graph:
+ * threads, nodes, refs, death notifications and the transaction stacks
+ * that link processes. All of that work is serialized across every
+ * process pair in the system.
+ *
+ * Only the buffer space of each process has a lock of its own,
+ * proc->alloc_lock, so that page allocation and copying transaction
+ * data in from user space happen with binder_lock dropped. Lock order is
+ * binder_lock -> proc->alloc_lock -> mmap_sem.
+ *
+ * This shortens the time binder_lock is held but is only a first step.
+ * Splitting it further into per-proc locks for threads and refs and
+ * per-node locks for refcounts has not been done: it needs a lock order
+ * for every path that follows a pointer from one process into another.
+ */
 static DEFINE_MUTEX(binder_lock);
 static DEFINE_MUTEX(binder_deferred_lock);
 static DEFINE_MUTEX(binder_mmap_lock);
+static DEFINE_MUTEX(binder_procs_lock);
 
 static HLIST_HEAD(binder_procs);
 static HLIST_HEAD(binder_deferred_list);
@@ -106,6 +124,10 @@ module_param_named(debug_mask, binder_debug_mask, uint, S_IWUSR | S_IRUGO);
 static int binder_debug_no_lock;
 module_param_named(proc_no_lock, binder_debug_no_lock, bool, S_IWUSR | S_IRUGO);
 
+/* Pages per process kept mapped after their buffers are freed */
+static int binder_retain_pages = 8;
+module_param_named(retain_pages, binder_retain_pages, int, S_IWUSR | S_IRUGO);
+
 static DECLARE_WAIT_QUEUE_HEAD(binder_user_error_wait);
 static int binder_stop_on_user_error;
 
@@ -147,22 +169,22 @@ enum binder_stat_types {
 };
 
 struct binder_stats {
-	int br[_IOC_NR(BR_FAILED_REPLY) + 1];
-	int bc[_IOC_NR(BC_DEAD_BINDER_DONE) + 1];
-	int obj_created[BINDER_STAT_COUNT];
-	int obj_deleted[BINDER_STAT_COUNT];
+	atomic_t br[_IOC_NR(BR_FAILED_REPLY) + 1];
+	atomic_t bc[_IOC_NR(BC_DEAD_BINDER_DONE) + 1];
+	atomic_t obj_created[BINDER_STAT_COUNT];
+	atomic_t obj_deleted[BINDER_STAT_COUNT];
 };
 
 static struct binder_stats binder_stats;
 
 static inline void binder_stats_deleted(enum binder_stat_types type)
 {
-	binder_stats.obj_deleted[type]++;
+	atomic_inc(&binder_stats.obj_deleted[type]);
 }
 
 static inline void binder_stats_created(enum binder_stat_types type)
 {
-	binder_stats.obj_created[type]++;
+	atomic_inc(&binder_stats.obj_created[type]);
 }
 
 struct binder_transaction_log_entry {
@@ -178,17 +200,24 @@ struct binder_transaction_log_entry {
 	int offsets_size;
 };
 struct binder_transaction_log {
+	spinlock_t lock;
 	int next;
 	int full;
 	struct binder_transaction_log_entry entry[32];
 };
-static struct binder_transaction_log binder_transaction_log;
-static struct binder_transaction_log binder_transaction_log_failed;
+static struct binder_transaction_log binder_transaction_log = {
+	.lock = __SPIN_LOCK_UNLOCKED(binder_transaction_log.lock),
+};
+static struct binder_transaction_log binder_transaction_log_failed = {
+	.lock = __SPIN_LOCK_UNLOCKED(binder_transaction_log_failed.lock),
+};
 
 static struct binder_transaction_log_entry *binder_transaction_log_add(
 	struct binder_transaction_log *log)
 {
 	struct binder_transaction_log_entry *e;
+
+	spin_lock(&log->lock);
 	e = &log->entry[log->next];
 	memset(e, 0, sizeof(*e));
 	log->next++;
@@ -196,6 +225,7 @@ static struct binder_transaction_log_entry *binder_transaction_log_add(
 		log->next = 0;
 		log->full = 1;
 	}
+	spin_unlock(&log->lock);
 	return e;
 }
 
@@ -259,8 +289,10 @@ struct binder_ref {
 
 struct binder_buffer {
 	struct list_head entry; /* free and allocated entries by addesss */
-	struct rb_node rb_node; /* free entry by size or allocated entry */
-				/* by address */
+	union {
+		struct rb_node rb_node; /* allocated entry by address */
+		struct list_head free_entry; /* free entry by size class */
+	};
 	unsigned free:1;
 	unsigned allow_user_free:1;
 	unsigned async_transaction:1;
@@ -274,6 +306,35 @@ struct binder_buffer {
 	uint8_t data[0];
 };
 
+/*
+ * Free buffers of at least 1 << i (and less than 2 << i) bytes are kept
+ * on free_lists[i]. Bit i of free_lists_mask is set if that list is not
+ * empty, so a buffer that is large enough can be found without a
+ * search.
+ */
+#define BINDER_FREE_LISTS	(ilog2(SZ_4M) + 1)
+
+/*
+ * Latency histogram, count[i] is the number of events that took less
+ * than 1 << i microseconds. The last bucket also counts everything
+ * slower.
+ */
+#define BINDER_LATENCY_BUCKETS	16
+
+struct binder_latency {
+	unsigned int count[BINDER_LATENCY_BUCKETS];
+};
+
+static void binder_latency_add(struct binder_latency *lat, ktime_t start)
+{
+	s64 us = ktime_us_delta(ktime_get(), start);
+	int i = us > 0 ? fls64(us) : 0;
+
+	if (i >= BINDER_LATENCY_BUCKETS)
+		i = BINDER_LATENCY_BUCKETS - 1;
+	lat->count[i]++;
+}
+
 enum binder_deferred_state {
 	BINDER_DEFERRED_PUT_FILES    = 0x01,
 	BINDER_DEFERRED_FLUSH        = 0x02,
@@ -295,17 +356,22 @@ struct binder_proc {
 	void *buffer;
 	ptrdiff_t user_buffer_offset;
 
+	struct mutex alloc_lock;	/* protects buffers .. alloc_latency */
 	struct list_head buffers;
-	struct rb_root free_buffers;
+	struct list_head free_lists[BINDER_FREE_LISTS];
+	unsigned long free_lists_mask;
 	struct rb_root allocated_buffers;
 	size_t free_async_space;
 
 	struct page **pages;
+	int pages_retained;
+	struct binder_latency alloc_latency;
 	size_t buffer_size;
 	uint32_t buffer_free;
 	struct list_head todo;
 	wait_queue_head_t wait;
 	struct binder_stats stats;
+	struct binder_latency transaction_latency;
 	struct list_head delivered_death;
 	int max_threads;
 	int requested_threads;
@@ -313,6 +379,8 @@ struct binder_proc {
 	int ready_threads;
 	long default_priority;
 	struct dentry *debugfs_entry;
+	int tmp_ref;		/* senders copying into our buffers */
+	int is_dead;
 };
 
 enum {
@@ -356,6 +424,7 @@ struct binder_transaction {
 	long	priority;
 	long	saved_priority;
 	uid_t	sender_euid;
+	ktime_t	start_time;
 };
 
 static void
@@ -526,14 +595,16 @@ static size_t binder_buffer_size(struct binder_proc *proc,
 			struct binder_buffer, entry) - (size_t)buffer->data;
 }
 
+static int binder_free_list_index(size_t size)
+{
+	return size ? fls(size) - 1 : 0;
+}
+
 static void binder_insert_free_buffer(struct binder_proc *proc,
 				      struct binder_buffer *new_buffer)
 {
-	struct rb_node **p = &proc->free_buffers.rb_node;
-	struct rb_node *parent = NULL;
-	struct binder_buffer *buffer;
-	size_t buffer_size;
 	size_t new_buffer_size;
+	int i;
 
 	BUG_ON(!new_buffer->free);
 
@@ -543,20 +614,52 @@ static void binder_insert_free_buffer(struct binder_proc *proc,
 		     "binder: %d: add free buffer, size %zd, "
 		     "at %p\n", proc->pid, new_buffer_size, new_buffer);
 
-	while (*p) {
-		parent = *p;
-		buffer = rb_entry(parent, struct binder_buffer, rb_node);
-		BUG_ON(!buffer->free);
+	/* recently freed buffers first, their pages are likely mapped */
+	i = binder_free_list_index(new_buffer_size);
+	list_add(&new_buffer->free_entry, &proc->free_lists[i]);
+	__set_bit(i, &proc->free_lists_mask);
+}
 
-		buffer_size = binder_buffer_size(proc, buffer);
+/* Must be called before the size of buffer changes */
+static void binder_erase_free_buffer(struct binder_proc *proc,
+				     struct binder_buffer *buffer)
+{
+	int i = binder_free_list_index(binder_buffer_size(proc, buffer));
 
-		if (new_buffer_size < buffer_size)
-			p = &parent->rb_left;
-		else
-			p = &parent->rb_right;
+	BUG_ON(!buffer->free);
+	list_del(&buffer->free_entry);
+	if (list_empty(&proc->free_lists[i]))
+		__clear_bit(i, &proc->free_lists_mask);
+}
+
+/*
+ * Every buffer on a list above that of size is large enough. Failing
+ * that, the list of size itself has to be searched.
+ */
+static struct binder_buffer *binder_find_free_buffer(struct binder_proc *proc,
+						     size_t size)
+{
+	struct binder_buffer *buffer;
+	int i = binder_free_list_index(size);
+	int bit;
+
+	if (!list_empty(&proc->free_lists[i])) {
+		buffer = list_first_entry(&proc->free_lists[i],
+					  struct binder_buffer, free_entry);
+		if (binder_buffer_size(proc, buffer) >= size)
+			return buffer;
 	}
-	rb_link_node(&new_buffer->rb_node, parent, p);
-	rb_insert_color(&new_buffer->rb_node, &proc->free_buffers);
+
+	bit = find_next_bit(&proc->free_lists_mask, BINDER_FREE_LISTS, i + 1);
+	if (bit < BINDER_FREE_LISTS)
+		return list_first_entry(&proc->free_lists[bit],
+					struct binder_buffer, free_entry);
+
+	list_for_each_entry(buffer, &proc->free_lists[i], free_entry) {
+		if (binder_buffer_size(proc, buffer) >= size)
+			return buffer;
+	}
+	return NULL;
 }
 
 static void binder_insert_allocated_buffer(struct binder_proc *proc,
@@ -617,6 +720,7 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	struct vm_struct tmp_area;
 	struct page **page;
 	struct mm_struct *mm;
+	int npages, i;
 
 	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 		     "binder: %d: %s pages %p-%p\n", proc->pid,
@@ -625,6 +729,25 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	if (end <= start)
 		return 0;
 
+	/*
+	 * Keep the pages of freed buffers mapped, up to binder_retain_pages
+	 * per process, so the next allocation over them does not have to
+	 * take mmap_sem and map them again.
+	 */
+	npages = (end - start) / PAGE_SIZE;
+	if (allocate) {
+		page = &proc->pages[(start - proc->buffer) / PAGE_SIZE];
+		for (i = 0; i < npages && page[i]; i++)
+			;
+		if (i == npages) {
+			proc->pages_retained -= npages;
+			return 0;
+		}
+	} else if (proc->pages_retained + npages <= binder_retain_pages) {
+		proc->pages_retained += npages;
+		return 0;
+	}
+
 	if (vma)
 		mm = NULL;
 	else
@@ -655,7 +778,10 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 		struct page **page_array_ptr;
 		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
 
-		BUG_ON(*page);
+		if (*page) {
+			proc->pages_retained--;
+			continue;
+		}
 		*page = alloc_page(GFP_KERNEL | __GFP_ZERO);
 		if (*page == NULL) {
 			binder_debug(BINDER_DEBUG_TOP_ERRORS,
@@ -719,10 +845,8 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 					      size_t data_size,
 					      size_t offsets_size, int is_async)
 {
-	struct rb_node *n = proc->free_buffers.rb_node;
 	struct binder_buffer *buffer;
 	size_t buffer_size;
-	struct rb_node *best_fit = NULL;
 	void *has_page_addr;
 	void *end_page_addr;
 	size_t size;
@@ -751,31 +875,14 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 		return NULL;
 	}
 
-	while (n) {
-		buffer = rb_entry(n, struct binder_buffer, rb_node);
-		BUG_ON(!buffer->free);
-		buffer_size = binder_buffer_size(proc, buffer);
-
-		if (size < buffer_size) {
-			best_fit = n;
-			n = n->rb_left;
-		} else if (size > buffer_size)
-			n = n->rb_right;
-		else {
-			best_fit = n;
-			break;
-		}
-	}
-	if (best_fit == NULL) {
+	buffer = binder_find_free_buffer(proc, size);
+	if (buffer == NULL) {
 		binder_debug(BINDER_DEBUG_TOP_ERRORS,
 		       "binder: %d: binder_alloc_buf size %zd failed, "
 		       "no address space\n", proc->pid, size);
 		return NULL;
 	}
-	if (n == NULL) {
-		buffer = rb_entry(best_fit, struct binder_buffer, rb_node);
-		buffer_size = binder_buffer_size(proc, buffer);
-	}
+	buffer_size = binder_buffer_size(proc, buffer);
 
 	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 		     "binder: %d: binder_alloc_buf size %zd got buff"
@@ -783,7 +890,7 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 
 	has_page_addr =
 		(void *)(((uintptr_t)buffer->data + buffer_size) & PAGE_MASK);
-	if (n == NULL) {
+	if (size != buffer_size) {
 		if (size + sizeof(struct binder_buffer) + 4 >= buffer_size)
 			buffer_size = size; /* no room for other buffers */
 		else
@@ -797,7 +904,7 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 	    (void *)PAGE_ALIGN((uintptr_t)buffer->data), end_page_addr, NULL))
 		return NULL;
 
-	rb_erase(best_fit, &proc->free_buffers);
+	binder_erase_free_buffer(proc, buffer);
 	buffer->free = 0;
 	binder_insert_allocated_buffer(proc, buffer);
 	if (buffer_size != size) {
@@ -919,7 +1026,7 @@ static void binder_free_buf(struct binder_proc *proc,
 		struct binder_buffer *next = list_entry(buffer->entry.next,
 						struct binder_buffer, entry);
 		if (next->free) {
-			rb_erase(&next->rb_node, &proc->free_buffers);
+			binder_erase_free_buffer(proc, next);
 			binder_delete_free_buffer(proc, next);
 		}
 	}
@@ -927,8 +1034,8 @@ static void binder_free_buf(struct binder_proc *proc,
 		struct binder_buffer *prev = list_entry(buffer->entry.prev,
 						struct binder_buffer, entry);
 		if (prev->free) {
+			binder_erase_free_buffer(proc, prev);
 			binder_delete_free_buffer(proc, buffer);
-			rb_erase(&prev->rb_node, &proc->free_buffers);
 			buffer = prev;
 		}
 	}
@@ -1242,6 +1349,17 @@ static int binder_dec_ref(struct binder_ref *ref, int strong)
 	return 0;
 }
 
+/*
+ * Drop a reference taken while binder_lock was released. The last one
+ * frees a process that binder_deferred_release left behind.
+ */
+static void binder_proc_dec_tmpref(struct binder_proc *proc)
+{
+	proc->tmp_ref--;
+	if (proc->is_dead && !proc->tmp_ref)
+		kfree(proc);
+}
+
 static void binder_pop_transaction(struct binder_thread *target_thread,
 				   struct binder_transaction *t)
 {
@@ -1414,6 +1532,8 @@ static void binder_transaction(struct binder_proc *proc,
 	wait_queue_head_t *target_wait;
 	struct binder_transaction *in_reply_to = NULL;
 	struct binder_transaction_log_entry *e;
+	const char *bad_ptr = NULL;
+	int target_dead;
 	uint32_t return_error;
 
 	e = binder_transaction_log_add(&binder_transaction_log);
@@ -1513,14 +1633,8 @@ static void binder_transaction(struct binder_proc *proc,
 			}
 		}
 	}
-	if (target_thread) {
+	if (target_thread)
 		e->to_thread = target_thread->pid;
-		target_list = &target_thread->todo;
-		target_wait = &target_thread->wait;
-	} else {
-		target_list = &target_proc->todo;
-		target_wait = &target_proc->wait;
-	}
 	e->to_proc = target_proc->pid;
 
 	/* TODO: reuse incoming transaction for reply */
@@ -1530,6 +1644,7 @@ static void binder_transaction(struct binder_proc *proc,
 		goto err_alloc_t_failed;
 	}
 	binder_stats_created(BINDER_STAT_TRANSACTION);
+	t->start_time = ktime_get();
 
 	tcomplete = kzalloc(sizeof(*tcomplete), GFP_KERNEL);
 	if (tcomplete == NULL) {
@@ -1564,37 +1679,104 @@ static void binder_transaction(struct binder_proc *proc,
 		t->from = NULL;
 	t->sender_euid = proc->tsk->cred->euid;
 	t->to_proc = target_proc;
-	t->to_thread = target_thread;
 	t->code = tr->code;
 	t->flags = tr->flags;
 	t->priority = task_nice(current);
-	t->buffer = binder_alloc_buf(target_proc, tr->data_size,
-		tr->offsets_size, !reply && (t->flags & TF_ONE_WAY));
+
+	/*
+	 * Allocating the buffer may map pages into the target and the copy
+	 * may fault, so both are done without binder_lock. The node
+	 * reference keeps target_node alive and tmp_ref keeps target_proc
+	 * around; if the target dies meanwhile, binder_deferred_release
+	 * takes the buffer back and we fail the transaction below.
+	 */
+	if (target_node)
+		binder_inc_node(target_node, 1, 0, NULL);
+	target_proc->tmp_ref++;
+	mutex_unlock(&binder_lock);
+
+	mutex_lock(&target_proc->alloc_lock);
+	if (!target_proc->is_dead) {
+		ktime_t start = ktime_get();
+
+		t->buffer = binder_alloc_buf(target_proc, tr->data_size,
+			tr->offsets_size, !reply && (t->flags & TF_ONE_WAY));
+		binder_latency_add(&target_proc->alloc_latency, start);
+	}
+	if (t->buffer) {
+		t->buffer->allow_user_free = 0;
+		t->buffer->debug_id = t->debug_id;
+		t->buffer->transaction = t;
+		t->buffer->target_node = NULL;
+		offp = (size_t *)(t->buffer->data +
+				  ALIGN(tr->data_size, sizeof(void *)));
+		if (copy_from_user(t->buffer->data, tr->data.ptr.buffer,
+				   tr->data_size))
+			bad_ptr = "data";
+		else if (copy_from_user(offp, tr->data.ptr.offsets,
+					tr->offsets_size))
+			bad_ptr = "offsets";
+	}
+	mutex_unlock(&target_proc->alloc_lock);
+
+	mutex_lock(&binder_lock);
+	target_dead = target_proc->is_dead;
+	binder_proc_dec_tmpref(target_proc);
+	if (target_dead) {
+		/* our buffer and node reference went with it */
+		return_error = BR_DEAD_REPLY;
+		goto err_target_proc_dead;
+	}
 	if (t->buffer == NULL) {
 		return_error = BR_FAILED_REPLY;
 		goto err_binder_alloc_buf_failed;
 	}
-	t->buffer->allow_user_free = 0;
-	t->buffer->debug_id = t->debug_id;
-	t->buffer->transaction = t;
 	t->buffer->target_node = target_node;
-	if (target_node)
-		binder_inc_node(target_node, 1, 0, NULL);
-
-	offp = (size_t *)(t->buffer->data + ALIGN(tr->data_size, sizeof(void *)));
 
-	if (copy_from_user(t->buffer->data, tr->data.ptr.buffer, tr->data_size)) {
+	if (bad_ptr) {
 		binder_user_error("binder: %d:%d got transaction with invalid "
-			"data ptr\n", proc->pid, thread->pid);
+			"%s ptr\n", proc->pid, thread->pid, bad_ptr);
 		return_error = BR_FAILED_REPLY;
 		goto err_copy_data_failed;
 	}
-	if (copy_from_user(offp, tr->data.ptr.offsets, tr->offsets_size)) {
-		binder_user_error("binder: %d:%d got transaction with invalid "
-			"offsets ptr\n", proc->pid, thread->pid);
-		return_error = BR_FAILED_REPLY;
-		goto err_copy_data_failed;
+	if (reply) {
+		if (in_reply_to->from == NULL) {
+			return_error = BR_DEAD_REPLY;
+			goto err_dead_target_thread;
+		}
+		if (target_thread->transaction_stack != in_reply_to) {
+			binder_user_error("binder: %d:%d got reply transaction "
+				"with bad target transaction stack %d, "
+				"expected %d\n",
+				proc->pid, thread->pid,
+				target_thread->transaction_stack ?
+				target_thread->transaction_stack->debug_id : 0,
+				in_reply_to->debug_id);
+			return_error = BR_FAILED_REPLY;
+			in_reply_to = NULL;
+			target_thread = NULL;
+			goto err_dead_target_thread;
+		}
+	} else if (target_thread) {
+		struct binder_transaction *tmp;
+
+		/* it may have exited while binder_lock was dropped */
+		target_thread = NULL;
+		for (tmp = thread->transaction_stack; tmp;
+		     tmp = tmp->from_parent) {
+			if (tmp->from && tmp->from->proc == target_proc)
+				target_thread = tmp->from;
+		}
 	}
+	t->to_thread = target_thread;
+	if (target_thread) {
+		target_list = &target_thread->todo;
+		target_wait = &target_thread->wait;
+	} else {
+		target_list = &target_proc->todo;
+		target_wait = &target_proc->wait;
+	}
+
 	if (!IS_ALIGNED(tr->offsets_size, sizeof(size_t))) {
 		binder_user_error("binder: %d:%d got transaction with "
 			"invalid offsets size, %zd\n",
@@ -1795,11 +1977,18 @@ err_binder_get_ref_failed:
 err_binder_new_node_failed:
 err_bad_object_type:
 err_bad_offset:
+err_dead_target_thread:
 err_copy_data_failed:
 	binder_transaction_buffer_release(target_proc, t->buffer, offp);
 	t->buffer->transaction = NULL;
+	mutex_lock(&target_proc->alloc_lock);
 	binder_free_buf(target_proc, t->buffer);
+	mutex_unlock(&target_proc->alloc_lock);
+	target_node = NULL;	/* reference dropped with the buffer */
 err_binder_alloc_buf_failed:
+	if (target_node)
+		binder_dec_node(target_node, 1, 0);
+err_target_proc_dead:
 	kfree(tcomplete);
 	binder_stats_deleted(BINDER_STAT_TRANSACTION_COMPLETE);
 err_alloc_tcomplete_failed:
@@ -1822,7 +2011,12 @@ err_no_context_mgr_node:
 		*fe = *e;
 	}
 
-	BUG_ON(thread->return_error != BR_OK);
+	if (thread->return_error != BR_OK) {
+		/* a failed reply reached us while binder_lock was dropped */
+		if (thread->return_error2 == BR_OK)
+			thread->return_error2 = thread->return_error;
+		thread->return_error = BR_OK;
+	}
 	if (in_reply_to) {
 		thread->return_error = BR_TRANSACTION_COMPLETE;
 		binder_send_failed_reply(in_reply_to, return_error);
@@ -1842,9 +2036,9 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			return -EFAULT;
 		ptr += sizeof(uint32_t);
 		if (_IOC_NR(cmd) < ARRAY_SIZE(binder_stats.bc)) {
-			binder_stats.bc[_IOC_NR(cmd)]++;
-			proc->stats.bc[_IOC_NR(cmd)]++;
-			thread->stats.bc[_IOC_NR(cmd)]++;
+			atomic_inc(&binder_stats.bc[_IOC_NR(cmd)]);
+			atomic_inc(&proc->stats.bc[_IOC_NR(cmd)]);
+			atomic_inc(&thread->stats.bc[_IOC_NR(cmd)]);
 		}
 		switch (cmd) {
 		case BC_INCREFS:
@@ -1986,20 +2180,26 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				return -EFAULT;
 			ptr += sizeof(void *);
 
+			mutex_lock(&proc->alloc_lock);
 			buffer = binder_buffer_lookup(proc, data_ptr);
 			if (buffer == NULL) {
+				mutex_unlock(&proc->alloc_lock);
 				binder_user_error("binder: %d:%d "
 					"BC_FREE_BUFFER u%p no match\n",
 					proc->pid, thread->pid, data_ptr);
 				break;
 			}
 			if (!buffer->allow_user_free) {
+				mutex_unlock(&proc->alloc_lock);
 				binder_user_error("binder: %d:%d "
 					"BC_FREE_BUFFER u%p matched "
 					"unreturned buffer\n",
 					proc->pid, thread->pid, data_ptr);
 				break;
 			}
+			/* claim it before binder_lock is dropped below */
+			buffer->allow_user_free = 0;
+			mutex_unlock(&proc->alloc_lock);
 			binder_debug(BINDER_DEBUG_FREE_BUFFER,
 				     "binder: %d:%d BC_FREE_BUFFER u%p found"
 				     " buffer %d for %s transaction\n",
@@ -2019,7 +2219,13 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					list_move_tail(buffer->target_node->async_todo.next, &thread->todo);
 			}
 			binder_transaction_buffer_release(proc, buffer, NULL);
+
+			/* unmapping the pages does not need the object graph */
+			mutex_unlock(&binder_lock);
+			mutex_lock(&proc->alloc_lock);
 			binder_free_buf(proc, buffer);
+			mutex_unlock(&proc->alloc_lock);
+			mutex_lock(&binder_lock);
 			break;
 		}
 
@@ -2232,9 +2438,9 @@ void binder_stat_br(struct binder_proc *proc, struct binder_thread *thread,
 		    uint32_t cmd)
 {
 	if (_IOC_NR(cmd) < ARRAY_SIZE(binder_stats.br)) {
-		binder_stats.br[_IOC_NR(cmd)]++;
-		proc->stats.br[_IOC_NR(cmd)]++;
-		thread->stats.br[_IOC_NR(cmd)]++;
+		atomic_inc(&binder_stats.br[_IOC_NR(cmd)]);
+		atomic_inc(&proc->stats.br[_IOC_NR(cmd)]);
+		atomic_inc(&thread->stats.br[_IOC_NR(cmd)]);
 	}
 }
 
@@ -2507,6 +2713,7 @@ retry:
 		ptr += sizeof(tr);
 
 		binder_stat_br(proc, thread, cmd);
+		binder_latency_add(&proc->transaction_latency, t->start_time);
 		binder_debug(BINDER_DEBUG_TRANSACTION,
 			     "binder: %d:%d %s %d %d:%d, cmd %d"
 			     "size %zd-%zd ptr %p-%p\n",
@@ -2971,6 +3178,7 @@ err_bad_arg:
 static int binder_open(struct inode *nodp, struct file *filp)
 {
 	struct binder_proc *proc;
+	int i;
 
 	binder_debug(BINDER_DEBUG_OPEN_CLOSE, "binder_open: %d:%d\n",
 		     current->group_leader->pid, current->pid);
@@ -2982,14 +3190,18 @@ static int binder_open(struct inode *nodp, struct file *filp)
 	proc->tsk = current;
 	INIT_LIST_HEAD(&proc->todo);
 	init_waitqueue_head(&proc->wait);
+	mutex_init(&proc->alloc_lock);
+	for (i = 0; i < BINDER_FREE_LISTS; i++)
+		INIT_LIST_HEAD(&proc->free_lists[i]);
 	proc->default_priority = task_nice(current);
-	mutex_lock(&binder_lock);
-	binder_stats_created(BINDER_STAT_PROC);
-	hlist_add_head(&proc->proc_node, &binder_procs);
 	proc->pid = current->group_leader->pid;
 	INIT_LIST_HEAD(&proc->delivered_death);
 	filp->private_data = proc;
-	mutex_unlock(&binder_lock);
+	binder_stats_created(BINDER_STAT_PROC);
+
+	mutex_lock(&binder_procs_lock);
+	hlist_add_head(&proc->proc_node, &binder_procs);
+	mutex_unlock(&binder_procs_lock);
 
 	if (binder_debugfs_dir_entry_proc) {
 		char strbuf[11];
@@ -3048,7 +3260,9 @@ static void binder_deferred_release(struct binder_proc *proc)
 	BUG_ON(proc->vma);
 	BUG_ON(proc->files);
 
+	mutex_lock(&binder_procs_lock);
 	hlist_del(&proc->proc_node);
+	mutex_unlock(&binder_procs_lock);
 	if (binder_context_mgr_node && binder_context_mgr_node->proc == proc) {
 		binder_debug(BINDER_DEBUG_DEAD_BINDER,
 			     "binder_release: %d context_mgr_node gone\n",
@@ -3113,6 +3327,8 @@ static void binder_deferred_release(struct binder_proc *proc)
 	binder_release_work(&proc->delivered_death);
 	buffers = 0;
 
+	mutex_lock(&proc->alloc_lock);
+	proc->is_dead = 1;
 	while ((n = rb_first(&proc->allocated_buffers))) {
 		struct binder_buffer *buffer = rb_entry(n, struct binder_buffer,
 							rb_node);
@@ -3152,6 +3368,7 @@ static void binder_deferred_release(struct binder_proc *proc)
 		kfree(proc->pages);
 		vfree(proc->buffer);
 	}
+	mutex_unlock(&proc->alloc_lock);
 
 	put_task_struct(proc->tsk);
 
@@ -3162,7 +3379,9 @@ static void binder_deferred_release(struct binder_proc *proc)
 		     proc->pid, threads, nodes, incoming_refs, outgoing_refs,
 		     active_transactions, buffers, page_count);
 
-	kfree(proc);
+	/* else freed by the last binder_proc_dec_tmpref() */
+	if (!proc->tmp_ref)
+		kfree(proc);
 }
 
 static void binder_deferred_func(struct work_struct *work)
@@ -3380,9 +3599,11 @@ static void print_binder_proc(struct seq_file *m,
 			print_binder_ref(m, rb_entry(n, struct binder_ref,
 						     rb_node_desc));
 	}
+	mutex_lock(&proc->alloc_lock);
 	for (n = rb_first(&proc->allocated_buffers); n != NULL; n = rb_next(n))
 		print_binder_buffer(m, "  buffer",
 				    rb_entry(n, struct binder_buffer, rb_node));
+	mutex_unlock(&proc->alloc_lock);
 	list_for_each_entry(w, &proc->todo, entry)
 		print_binder_work(m, "  ", "  pending transaction", w);
 	list_for_each_entry(w, &proc->delivered_death, entry) {
@@ -3452,17 +3673,21 @@ static void print_binder_stats(struct seq_file *m, const char *prefix,
 	BUILD_BUG_ON(ARRAY_SIZE(stats->bc) !=
 		     ARRAY_SIZE(binder_command_strings));
 	for (i = 0; i < ARRAY_SIZE(stats->bc); i++) {
-		if (stats->bc[i])
+		int temp = atomic_read(&stats->bc[i]);
+
+		if (temp)
 			seq_printf(m, "%s%s: %d\n", prefix,
-				   binder_command_strings[i], stats->bc[i]);
+				   binder_command_strings[i], temp);
 	}
 
 	BUILD_BUG_ON(ARRAY_SIZE(stats->br) !=
 		     ARRAY_SIZE(binder_return_strings));
 	for (i = 0; i < ARRAY_SIZE(stats->br); i++) {
-		if (stats->br[i])
+		int temp = atomic_read(&stats->br[i]);
+
+		if (temp)
 			seq_printf(m, "%s%s: %d\n", prefix,
-				   binder_return_strings[i], stats->br[i]);
+				   binder_return_strings[i], temp);
 	}
 
 	BUILD_BUG_ON(ARRAY_SIZE(stats->obj_created) !=
@@ -3470,12 +3695,31 @@ static void print_binder_stats(struct seq_file *m, const char *prefix,
 	BUILD_BUG_ON(ARRAY_SIZE(stats->obj_created) !=
 		     ARRAY_SIZE(stats->obj_deleted));
 	for (i = 0; i < ARRAY_SIZE(stats->obj_created); i++) {
-		if (stats->obj_created[i] || stats->obj_deleted[i])
+		int created = atomic_read(&stats->obj_created[i]);
+		int deleted = atomic_read(&stats->obj_deleted[i]);
+
+		if (created || deleted)
 			seq_printf(m, "%s%s: active %d total %d\n", prefix,
 				binder_objstat_strings[i],
-				stats->obj_created[i] - stats->obj_deleted[i],
-				stats->obj_created[i]);
+				created - deleted, created);
+	}
+}
+
+static void print_binder_latency(struct seq_file *m, const char *name,
+				 struct binder_latency *lat)
+{
+	int i;
+
+	seq_printf(m, "  %s latency (us):", name);
+	for (i = 0; i < BINDER_LATENCY_BUCKETS; i++) {
+		if (!lat->count[i])
+			continue;
+		if (i == BINDER_LATENCY_BUCKETS - 1)
+			seq_printf(m, " >=%u:%u", 1U << (i - 1), lat->count[i]);
+		else
+			seq_printf(m, " <%u:%u", 1U << i, lat->count[i]);
 	}
+	seq_puts(m, "\n");
 }
 
 static void print_binder_proc_stats(struct seq_file *m,
@@ -3484,17 +3728,25 @@ static void print_binder_proc_stats(struct seq_file *m,
 	struct binder_work *w;
 	struct rb_node *n;
 	int count, strong, weak;
+	size_t free_async_space;
+	int pages_retained;
+	struct binder_latency alloc_latency;
 
 	seq_printf(m, "proc %d\n", proc->pid);
 	count = 0;
 	for (n = rb_first(&proc->threads); n != NULL; n = rb_next(n))
 		count++;
+	mutex_lock(&proc->alloc_lock);
+	free_async_space = proc->free_async_space;
+	pages_retained = proc->pages_retained;
+	alloc_latency = proc->alloc_latency;
+	mutex_unlock(&proc->alloc_lock);
 	seq_printf(m, "  threads: %d\n", count);
 	seq_printf(m, "  requested threads: %d+%d/%d\n"
 			"  ready threads %d\n"
 			"  free async space %zd\n", proc->requested_threads,
 			proc->requested_threads_started, proc->max_threads,
-			proc->ready_threads, proc->free_async_space);
+			proc->ready_threads, free_async_space);
 	count = 0;
 	for (n = rb_first(&proc->nodes); n != NULL; n = rb_next(n))
 		count++;
@@ -3512,9 +3764,12 @@ static void print_binder_proc_stats(struct seq_file *m,
 	seq_printf(m, "  refs: %d s %d w %d\n", count, strong, weak);
 
 	count = 0;
+	mutex_lock(&proc->alloc_lock);
 	for (n = rb_first(&proc->allocated_buffers); n != NULL; n = rb_next(n))
 		count++;
+	mutex_unlock(&proc->alloc_lock);
 	seq_printf(m, "  buffers: %d\n", count);
+	seq_printf(m, "  retained pages: %d\n", pages_retained);
 
 	count = 0;
 	list_for_each_entry(w, &proc->todo, entry) {
@@ -3529,6 +3784,8 @@ static void print_binder_proc_stats(struct seq_file *m,
 	seq_printf(m, "  pending transactions: %d\n", count);
 
 	print_binder_stats(m, "  ", &proc->stats);
+	print_binder_latency(m, "alloc", &alloc_latency);
+	print_binder_latency(m, "transaction", &proc->transaction_latency);
 }
 
 
@@ -3549,8 +3806,10 @@ static int binder_state_show(struct seq_file *m, void *unused)
 	hlist_for_each_entry(node, pos, &binder_dead_nodes, dead_node)
 		print_binder_node(m, node);
 
+	mutex_lock(&binder_procs_lock);
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
 		print_binder_proc(m, proc, 1);
+	mutex_unlock(&binder_procs_lock);
 	if (do_lock)
 		mutex_unlock(&binder_lock);
 	return 0;
@@ -3569,8 +3828,10 @@ static int binder_stats_show(struct seq_file *m, void *unused)
 
 	print_binder_stats(m, "", &binder_stats);
 
+	mutex_lock(&binder_procs_lock);
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
 		print_binder_proc_stats(m, proc);
+	mutex_unlock(&binder_procs_lock);
 	if (do_lock)
 		mutex_unlock(&binder_lock);
 	return 0;
@@ -3586,8 +3847,10 @@ static int binder_transactions_show(struct seq_file *m, void *unused)
 		mutex_lock(&binder_lock);
 
 	seq_puts(m, "binder transactions:\n");
+	mutex_lock(&binder_procs_lock);
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
 		print_binder_proc(m, proc, 0);
+	mutex_unlock(&binder_procs_lock);
 	if (do_lock)
 		mutex_unlock(&binder_lock);
 	return 0;
@@ -3623,12 +3886,14 @@ static int binder_transaction_log_show(struct seq_file *m, void *unused)
 	struct binder_transaction_log *log = m->private;
 	int i;
 
+	spin_lock(&log->lock);
 	if (log->full) {
 		for (i = log->next; i < ARRAY_SIZE(log->entry); i++)
 			print_binder_transaction_log_entry(m, &log->entry[i]);
 	}
 	for (i = 0; i < log->next; i++)
 		print_binder_transaction_log_entry(m, &log->entry[i]);
+	spin_unlock(&log->lock);
 	return 0;
 }
 
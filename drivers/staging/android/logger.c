@@ -21,9 +21,13 @@
 #include <linux/module.h>
 #include <linux/fs.h>
 #include <linux/miscdevice.h>
+#include <linux/mm.h>
 #include <linux/uaccess.h>
 #include <linux/poll.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
 #include <linux/time.h>
+#include <linux/vmalloc.h>
 #include "logger.h"
 
 #include <asm/ioctls.h>
@@ -33,34 +37,57 @@
  *
  * This structure lives from module insertion until module removal, so it does
  * not need additional reference counting. The structure is protected by the
- * mutex 'mutex'.
+ * spinlock 'lock'.
+ *
+ * Writers only hold the lock to reserve space for their entry and to write its
+ * header; the payload is copied from user space after dropping it. Entries
+ * between c_off and w_off are not visible to readers yet. Each of them is
+ * marked pending in its header until its writer is done, and c_off moves
+ * over the finished entries at its front as writers commit.
  */
 struct logger_log {
 	unsigned char 		*buffer;/* the ring buffer itself */
 	struct miscdevice	misc;	/* misc device representing the log */
 	wait_queue_head_t	wq;	/* wait queue for readers */
+	wait_queue_head_t	commit_wq; /* writers waiting for space */
 	struct list_head	readers; /* this log's readers */
-	struct mutex		mutex;	/* mutex protecting buffer */
+	spinlock_t		lock;	/* lock protecting buffer */
 	size_t			w_off;	/* current write head offset */
+	size_t			c_off;	/* end of complete entries */
 	size_t			head;	/* new readers start here */
 	size_t			size;	/* size of the log */
+	u64			w_pos;	/* w_off, c_off and head as */
+	u64			c_pos;	/* positions in the stream, */
+	u64			head_pos; /* for mmap readers */
+	struct logger_mmap_header *mmap; /* first page of mmap */
 };
 
 /*
  * struct logger_reader - a logging device open for reading
  *
  * This object lives from open to release, so we don't need additional
- * reference counting. The structure is protected by log->mutex.
+ * reference counting. r_off is protected by log->lock, buf by 'mutex'.
  */
 struct logger_reader {
 	struct logger_log	*log;	/* associated log */
 	struct list_head	list;	/* entry in logger_log's list */
 	size_t			r_off;	/* current read head offset */
+	struct mutex		mutex;	/* serializes reads */
+	unsigned char		*buf;	/* entry being copied to the user */
+	int			batch;	/* read() as many entries as fit */
 };
 
 /* logger_offset - returns index 'n' into the log via (optimized) modulus */
 #define logger_offset(n)	((n) & (log->size - 1))
 
+/*
+ * The padding of an entry's header in the ring holds its commit state:
+ * LOGGER_ENTRY_PENDING while the writer is copying the payload, 0 once it is
+ * done. Readers only ever see committed entries.
+ */
+#define LOGGER_ENTRY_STATE_OFF	offsetof(struct logger_entry, __pad)
+#define LOGGER_ENTRY_PENDING	1
+
 /*
  * file_get_log - Given a file structure, return the associated log
  *
@@ -88,7 +115,7 @@ static inline struct logger_log *file_get_log(struct file *file)
  * get_entry_len - Grabs the length of the payload of the next entry starting
  * from 'off'.
  *
- * Caller needs to hold log->mutex.
+ * Caller needs to hold log->lock.
  */
 static __u32 get_entry_len(struct logger_log *log, size_t off)
 {
@@ -107,15 +134,14 @@ static __u32 get_entry_len(struct logger_log *log, size_t off)
 }
 
 /*
- * do_read_log_to_user - reads exactly 'count' bytes from 'log' into the
- * user-space buffer 'buf'. Returns 'count' on success.
+ * do_read_log - reads exactly 'count' bytes from 'log' into the reader's
+ * buffer. The entry is copied out under the lock, so that no writer can
+ * overwrite it while it is being copied to user space.
  *
- * Caller must hold log->mutex.
+ * Caller must hold log->lock.
  */
-static ssize_t do_read_log_to_user(struct logger_log *log,
-				   struct logger_reader *reader,
-				   char __user *buf,
-				   size_t count)
+static void do_read_log(struct logger_log *log, struct logger_reader *reader,
+			size_t count)
 {
 	size_t len;
 
@@ -125,20 +151,16 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 	 * the log, whichever comes first.
 	 */
 	len = min(count, log->size - reader->r_off);
-	if (copy_to_user(buf, log->buffer + reader->r_off, len))
-		return -EFAULT;
+	memcpy(reader->buf, log->buffer + reader->r_off, len);
 
 	/*
 	 * Second, we read any remaining bytes, starting back at the head of
 	 * the log.
 	 */
 	if (count != len)
-		if (copy_to_user(buf + len, log->buffer, count - len))
-			return -EFAULT;
+		memcpy(reader->buf + len, log->buffer, count - len);
 
 	reader->r_off = logger_offset(reader->r_off + count);
-
-	return count;
 }
 
 /*
@@ -149,9 +171,11 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
  * 	- O_NONBLOCK works
  * 	- If there are no log entries to read, blocks until log is written to
  * 	- Atomically reads exactly one log entry
+ * 	- After LOGGER_SET_BATCH_READ, reads as many whole entries as fit
  *
- * Optimal read size is LOGGER_ENTRY_MAX_LEN. Will set errno to EINVAL if read
- * buffer is insufficient to hold next entry.
+ * Optimal read size is LOGGER_ENTRY_MAX_LEN, or a multiple of it in batch
+ * mode. Will set errno to EINVAL if read buffer is insufficient to hold next
+ * entry.
  */
 static ssize_t logger_read(struct file *file, char __user *buf,
 			   size_t count, loff_t *pos)
@@ -159,15 +183,17 @@ static ssize_t logger_read(struct file *file, char __user *buf,
 	struct logger_reader *reader = file->private_data;
 	struct logger_log *log = reader->log;
 	ssize_t ret;
+	size_t len;
+	size_t done = 0;
 	DEFINE_WAIT(wait);
 
 start:
 	while (1) {
 		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
-		mutex_lock(&log->mutex);
-		ret = (log->w_off == reader->r_off);
-		mutex_unlock(&log->mutex);
+		spin_lock(&log->lock);
+		ret = (log->c_off == reader->r_off);
+		spin_unlock(&log->lock);
 		if (!ret)
 			break;
 
@@ -188,26 +214,54 @@ start:
 	if (ret)
 		return ret;
 
-	mutex_lock(&log->mutex);
+	mutex_lock(&reader->mutex);
+	spin_lock(&log->lock);
 
 	/* is there still something to read or did we race? */
-	if (unlikely(log->w_off == reader->r_off)) {
-		mutex_unlock(&log->mutex);
+	if (unlikely(log->c_off == reader->r_off)) {
+		spin_unlock(&log->lock);
+		mutex_unlock(&reader->mutex);
 		goto start;
 	}
 
 	/* get the size of the next entry */
-	ret = get_entry_len(log, reader->r_off);
-	if (count < ret) {
+	len = get_entry_len(log, reader->r_off);
+	if (count < len) {
+		spin_unlock(&log->lock);
 		ret = -EINVAL;
 		goto out;
 	}
 
-	/* get exactly one entry from the log */
-	ret = do_read_log_to_user(log, reader, buf, ret);
+	while (1) {
+		/* get exactly one entry from the log */
+		do_read_log(log, reader, len);
+		spin_unlock(&log->lock);
+
+		if (copy_to_user(buf + done, reader->buf, len)) {
+			ret = done ? done : -EFAULT;
+			goto out;
+		}
+		done += len;
+
+		if (!reader->batch)
+			break;
+
+		/* keep going while whole entries fit, without blocking */
+		spin_lock(&log->lock);
+		if (log->c_off == reader->r_off) {
+			spin_unlock(&log->lock);
+			break;
+		}
+		len = get_entry_len(log, reader->r_off);
+		if (count - done < len) {
+			spin_unlock(&log->lock);
+			break;
+		}
+	}
+	ret = done;
 
 out:
-	mutex_unlock(&log->mutex);
+	mutex_unlock(&reader->mutex);
 
 	return ret;
 }
@@ -216,7 +270,7 @@ out:
  * get_next_entry - return the offset of the first valid entry at least 'len'
  * bytes after 'off'.
  *
- * Caller must hold log->mutex.
+ * Caller must hold log->lock.
  */
 static size_t get_next_entry(struct logger_log *log, size_t off, size_t len)
 {
@@ -254,7 +308,7 @@ static inline int clock_interval(size_t a, size_t b, size_t c)
  * We do this by "pulling forward" the readers and start head to the first
  * entry after the new write head.
  *
- * The caller needs to hold log->mutex.
+ * The caller needs to hold log->lock.
  */
 static void fix_up_readers(struct logger_log *log, size_t len)
 {
@@ -262,8 +316,12 @@ static void fix_up_readers(struct logger_log *log, size_t len)
 	size_t new = logger_offset(old + len);
 	struct logger_reader *reader;
 
-	if (clock_interval(old, new, log->head))
-		log->head = get_next_entry(log, log->head, len);
+	if (clock_interval(old, new, log->head)) {
+		size_t head = get_next_entry(log, log->head, len);
+
+		log->head_pos += logger_offset(head - log->head);
+		log->head = head;
+	}
 
 	list_for_each_entry(reader, &log->readers, list)
 		if (clock_interval(old, new, reader->r_off))
@@ -271,50 +329,190 @@ static void fix_up_readers(struct logger_log *log, size_t len)
 }
 
 /*
- * do_write_log - writes 'len' bytes from 'buf' to 'log'
+ * do_write_log - writes 'len' bytes from 'buf' to 'log' at offset 'off'
  *
- * The caller needs to hold log->mutex.
+ * The caller needs to own the space, either by holding log->lock or by having
+ * reserved it with logger_reserve().
  */
-static void do_write_log(struct logger_log *log, const void *buf, size_t count)
+static void do_write_log(struct logger_log *log, size_t off, const void *buf,
+			 size_t count)
 {
 	size_t len;
 
-	len = min(count, log->size - log->w_off);
-	memcpy(log->buffer + log->w_off, buf, len);
+	len = min(count, log->size - off);
+	memcpy(log->buffer + off, buf, len);
 
 	if (count != len)
 		memcpy(log->buffer, buf + len, count - len);
+}
+
+/*
+ * get_entry_state - returns the commit state of the entry starting at 'off'
+ *
+ * Caller needs to hold log->lock.
+ */
+static __u16 get_entry_state(struct logger_log *log, size_t off)
+{
+	__u16 val;
+	size_t len;
+
+	off = logger_offset(off + LOGGER_ENTRY_STATE_OFF);
+	len = min(sizeof(val), log->size - off);
+	memcpy(&val, log->buffer + off, len);
+
+	if (len != sizeof(val))
+		memcpy(((char *) &val) + len, log->buffer, sizeof(val) - len);
+
+	return val;
+}
+
+/*
+ * set_entry_state - sets the commit state of the entry starting at 'off'
+ *
+ * Caller needs to hold log->lock.
+ */
+static void set_entry_state(struct logger_log *log, size_t off, __u16 state)
+{
+	do_write_log(log, logger_offset(off + LOGGER_ENTRY_STATE_OFF), &state,
+		     sizeof(state));
+}
+
+/*
+ * do_clear_log - zeroes 'count' bytes of 'log' starting at offset 'off'
+ *
+ * Used to blank the rest of an entry whose payload could not be copied, as
+ * the space cannot be given back once other writers have reserved past it.
+ */
+static void do_clear_log(struct logger_log *log, size_t off, size_t count)
+{
+	size_t len;
 
-	log->w_off = logger_offset(log->w_off + count);
+	len = min(count, log->size - off);
+	memset(log->buffer + off, 0, len);
 
+	if (count != len)
+		memset(log->buffer, 0, count - len);
 }
 
 /*
  * do_write_log_user - writes 'len' bytes from the user-space buffer 'buf' to
- * the log 'log'
+ * the log 'log' at offset 'off'
  *
- * The caller needs to hold log->mutex.
+ * The caller needs to have reserved the space with logger_reserve().
  *
  * Returns 'count' on success, negative error code on failure.
  */
-static ssize_t do_write_log_from_user(struct logger_log *log,
+static ssize_t do_write_log_from_user(struct logger_log *log, size_t off,
 				      const void __user *buf, size_t count)
 {
 	size_t len;
 
-	len = min(count, log->size - log->w_off);
-	if (len && copy_from_user(log->buffer + log->w_off, buf, len))
+	len = min(count, log->size - off);
+	if (len && copy_from_user(log->buffer + off, buf, len))
 		return -EFAULT;
 
 	if (count != len)
 		if (copy_from_user(log->buffer, buf + len, count - len))
 			return -EFAULT;
 
-	log->w_off = logger_offset(log->w_off + count);
-
 	return count;
 }
 
+/*
+ * logger_publish - updates the positions seen by mmap readers
+ *
+ * The caller needs to hold log->lock.
+ */
+static void logger_publish(struct logger_log *log)
+{
+	struct logger_mmap_header *hdr = log->mmap;
+
+	hdr->seq++;
+	smp_wmb();
+	hdr->head = log->head_pos;
+	hdr->tail = log->c_pos;
+	smp_wmb();
+	hdr->seq++;
+}
+
+/* logger_in_flight - bytes reserved by writers that have not finished yet */
+static inline size_t logger_in_flight(struct logger_log *log)
+{
+	return logger_offset(log->w_off - log->c_off);
+}
+
+/*
+ * logger_reserve - reserves space for an entry of 'len' bytes and writes its
+ * header, marked pending. Returns the offset of the entry.
+ *
+ * Waits if the new entry would lap entries that are still being written.
+ * Such entries cannot be overwritten, and readers could not be fixed up past
+ * them, as their headers may be clobbered by the writer's payload copy.
+ */
+static size_t logger_reserve(struct logger_log *log,
+			     struct logger_entry *header, size_t len)
+{
+	size_t off;
+
+	spin_lock(&log->lock);
+	while (logger_in_flight(log) + len >= log->size) {
+		spin_unlock(&log->lock);
+		wait_event(log->commit_wq,
+			   logger_in_flight(log) + len < log->size);
+		spin_lock(&log->lock);
+	}
+
+	/*
+	 * Fix up any readers, pulling them forward to the first readable
+	 * entry after (what will be) the new write offset. We do this now
+	 * because the entries in the reserved space are about to be
+	 * clobbered.
+	 */
+	fix_up_readers(log, len);
+	/* mmap readers must see the new head before the data is clobbered */
+	logger_publish(log);
+
+	off = log->w_off;
+	log->w_off = logger_offset(off + len);
+	log->w_pos += len;
+
+	/* readers walk entries by their headers, so write it right away */
+	header->__pad = LOGGER_ENTRY_PENDING;
+	do_write_log(log, off, header, sizeof(struct logger_entry));
+
+	spin_unlock(&log->lock);
+
+	return off;
+}
+
+/*
+ * logger_commit - marks the entry at 'off' as complete, and makes every
+ * complete entry that is not preceded by a pending one visible to readers.
+ */
+static void logger_commit(struct logger_log *log, size_t off)
+{
+	size_t len;
+	int done = 0;
+
+	spin_lock(&log->lock);
+	set_entry_state(log, off, 0);
+	while (log->c_off != log->w_off && !get_entry_state(log, log->c_off)) {
+		len = get_entry_len(log, log->c_off);
+		log->c_off = logger_offset(log->c_off + len);
+		log->c_pos += len;
+		done = 1;
+	}
+	if (done)
+		logger_publish(log);
+	spin_unlock(&log->lock);
+
+	if (done) {
+		/* wake up any blocked readers and writers */
+		wake_up_interruptible(&log->wq);
+		wake_up(&log->commit_wq);
+	}
+}
+
 /*
  * logger_aio_write - our write method, implementing support for write(),
  * writev(), and aio_write(). Writes are our fast path, and we try to optimize
@@ -324,8 +522,8 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
 	struct logger_entry header;
+	size_t entry, off;
 	struct timespec now;
 	ssize_t ret = 0;
 
@@ -341,17 +539,9 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 	if (unlikely(!header.len))
 		return 0;
 
-	mutex_lock(&log->mutex);
-
-	/*
-	 * Fix up any readers, pulling them forward to the first readable
-	 * entry after (what will be) the new write offset. We do this now
-	 * because if we partially fail, we can end up with clobbered log
-	 * entries that encroach on readable buffer.
-	 */
-	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
-
-	do_write_log(log, &header, sizeof(struct logger_entry));
+	entry = logger_reserve(log, &header,
+			       sizeof(struct logger_entry) + header.len);
+	off = logger_offset(entry + sizeof(struct logger_entry));
 
 	while (nr_segs-- > 0) {
 		size_t len;
@@ -361,21 +551,19 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 		len = min_t(size_t, iov->iov_len, header.len - ret);
 
 		/* write out this segment's payload */
-		nr = do_write_log_from_user(log, iov->iov_base, len);
+		nr = do_write_log_from_user(log, off, iov->iov_base, len);
 		if (unlikely(nr < 0)) {
-			log->w_off = orig;
-			mutex_unlock(&log->mutex);
-			return nr;
+			do_clear_log(log, off, header.len - ret);
+			ret = nr;
+			break;
 		}
 
+		off = logger_offset(off + nr);
 		iov++;
 		ret += nr;
 	}
 
-	mutex_unlock(&log->mutex);
-
-	/* wake up any blocked readers */
-	wake_up_interruptible(&log->wq);
+	logger_commit(log, entry);
 
 	return ret;
 }
@@ -407,13 +595,21 @@ static int logger_open(struct inode *inode, struct file *file)
 		if (!reader)
 			return -ENOMEM;
 
+		reader->buf = kmalloc(LOGGER_ENTRY_MAX_LEN, GFP_KERNEL);
+		if (!reader->buf) {
+			kfree(reader);
+			return -ENOMEM;
+		}
+
 		reader->log = log;
 		INIT_LIST_HEAD(&reader->list);
+		mutex_init(&reader->mutex);
+		reader->batch = 0;
 
-		mutex_lock(&log->mutex);
+		spin_lock(&log->lock);
 		reader->r_off = log->head;
 		list_add_tail(&reader->list, &log->readers);
-		mutex_unlock(&log->mutex);
+		spin_unlock(&log->lock);
 
 		file->private_data = reader;
 	} else
@@ -431,7 +627,12 @@ static int logger_release(struct inode *ignored, struct file *file)
 {
 	if (file->f_mode & FMODE_READ) {
 		struct logger_reader *reader = file->private_data;
+		struct logger_log *log = reader->log;
+
+		spin_lock(&log->lock);
 		list_del(&reader->list);
+		spin_unlock(&log->lock);
+		kfree(reader->buf);
 		kfree(reader);
 	}
 
@@ -461,21 +662,43 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 
 	poll_wait(file, &log->wq, wait);
 
-	mutex_lock(&log->mutex);
-	if (log->w_off != reader->r_off)
+	spin_lock(&log->lock);
+	if (log->c_off != reader->r_off)
 		ret |= POLLIN | POLLRDNORM;
-	mutex_unlock(&log->mutex);
+	spin_unlock(&log->lock);
 
 	return ret;
 }
 
+/*
+ * logger_mmap - the log's mmap file operation
+ *
+ * Maps the log read-only: one page holding a struct logger_mmap_header,
+ * followed by the ring buffer. This lets a reader drain the whole log without
+ * a syscall per entry. Both live in one vmalloc_user() area, so the mapping is
+ * correct whether the logger is built in or a module.
+ */
+static int logger_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct logger_log *log = file_get_log(file);
+	unsigned long size = vma->vm_end - vma->vm_start;
+
+	if (vma->vm_pgoff || size != PAGE_SIZE + log->size)
+		return -EINVAL;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	return remap_vmalloc_range(vma, log->mmap, 0);
+}
+
 static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
 	struct logger_log *log = file_get_log(file);
 	struct logger_reader *reader;
 	long ret = -ENOTTY;
 
-	mutex_lock(&log->mutex);
+	spin_lock(&log->lock);
 
 	switch (cmd) {
 	case LOGGER_GET_LOG_BUF_SIZE:
@@ -487,10 +710,10 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off >= reader->r_off)
-			ret = log->w_off - reader->r_off;
+		if (log->c_off >= reader->r_off)
+			ret = log->c_off - reader->r_off;
 		else
-			ret = (log->size - reader->r_off) + log->w_off;
+			ret = (log->size - reader->r_off) + log->c_off;
 		break;
 	case LOGGER_GET_NEXT_ENTRY_LEN:
 		if (!(file->f_mode & FMODE_READ)) {
@@ -498,7 +721,7 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off != reader->r_off)
+		if (log->c_off != reader->r_off)
 			ret = get_entry_len(log, reader->r_off);
 		else
 			ret = 0;
@@ -509,13 +732,24 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		list_for_each_entry(reader, &log->readers, list)
-			reader->r_off = log->w_off;
-		log->head = log->w_off;
+			reader->r_off = log->c_off;
+		log->head = log->c_off;
+		log->head_pos = log->c_pos;
+		logger_publish(log);
+		ret = 0;
+		break;
+	case LOGGER_SET_BATCH_READ:
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		reader = file->private_data;
+		reader->batch = !!arg;
 		ret = 0;
 		break;
 	}
 
-	mutex_unlock(&log->mutex);
+	spin_unlock(&log->lock);
 
 	return ret;
 }
@@ -525,6 +759,7 @@ static const struct file_operations logger_fops = {
 	.read = logger_read,
 	.aio_write = logger_aio_write,
 	.poll = logger_poll,
+	.mmap = logger_mmap,
 	.unlocked_ioctl = logger_ioctl,
 	.compat_ioctl = logger_ioctl,
 	.open = logger_open,
@@ -533,13 +768,12 @@ static const struct file_operations logger_fops = {
 
 /*
  * Defines a log structure with name 'NAME' and a size of 'SIZE' bytes, which
- * must be a power of two, greater than LOGGER_ENTRY_MAX_LEN, and less than
- * LONG_MAX minus LOGGER_ENTRY_MAX_LEN.
+ * must be a power of two, greater than LOGGER_ENTRY_MAX_LEN and PAGE_SIZE, and
+ * less than LONG_MAX minus LOGGER_ENTRY_MAX_LEN. The buffer is allocated by
+ * init_log().
  */
 #define DEFINE_LOGGER_DEVICE(VAR, NAME, SIZE) \
-static unsigned char _buf_ ## VAR[SIZE]; \
 static struct logger_log VAR = { \
-	.buffer = _buf_ ## VAR, \
 	.misc = { \
 		.minor = MISC_DYNAMIC_MINOR, \
 		.name = NAME, \
@@ -547,9 +781,11 @@ static struct logger_log VAR = { \
 		.parent = NULL, \
 	}, \
 	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .wq), \
+	.commit_wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .commit_wq), \
 	.readers = LIST_HEAD_INIT(VAR .readers), \
-	.mutex = __MUTEX_INITIALIZER(VAR .mutex), \
+	.lock = __SPIN_LOCK_UNLOCKED(VAR .lock), \
 	.w_off = 0, \
+	.c_off = 0, \
 	.head = 0, \
 	.size = SIZE, \
 };
@@ -574,12 +810,22 @@ static struct logger_log *get_log_from_minor(int minor)
 
 static int __init init_log(struct logger_log *log)
 {
+	void *area;
 	int ret;
 
+	/* the mmap header page and the ring buffer, mapped as one */
+	area = vmalloc_user(PAGE_SIZE + log->size);
+	if (unlikely(!area))
+		return -ENOMEM;
+	log->mmap = area;
+	log->mmap->size = log->size;
+	log->buffer = area + PAGE_SIZE;
+
 	ret = misc_register(&log->misc);
 	if (unlikely(ret)) {
 		printk(KERN_ERR "logger: failed to register misc "
 		       "device for log '%s'!\n", log->misc.name);
+		vfree(area);
 		return ret;
 	}
 
@@ -30,6 +30,21 @@ struct logger_entry {
 	char		msg[0];	/* the entry's payload */
 };
 
+/*
+ * The first page of a read-only mmap() of a log. It is followed by the ring
+ * buffer itself. Positions count bytes ever written, so an entry at position
+ * 'pos' is at offset (pos & (size - 1)) into the ring. Entries from 'head' up
+ * to 'tail' are complete. Data before 'head' may be overwritten at any time,
+ * so a reader must check 'head' again after copying entries out of the ring.
+ * 'seq' is odd while the positions are being updated.
+ */
+struct logger_mmap_header {
+	__u32		seq;
+	__u32		size;	/* size of the ring buffer */
+	__u64		head;	/* position of the oldest entry */
+	__u64		tail;	/* end of the complete entries */
+};
+
 #define LOGGER_LOG_RADIO	"log_radio"	/* radio-related messages */
 #define LOGGER_LOG_EVENTS	"log_events"	/* system/hardware events */
 #define LOGGER_LOG_SYSTEM	"log_system"	/* system/framework messages */
@@ -45,5 +60,6 @@ struct logger_entry {
 #define LOGGER_GET_LOG_LEN		_IO(__LOGGERIO, 2) /* used log len */
 #define LOGGER_GET_NEXT_ENTRY_LEN	_IO(__LOGGERIO, 3) /* next entry len */
 #define LOGGER_FLUSH_LOG		_IO(__LOGGERIO, 4) /* flush log */
+#define LOGGER_SET_BATCH_READ		_IO(__LOGGERIO, 5) /* read() many */
 
 #endif /* _LINUX_LOGGER_H */
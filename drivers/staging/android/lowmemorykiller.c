@@ -12,6 +12,17 @@
  * and kill processes with a oom_adj value of 0 or higher when the free memory
  * drops below 1024 pages.
  *
+ * By default one process is killed per shrinker call. Setting
+ * /sys/module/lowmemorykiller/parameters/kill_batch to N lets a single call
+ * kill up to N processes, until the memory they use would bring free memory
+ * back above the threshold that was crossed.
+ *
+ * /dev/lowmemorykiller reports the pressure level, the number of minfree
+ * thresholds that free memory is below, as an int on read(). It polls
+ * readable when the level changes, in either direction. The thresholds used
+ * for it are raised by notify_margin percent so that user space can release
+ * memory before processes get killed.
+ *
  * The driver considers memory used for caches to be free, but if a large
  * percentage of the cached memory is locked this can be very inaccurate
  * and processes may not get killed until the normal oom killer is triggered.
@@ -31,12 +42,22 @@
 
 #include <linux/module.h>
 #include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/miscdevice.h>
 #include <linux/mm.h>
 #include <linux/oom.h>
+#include <linux/poll.h>
 #include <linux/sched.h>
-#include <linux/rcupdate.h>
+#include <linux/rculist.h>
 #include <linux/notifier.h>
+#include <linux/spinlock.h>
 #include <linux/swap.h>
+#include <linux/uaccess.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+
+#define CREATE_TRACE_POINTS
+#include <trace/events/lowmemorykiller.h>
 
 #define SEC_ADJUST_LMK
 
@@ -60,36 +81,278 @@ static int lowmem_minfree_size = 4;
 
 static unsigned long lowmem_deathpending_timeout;
 
+/* Kill up to this many processes per pass to get back above minfree */
+static int lowmem_kill_batch = 1;
+
+static int lowmem_notify_margin = 25;	/* percent */
+static DEFINE_SPINLOCK(lowmem_pressure_lock);
+static DECLARE_WAIT_QUEUE_HEAD(lowmem_pressure_wait);
+static int lowmem_pressure_level;
+static unsigned int lowmem_pressure_seq;	/* bumped on level change */
+
+static void lowmem_pressure_recheck(struct work_struct *work);
+static DECLARE_DELAYED_WORK(lowmem_pressure_work, lowmem_pressure_recheck);
+#define LOWMEM_PRESSURE_RECHECK	(HZ / 2)
+
 #define lowmem_print(level, x...)			\
 	do {						\
 		if (lowmem_debug_level >= (level))	\
 			printk(x);			\
 	} while (0)
 
-static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask)
+/*
+ * Thread group leaders are kept on one list per oom_adj value so that
+ * the shrinker only looks at processes it may kill, starting with the
+ * most expendable ones, instead of walking every task in the system.
+ *
+ * The lists are changed under lowmem_adj_lock and walked under RCU.
+ * lowmem_adj_lock nests inside tasklist_lock, which is read-locked from
+ * interrupts, so it must always be taken with interrupts disabled.
+ * A reader may follow a task that changes oom_adj onto another list,
+ * so the walk checks each task's oom_adj rather than trusting the list.
+ */
+static DEFINE_SPINLOCK(lowmem_adj_lock);
+static struct hlist_head lowmem_adj_buckets[OOM_ADJUST_MAX - OOM_DISABLE + 1];
+
+/* Last process killed, until it is reaped; protected by lowmem_adj_lock */
+static struct task_struct *lowmem_deathpending;
+static ktime_t lowmem_deathpending_start;
+
+static struct hlist_head *lowmem_adj_bucket(int oom_adj)
+{
+	return &lowmem_adj_buckets[oom_adj - OOM_DISABLE];
+}
+
+void lowmem_adj_add(struct task_struct *p)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&lowmem_adj_lock, flags);
+	hlist_add_head_rcu(&p->lowmem_adj_node,
+			   lowmem_adj_bucket(p->signal->oom_adj));
+	spin_unlock_irqrestore(&lowmem_adj_lock, flags);
+}
+
+void lowmem_adj_del(struct task_struct *p)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&lowmem_adj_lock, flags);
+	hlist_del_init_rcu(&p->lowmem_adj_node);
+	if (p == lowmem_deathpending) {
+		trace_lowmemory_kill_done(p, ktime_us_delta(ktime_get(),
+					  lowmem_deathpending_start));
+		lowmem_deathpending = NULL;
+	}
+	spin_unlock_irqrestore(&lowmem_adj_lock, flags);
+}
+
+/* exec() by a thread other than the leader */
+void lowmem_adj_replace(struct task_struct *old, struct task_struct *new)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&lowmem_adj_lock, flags);
+	hlist_replace_rcu(&old->lowmem_adj_node, &new->lowmem_adj_node);
+	/* mark unhashed, but leave next for readers still on it */
+	old->lowmem_adj_node.pprev = NULL;
+	if (old == lowmem_deathpending)
+		lowmem_deathpending = new;
+	spin_unlock_irqrestore(&lowmem_adj_lock, flags);
+}
+
+void lowmem_adj_update(struct task_struct *task)
+{
+	struct task_struct *p;
+	unsigned long flags;
+
+	rcu_read_lock();
+	spin_lock_irqsave(&lowmem_adj_lock, flags);
+	p = task->group_leader;
+	if (!hlist_unhashed(&p->lowmem_adj_node)) {
+		hlist_del_rcu(&p->lowmem_adj_node);
+		hlist_add_head_rcu(&p->lowmem_adj_node,
+				   lowmem_adj_bucket(p->signal->oom_adj));
+	}
+	spin_unlock_irqrestore(&lowmem_adj_lock, flags);
+	rcu_read_unlock();
+}
+
+static int lowmem_array_size(void)
+{
+	int array_size = ARRAY_SIZE(lowmem_adj);
+
+	if (lowmem_adj_size < array_size)
+		array_size = lowmem_adj_size;
+	if (lowmem_minfree_size < array_size)
+		array_size = lowmem_minfree_size;
+	return array_size;
+}
+
+static void lowmem_get_free(int *other_free, int *other_file)
+{
+	*other_free = global_page_state(NR_FREE_PAGES) - totalreserve_pages;
+#ifdef SEC_ADJUST_LMK
+	*other_file = global_page_state(NR_INACTIVE_FILE) +
+					global_page_state(NR_ACTIVE_FILE);
+#else
+	*other_file = global_page_state(NR_FILE_PAGES) -
+					global_page_state(NR_SHMEM);
+#endif
+}
+
+/*
+ * The pressure level reported through /dev/lowmemorykiller is the number
+ * of minfree thresholds that free memory has dropped below: 0 means no
+ * pressure, lowmem_minfree_size means that the lowest threshold has been
+ * crossed. Each threshold is raised by notify_margin percent, so user
+ * space hears about a level before the shrinker starts killing at it.
+ *
+ * The shrinker stops being called once reclaim is satisfied, so it never
+ * sees pressure going away. While the level is above 0 it is sampled again
+ * every LOWMEM_PRESSURE_RECHECK jiffies from lowmem_pressure_work, which
+ * wakes pollers once free memory is back above the raised thresholds.
+ */
+static void lowmem_update_pressure(int other_free, int other_file,
+				   int array_size)
+{
+	int level = 0;
+	int i;
+
+	for (i = array_size - 1; i >= 0; i--) {
+		int minfree = lowmem_minfree[i] +
+			lowmem_minfree[i] * lowmem_notify_margin / 100;
+#ifdef SEC_ADJUST_LMK
+		if ((other_free + other_file) >= minfree)
+#else
+		if (other_free >= minfree || other_file >= minfree)
+#endif
+			break;
+		level++;
+	}
+
+	spin_lock(&lowmem_pressure_lock);
+	if (level != lowmem_pressure_level) {
+		lowmem_pressure_level = level;
+		lowmem_pressure_seq++;
+		wake_up_interruptible(&lowmem_pressure_wait);
+	}
+	spin_unlock(&lowmem_pressure_lock);
+
+	if (level)
+		schedule_delayed_work(&lowmem_pressure_work,
+				      LOWMEM_PRESSURE_RECHECK);
+}
+
+static void lowmem_pressure_recheck(struct work_struct *work)
+{
+	int other_free;
+	int other_file;
+
+	lowmem_get_free(&other_free, &other_file);
+	lowmem_update_pressure(other_free, other_file, lowmem_array_size());
+}
+
+/*
+ * Find the largest process with the highest oom_adj >= min_adj. Called
+ * under rcu_read_lock(). Returns ERR_PTR(-EBUSY) if an earlier victim is
+ * still dying and the caller should wait for it, unless skip_dying is
+ * set, in which case processes that have been killed already are passed
+ * over instead.
+ */
+static struct task_struct *lowmem_select(int min_adj, bool skip_dying,
+					 struct task_struct **leader,
+					 int *selected_tasksize,
+					 int *selected_oom_adj)
 {
 	struct task_struct *tsk;
 	struct task_struct *selected = NULL;
-	int rem = 0;
+	struct hlist_node *pos;
 	int tasksize;
+	int adj;
+	int nr_scanned = 0;
+	ktime_t scan_start = ktime_get();
+
+	*selected_oom_adj = min_adj;
+	/* The first list with a candidate holds the highest oom_adj */
+	for (adj = OOM_ADJUST_MAX; adj >= max(min_adj, OOM_DISABLE) &&
+	     !selected; adj--) {
+		hlist_for_each_entry_rcu(tsk, pos, lowmem_adj_bucket(adj),
+					 lowmem_adj_node) {
+			struct task_struct *p;
+			int oom_adj;
+
+			nr_scanned++;
+			if (tsk->flags & PF_KTHREAD)
+				continue;
+
+			p = find_lock_task_mm(tsk);
+			if (!p)
+				continue;
+
+			if (skip_dying &&
+			    (test_tsk_thread_flag(p, TIF_MEMDIE) ||
+			     fatal_signal_pending(p))) {
+				task_unlock(p);
+				continue;
+			}
+			if (test_tsk_thread_flag(p, TIF_MEMDIE) &&
+			    time_before_eq(jiffies,
+					   lowmem_deathpending_timeout)) {
+				task_unlock(p);
+				return ERR_PTR(-EBUSY);
+			}
+
+			oom_adj = p->signal->oom_adj;
+			if (oom_adj < min_adj) {
+				task_unlock(p);
+				continue;
+			}
+			tasksize = get_mm_rss(p->mm);
+			task_unlock(p);
+			if (tasksize <= 0)
+				continue;
+			if (selected) {
+				if (oom_adj < *selected_oom_adj)
+					continue;
+				if (oom_adj == *selected_oom_adj &&
+				    tasksize <= *selected_tasksize)
+					continue;
+			}
+			selected = p;
+			*leader = tsk;
+			*selected_tasksize = tasksize;
+			*selected_oom_adj = oom_adj;
+			lowmem_print(2, "select %d (%s), adj %d, size %d, "
+				     "to kill\n", p->pid, p->comm, oom_adj,
+				     tasksize);
+		}
+	}
+	trace_lowmemory_scan(min_adj, nr_scanned,
+			     ktime_us_delta(ktime_get(), scan_start));
+	return selected;
+}
+
+static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask)
+{
+	struct task_struct *selected;
+	struct task_struct *selected_leader = NULL;
+	int rem = 0;
 	int i;
 	int min_adj = OOM_ADJUST_MAX + 1;
+	int minfree = 0;
+	int need;
+	int nr_killed = 0;
 	int selected_tasksize = 0;
 	int selected_oom_adj;
-	int array_size = ARRAY_SIZE(lowmem_adj);
-	int other_free = global_page_state(NR_FREE_PAGES) - totalreserve_pages;
-#ifdef SEC_ADJUST_LMK
-	int other_file = global_page_state(NR_INACTIVE_FILE) +
-						global_page_state(NR_ACTIVE_FILE);
-#else
-	int other_file = global_page_state(NR_FILE_PAGES) -
-						global_page_state(NR_SHMEM);
-#endif
+	int array_size = lowmem_array_size();
+	int other_free;
+	int other_file;
+	unsigned long flags;
+
+	lowmem_get_free(&other_free, &other_file);
+	lowmem_update_pressure(other_free, other_file, array_size);
 
-	if (lowmem_adj_size < array_size)
-		array_size = lowmem_adj_size;
-	if (lowmem_minfree_size < array_size)
-		array_size = lowmem_minfree_size;
 	for (i = 0; i < array_size; i++) {
 #ifdef SEC_ADJUST_LMK
 		if ((other_free + other_file) < lowmem_minfree[i])
@@ -99,6 +362,7 @@ static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask)
 #endif
         {
 			min_adj = lowmem_adj[i];
+			minfree = lowmem_minfree[i];
 			break;
 		}
 	}
@@ -124,68 +388,61 @@ static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask)
 			     nr_to_scan, gfp_mask, rem);
 		return rem;
 	}
-	selected_oom_adj = min_adj;
-
-	rcu_read_lock();
-	for_each_process(tsk) {
-		struct task_struct *p;
-		int oom_adj;
 
-		if (tsk->flags & PF_KTHREAD)
-			continue;
+	if (lowmem_deathpending &&
+	    time_before_eq(jiffies, lowmem_deathpending_timeout))
+		return 0;
 
-		p = find_lock_task_mm(tsk);
-		if (!p)
-			continue;
+	/* pages still missing to get back above minfree */
+#ifdef SEC_ADJUST_LMK
+	need = minfree - (other_free + other_file);
+#else
+	need = minfree - other_free;
+#endif
 
-		if (test_tsk_thread_flag(p, TIF_MEMDIE) &&
-			time_before_eq(jiffies, lowmem_deathpending_timeout)) {
-				task_unlock(p);
-				rcu_read_unlock();
-				return 0;
+	rcu_read_lock();
+	while (nr_killed < max(lowmem_kill_batch, 1)) {
+		selected = lowmem_select(min_adj, nr_killed > 0,
+					 &selected_leader, &selected_tasksize,
+					 &selected_oom_adj);
+		if (IS_ERR(selected)) {
+			rcu_read_unlock();
+			return 0;
 		}
+		if (!selected)
+			break;
 
-		oom_adj = p->signal->oom_adj;
-		if (oom_adj < min_adj) {
-			task_unlock(p);
-			continue;
-		}
-		tasksize = get_mm_rss(p->mm);
-		task_unlock(p);
-		if (tasksize <= 0)
-			continue;
-		if (selected) {
-			if (oom_adj < selected_oom_adj)
-				continue;
-			if (oom_adj == selected_oom_adj &&
-			    tasksize <= selected_tasksize)
-				continue;
-		}
-		selected = p;
-		selected_tasksize = tasksize;
-		selected_oom_adj = oom_adj;
-		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
-			     p->pid, p->comm, oom_adj, tasksize);
-	}
-	if (selected) {
-		
 		if (fatal_signal_pending(selected)) {
 			pr_warning("process %d is suffering a slow death\n",
 				selected->pid);
-			read_unlock(&tasklist_lock);
+			rcu_read_unlock();
 			return rem;
 		}
 
 		lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
 			     selected->pid, selected->comm,
 			     selected_oom_adj, selected_tasksize);
+		trace_lowmemory_kill(selected, selected_oom_adj,
+				     selected_tasksize);
+		spin_lock_irqsave(&lowmem_adj_lock, flags);
+		/* not set if it was reaped already */
+		if (!hlist_unhashed(&selected_leader->lowmem_adj_node)) {
+			lowmem_deathpending = selected_leader;
+			lowmem_deathpending_start = ktime_get();
+		}
+		spin_unlock_irqrestore(&lowmem_adj_lock, flags);
 		lowmem_deathpending_timeout = jiffies + HZ;
 		send_sig(SIGKILL, selected, 0);
 		set_tsk_thread_flag(selected, TIF_MEMDIE);
 		rem -= selected_tasksize;
+		nr_killed++;
+
+		need -= selected_tasksize;
+		if (need <= 0)
+			break;
 	}
 #ifdef SEC_ADJUST_LMK
-	else
+	if (!nr_killed)
 		rem = -1;
 #endif
 
@@ -200,8 +457,72 @@ static struct shrinker lowmem_shrinker = {
 	.seeks = DEFAULT_SEEKS * 16
 };
 
+static int lowmem_pressure_open(struct inode *inode, struct file *file)
+{
+	spin_lock(&lowmem_pressure_lock);
+	file->f_version = lowmem_pressure_seq;
+	spin_unlock(&lowmem_pressure_lock);
+	return nonseekable_open(inode, file);
+}
+
+/* Returns the current pressure level, sampled afresh, as an int. */
+static ssize_t lowmem_pressure_read(struct file *file, char __user *buf,
+				    size_t count, loff_t *pos)
+{
+	int level;
+	int other_free;
+	int other_file;
+
+	if (count < sizeof(level))
+		return -EINVAL;
+
+	lowmem_get_free(&other_free, &other_file);
+	lowmem_update_pressure(other_free, other_file, lowmem_array_size());
+
+	spin_lock(&lowmem_pressure_lock);
+	level = lowmem_pressure_level;
+	file->f_version = lowmem_pressure_seq;
+	spin_unlock(&lowmem_pressure_lock);
+
+	if (copy_to_user(buf, &level, sizeof(level)))
+		return -EFAULT;
+	return sizeof(level);
+}
+
+/* readable once the level has changed since it was last read */
+static unsigned int lowmem_pressure_poll(struct file *file, poll_table *wait)
+{
+	unsigned int ret = 0;
+
+	poll_wait(file, &lowmem_pressure_wait, wait);
+
+	spin_lock(&lowmem_pressure_lock);
+	if (file->f_version != lowmem_pressure_seq)
+		ret = POLLIN | POLLRDNORM | POLLPRI;
+	spin_unlock(&lowmem_pressure_lock);
+	return ret;
+}
+
+static const struct file_operations lowmem_pressure_fops = {
+	.owner = THIS_MODULE,
+	.open = lowmem_pressure_open,
+	.read = lowmem_pressure_read,
+	.poll = lowmem_pressure_poll,
+};
+
+static struct miscdevice lowmem_pressure_miscdev = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "lowmemorykiller",
+	.fops = &lowmem_pressure_fops,
+};
+
 static int __init lowmem_init(void)
 {
+	int ret;
+
+	ret = misc_register(&lowmem_pressure_miscdev);
+	if (ret)
+		return ret;
 	register_shrinker(&lowmem_shrinker);
 	return 0;
 }
@@ -209,6 +530,8 @@ static int __init lowmem_init(void)
 static void __exit lowmem_exit(void)
 {
 	unregister_shrinker(&lowmem_shrinker);
+	misc_deregister(&lowmem_pressure_miscdev);
+	cancel_delayed_work_sync(&lowmem_pressure_work);
 }
 
 module_param_named(cost, lowmem_shrinker.seeks, int, S_IRUGO | S_IWUSR);
@@ -216,10 +539,12 @@ module_param_array_named(adj, lowmem_adj, int, &lowmem_adj_size,
 			 S_IRUGO | S_IWUSR);
 module_param_array_named(minfree, lowmem_minfree, uint, &lowmem_minfree_size,
 			 S_IRUGO | S_IWUSR);
+module_param_named(notify_margin, lowmem_notify_margin, int,
+		   S_IRUGO | S_IWUSR);
+module_param_named(kill_batch, lowmem_kill_batch, int, S_IRUGO | S_IWUSR);
 module_param_named(debug_level, lowmem_debug_level, uint, S_IRUGO | S_IWUSR);
 
 module_init(lowmem_init);
 module_exit(lowmem_exit);
 
 MODULE_LICENSE("GPL");
-
@@ -0,0 +1,667 @@
+/*
+ * zcache - compressed cache for evicted clean page cache pages
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+/*
+ * A cleancache backend. When a clean page cache page is evicted it is
+ * compressed and kept in a zsmalloc pool; a later read of the same page
+ * decompresses it instead of going to storage. Gets are exclusive: a
+ * page handed back to the page cache is dropped from zcache, and will
+ * be put again when it is next evicted.
+ *
+ * Each cleancache pool (one per mounted file system) is an rbtree of
+ * entries ordered by file key and page index, so all pages of an inode
+ * are adjacent. All entries are also on one LRU list which is used to
+ * keep the compressed data under max_pool_percent of RAM and by the
+ * shrinker. A put only evicts a small batch itself and leaves the rest
+ * to a work item.
+ *
+ * put_page is called from __remove_from_page_cache() with the mapping's
+ * tree_lock held and interrupts disabled, so nothing in the put path may
+ * sleep and zcache_lock is always taken with interrupts disabled.
+ *
+ * tree_lock is also taken from writeback completion in hardirq context,
+ * and the put path takes zsmalloc's locks inside it. Every other zsmalloc
+ * call on the pool therefore runs with interrupts disabled too. That
+ * rules out zs_compact(), which reschedules between classes, so the pool
+ * is never compacted; emptied zspages are still freed by zs_free().
+ */
+
+#define KMSG_COMPONENT "zcache"
+#define pr_fmt(fmt) KMSG_COMPONENT ": " fmt
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/cleancache.h>
+#include <linux/crypto.h>
+#include <linux/highmem.h>
+#include <linux/kobject.h>
+#include <linux/list.h>
+#include <linux/mm.h>
+#include <linux/percpu.h>
+#include <linux/rbtree.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/swap.h>
+#include <linux/sysfs.h>
+#include <linux/workqueue.h>
+
+#include "../zram/zsmalloc.h"
+
+#define ZCACHE_MAX_POOLS	32
+
+/* Pages which compress worse than this are not worth keeping */
+#define ZCACHE_MAX_COMPRESSED	(PAGE_SIZE * 3 / 4)
+
+/* Allocations in the put path must not sleep or dip into reserves */
+#define ZCACHE_GFP_MASK	(GFP_NOWAIT | __GFP_NOWARN | __GFP_NOMEMALLOC)
+
+/* Most entries evicted per zcache_lock hold when over the limit */
+#define ZCACHE_EVICT_BATCH	8
+
+struct zcache_entry {
+	struct rb_node node;
+	struct list_head lru;
+	struct cleancache_filekey key;
+	pgoff_t index;
+	int pool_id;
+	unsigned long handle;
+	u16 size;
+};
+
+struct zcache_pool {
+	struct rb_root entries;
+	int in_use;
+	unsigned int gen;	/* bumped when the pool is destroyed */
+};
+
+struct zcache_stats {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long puts;
+	unsigned long evictions;
+	unsigned long flushes;
+	unsigned long rejects;		/* compressed size too large */
+	unsigned long alloc_fails;
+	unsigned long stored_pages;
+	unsigned long compr_bytes;	/* sum of compressed sizes */
+};
+
+static DEFINE_SPINLOCK(zcache_lock);
+static struct zcache_pool zcache_pools[ZCACHE_MAX_POOLS];
+static LIST_HEAD(zcache_lru);
+static struct zcache_stats zcache_stats;
+
+static struct zs_pool *zcache_zspool;
+static struct kmem_cache *zcache_entry_cache;
+
+static DEFINE_PER_CPU(struct crypto_comp *, zcache_tfm);
+static DEFINE_PER_CPU(u8 *, zcache_dstmem);
+
+static char *zcache_compressor = "lzo";
+module_param_named(compressor, zcache_compressor, charp, 0444);
+MODULE_PARM_DESC(compressor, "Compression algorithm (crypto API name)");
+
+static unsigned int zcache_max_pool_percent = 10;
+module_param_named(max_pool_percent, zcache_max_pool_percent, uint, 0644);
+MODULE_PARM_DESC(max_pool_percent, "Pool size limit in percent of RAM");
+
+static u64 zcache_max_pool_bytes(void)
+{
+	return ((u64)totalram_pages * zcache_max_pool_percent / 100)
+		<< PAGE_SHIFT;
+}
+
+static int zcache_cmp(struct cleancache_filekey *key, pgoff_t index,
+			struct zcache_entry *entry)
+{
+	int ret = memcmp(key, &entry->key, sizeof(*key));
+
+	if (ret)
+		return ret;
+	if (index < entry->index)
+		return -1;
+	return index > entry->index;
+}
+
+static struct zcache_entry *zcache_lookup(struct zcache_pool *pool,
+			struct cleancache_filekey *key, pgoff_t index)
+{
+	struct rb_node *node = pool->entries.rb_node;
+	struct zcache_entry *entry;
+	int cmp;
+
+	while (node) {
+		entry = rb_entry(node, struct zcache_entry, node);
+		cmp = zcache_cmp(key, index, entry);
+		if (cmp < 0)
+			node = node->rb_left;
+		else if (cmp > 0)
+			node = node->rb_right;
+		else
+			return entry;
+	}
+
+	return NULL;
+}
+
+/* First entry at or after (key, index) */
+static struct zcache_entry *zcache_lower_bound(struct zcache_pool *pool,
+			struct cleancache_filekey *key, pgoff_t index)
+{
+	struct rb_node *node = pool->entries.rb_node;
+	struct zcache_entry *entry, *found = NULL;
+
+	while (node) {
+		entry = rb_entry(node, struct zcache_entry, node);
+		if (zcache_cmp(key, index, entry) <= 0) {
+			found = entry;
+			node = node->rb_left;
+		} else {
+			node = node->rb_right;
+		}
+	}
+
+	return found;
+}
+
+/*
+ * Insert entry into its pool. An existing entry for the same page is
+ * replaced and returned so the caller can free it.
+ */
+static struct zcache_entry *zcache_insert(struct zcache_pool *pool,
+			struct zcache_entry *entry)
+{
+	struct rb_node **link = &pool->entries.rb_node, *parent = NULL;
+	struct zcache_entry *cur;
+	int cmp;
+
+	while (*link) {
+		parent = *link;
+		cur = rb_entry(parent, struct zcache_entry, node);
+		cmp = zcache_cmp(&entry->key, entry->index, cur);
+		if (cmp < 0) {
+			link = &parent->rb_left;
+		} else if (cmp > 0) {
+			link = &parent->rb_right;
+		} else {
+			rb_replace_node(&cur->node, &entry->node,
+					&pool->entries);
+			return cur;
+		}
+	}
+
+	rb_link_node(&entry->node, parent, link);
+	rb_insert_color(&entry->node, &pool->entries);
+	return NULL;
+}
+
+/* Unlink entry from its pool and the LRU. Called with zcache_lock held. */
+static void zcache_unlink(struct zcache_entry *entry, int in_tree)
+{
+	if (in_tree)
+		rb_erase(&entry->node, &zcache_pools[entry->pool_id].entries);
+	list_del(&entry->lru);
+	zcache_stats.stored_pages--;
+	zcache_stats.compr_bytes -= entry->size;
+}
+
+static void zcache_free_entry(struct zcache_entry *entry)
+{
+	zs_free(zcache_zspool, entry->handle);
+	kmem_cache_free(zcache_entry_cache, entry);
+}
+
+/*
+ * Evict from the cold end of the LRU until the compressed data is back
+ * under limit, or nr entries have gone. Called with zcache_lock held.
+ */
+static int zcache_evict(int nr, u64 limit)
+{
+	struct zcache_entry *entry;
+	int evicted = 0;
+
+	while (evicted < nr && !list_empty(&zcache_lru) &&
+			zcache_stats.compr_bytes > limit) {
+		entry = list_entry(zcache_lru.prev, struct zcache_entry, lru);
+		zcache_unlink(entry, 1);
+		zcache_free_entry(entry);
+		evicted++;
+	}
+
+	zcache_stats.evictions += evicted;
+	return evicted;
+}
+
+/* Brings the pool back under its limit for puts that found it over */
+static void zcache_reclaim(struct work_struct *work)
+{
+	unsigned long flags;
+	int evicted;
+
+	do {
+		spin_lock_irqsave(&zcache_lock, flags);
+		evicted = zcache_evict(ZCACHE_EVICT_BATCH,
+				       zcache_max_pool_bytes());
+		spin_unlock_irqrestore(&zcache_lock, flags);
+		cond_resched();
+	} while (evicted);
+}
+
+static DECLARE_WORK(zcache_reclaim_work, zcache_reclaim);
+
+static int zcache_init_fs(size_t pagesize)
+{
+	unsigned long flags;
+	int i;
+
+	if (pagesize != PAGE_SIZE)
+		return -1;
+
+	spin_lock_irqsave(&zcache_lock, flags);
+	for (i = 0; i < ZCACHE_MAX_POOLS; i++) {
+		if (!zcache_pools[i].in_use) {
+			zcache_pools[i].entries = RB_ROOT;
+			zcache_pools[i].in_use = 1;
+			break;
+		}
+	}
+	spin_unlock_irqrestore(&zcache_lock, flags);
+
+	if (i == ZCACHE_MAX_POOLS) {
+		pr_warning("out of pools\n");
+		return -1;
+	}
+
+	return i;
+}
+
+/* A single kernel sees the same data for a shared pool as a private one */
+static int zcache_init_shared_fs(char *uuid, size_t pagesize)
+{
+	return zcache_init_fs(pagesize);
+}
+
+static int zcache_pool_valid(int pool_id)
+{
+	return pool_id >= 0 && pool_id < ZCACHE_MAX_POOLS &&
+		zcache_pools[pool_id].in_use;
+}
+
+static void zcache_flush_page(int pool_id, struct cleancache_filekey key,
+			pgoff_t index)
+{
+	struct zcache_entry *entry = NULL;
+	unsigned long flags;
+
+	spin_lock_irqsave(&zcache_lock, flags);
+	if (zcache_pool_valid(pool_id))
+		entry = zcache_lookup(&zcache_pools[pool_id], &key, index);
+	if (entry) {
+		zcache_unlink(entry, 1);
+		zcache_free_entry(entry);
+		zcache_stats.flushes++;
+	}
+	spin_unlock_irqrestore(&zcache_lock, flags);
+}
+
+static void zcache_flush_inode(int pool_id, struct cleancache_filekey key)
+{
+	struct zcache_entry *entry, *next = NULL;
+	struct rb_node *node;
+	unsigned long flags;
+
+	spin_lock_irqsave(&zcache_lock, flags);
+	if (zcache_pool_valid(pool_id))
+		next = zcache_lower_bound(&zcache_pools[pool_id], &key, 0);
+	while (next && !memcmp(&next->key, &key, sizeof(key))) {
+		entry = next;
+		node = rb_next(&entry->node);
+		next = node ? rb_entry(node, struct zcache_entry, node) : NULL;
+
+		zcache_unlink(entry, 1);
+		zcache_free_entry(entry);
+		zcache_stats.flushes++;
+	}
+	spin_unlock_irqrestore(&zcache_lock, flags);
+}
+
+static void zcache_flush_fs(int pool_id)
+{
+	struct zcache_entry *entry;
+	struct rb_node *node;
+	unsigned long flags;
+
+	spin_lock_irqsave(&zcache_lock, flags);
+	if (!zcache_pool_valid(pool_id))
+		goto out;
+
+	while ((node = rb_first(&zcache_pools[pool_id].entries))) {
+		entry = rb_entry(node, struct zcache_entry, node);
+		zcache_unlink(entry, 1);
+		zcache_free_entry(entry);
+	}
+	zcache_pools[pool_id].in_use = 0;
+	zcache_pools[pool_id].gen++;
+out:
+	spin_unlock_irqrestore(&zcache_lock, flags);
+}
+
+/*
+ * A put that fails must still drop any older copy of the page, which
+ * may no longer match what is on storage.
+ */
+static void zcache_put_failed(int pool_id, struct cleancache_filekey *key,
+			pgoff_t index, unsigned long *stat)
+{
+	struct zcache_entry *entry = NULL;
+	unsigned long flags;
+
+	spin_lock_irqsave(&zcache_lock, flags);
+	(*stat)++;
+	if (zcache_pool_valid(pool_id))
+		entry = zcache_lookup(&zcache_pools[pool_id], key, index);
+	if (entry) {
+		zcache_unlink(entry, 1);
+		zcache_free_entry(entry);
+	}
+	spin_unlock_irqrestore(&zcache_lock, flags);
+}
+
+static void zcache_put_page(int pool_id, struct cleancache_filekey key,
+			pgoff_t index, struct page *page)
+{
+	struct zcache_entry *entry, *old;
+	unsigned int gen, clen = PAGE_SIZE * 2;
+	unsigned long handle, flags;
+	u64 limit;
+	u8 *src, *dst, *obj;
+	int cpu, ret;
+
+	if (pool_id < 0 || pool_id >= ZCACHE_MAX_POOLS)
+		return;
+
+	/*
+	 * The pool may be destroyed and its id handed to another file
+	 * system while we compress; the generation tells us if it was.
+	 */
+	gen = ACCESS_ONCE(zcache_pools[pool_id].gen);
+
+	entry = kmem_cache_alloc(zcache_entry_cache, ZCACHE_GFP_MASK);
+	if (!entry) {
+		zcache_put_failed(pool_id, &key, index,
+				&zcache_stats.alloc_fails);
+		return;
+	}
+
+	cpu = get_cpu();
+	dst = per_cpu(zcache_dstmem, cpu);
+	src = kmap_atomic(page, KM_USER0);
+	ret = crypto_comp_compress(per_cpu(zcache_tfm, cpu), src, PAGE_SIZE,
+				   dst, &clen);
+	kunmap_atomic(src, KM_USER0);
+
+	if (ret || clen > ZCACHE_MAX_COMPRESSED) {
+		put_cpu();
+		kmem_cache_free(zcache_entry_cache, entry);
+		zcache_put_failed(pool_id, &key, index, &zcache_stats.rejects);
+		return;
+	}
+
+	handle = zs_malloc(zcache_zspool, clen,
+			   ZCACHE_GFP_MASK | __GFP_HIGHMEM);
+	if (!handle) {
+		put_cpu();
+		kmem_cache_free(zcache_entry_cache, entry);
+		zcache_put_failed(pool_id, &key, index,
+				&zcache_stats.alloc_fails);
+		return;
+	}
+
+	obj = zs_map_object(zcache_zspool, handle, ZS_MM_WO, KM_USER0);
+	memcpy(obj, dst, clen);
+	zs_unmap_object(zcache_zspool, handle, obj, KM_USER0);
+	put_cpu();
+
+	entry->key = key;
+	entry->index = index;
+	entry->pool_id = pool_id;
+	entry->handle = handle;
+	entry->size = clen;
+
+	spin_lock_irqsave(&zcache_lock, flags);
+	if (!zcache_pool_valid(pool_id) || zcache_pools[pool_id].gen != gen) {
+		/* The file system went away while we were compressing */
+		zcache_free_entry(entry);
+		spin_unlock_irqrestore(&zcache_lock, flags);
+		return;
+	}
+
+	old = zcache_insert(&zcache_pools[pool_id], entry);
+	if (old) {
+		zcache_unlink(old, 0);
+		zcache_free_entry(old);
+	}
+	list_add(&entry->lru, &zcache_lru);
+	zcache_stats.puts++;
+	zcache_stats.stored_pages++;
+	zcache_stats.compr_bytes += clen;
+
+	limit = zcache_max_pool_bytes();
+	zcache_evict(ZCACHE_EVICT_BATCH, limit);
+	if (zcache_stats.compr_bytes > limit)
+		schedule_work(&zcache_reclaim_work);
+	spin_unlock_irqrestore(&zcache_lock, flags);
+}
+
+static int zcache_get_page(int pool_id, struct cleancache_filekey key,
+			pgoff_t index, struct page *page)
+{
+	struct zcache_entry *entry = NULL;
+	unsigned int dlen = PAGE_SIZE;
+	unsigned long flags;
+	u8 *src, *dst;
+	int cpu, ret;
+
+	spin_lock_irqsave(&zcache_lock, flags);
+	if (zcache_pool_valid(pool_id))
+		entry = zcache_lookup(&zcache_pools[pool_id], &key, index);
+	if (!entry) {
+		zcache_stats.misses++;
+		spin_unlock_irqrestore(&zcache_lock, flags);
+		return -1;
+	}
+	zcache_unlink(entry, 1);
+	zcache_stats.hits++;
+	/* Interrupts stay off until the entry is freed, see the top comment */
+	spin_unlock(&zcache_lock);
+
+	cpu = smp_processor_id();
+	src = zs_map_object(zcache_zspool, entry->handle, ZS_MM_RO, KM_USER0);
+	dst = kmap_atomic(page, KM_USER1);
+	ret = crypto_comp_decompress(per_cpu(zcache_tfm, cpu), src,
+				     entry->size, dst, &dlen);
+	kunmap_atomic(dst, KM_USER1);
+	zs_unmap_object(zcache_zspool, entry->handle, src, KM_USER0);
+
+	zcache_free_entry(entry);
+	local_irq_restore(flags);
+
+	if (ret || dlen != PAGE_SIZE) {
+		pr_err("decompression failed, pool %d index %lu\n",
+			pool_id, (unsigned long)index);
+		return -1;
+	}
+
+	return 0;
+}
+
+static struct cleancache_ops zcache_ops = {
+	.init_fs = zcache_init_fs,
+	.init_shared_fs = zcache_init_shared_fs,
+	.get_page = zcache_get_page,
+	.put_page = zcache_put_page,
+	.flush_page = zcache_flush_page,
+	.flush_inode = zcache_flush_inode,
+	.flush_fs = zcache_flush_fs,
+};
+
+static int zcache_shrink(int nr_to_scan, gfp_t gfp_mask)
+{
+	unsigned long flags;
+
+	if (nr_to_scan) {
+		spin_lock_irqsave(&zcache_lock, flags);
+		zcache_evict(nr_to_scan, 0);
+		spin_unlock_irqrestore(&zcache_lock, flags);
+	}
+
+	return zcache_stats.stored_pages;
+}
+
+static struct shrinker zcache_shrinker = {
+	.shrink = zcache_shrink,
+	.seeks = DEFAULT_SEEKS,
+};
+
+#define ZCACHE_STAT_ATTR(_name)						\
+static ssize_t _name##_show(struct kobject *kobj,			\
+			struct kobj_attribute *attr, char *buf)		\
+{									\
+	return sprintf(buf, "%lu\n", zcache_stats._name);		\
+}									\
+static struct kobj_attribute _name##_attr = __ATTR_RO(_name)
+
+ZCACHE_STAT_ATTR(hits);
+ZCACHE_STAT_ATTR(misses);
+ZCACHE_STAT_ATTR(puts);
+ZCACHE_STAT_ATTR(evictions);
+ZCACHE_STAT_ATTR(flushes);
+ZCACHE_STAT_ATTR(rejects);
+ZCACHE_STAT_ATTR(alloc_fails);
+ZCACHE_STAT_ATTR(stored_pages);
+ZCACHE_STAT_ATTR(compr_bytes);
+
+static ssize_t pool_bytes_show(struct kobject *kobj,
+			struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%llu\n",
+		(unsigned long long)zs_get_total_size_bytes(zcache_zspool));
+}
+static struct kobj_attribute pool_bytes_attr = __ATTR_RO(pool_bytes);
+
+static ssize_t compressor_show(struct kobject *kobj,
+			struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%s\n", zcache_compressor);
+}
+static struct kobj_attribute compressor_attr = __ATTR_RO(compressor);
+
+static struct attribute *zcache_attrs[] = {
+	&hits_attr.attr,
+	&misses_attr.attr,
+	&puts_attr.attr,
+	&evictions_attr.attr,
+	&flushes_attr.attr,
+	&rejects_attr.attr,
+	&alloc_fails_attr.attr,
+	&stored_pages_attr.attr,
+	&compr_bytes_attr.attr,
+	&pool_bytes_attr.attr,
+	&compressor_attr.attr,
+	NULL,
+};
+
+static struct attribute_group zcache_attr_group = {
+	.attrs = zcache_attrs,
+	.name = "zcache",
+};
+
+static void zcache_free_percpu(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		if (per_cpu(zcache_tfm, cpu))
+			crypto_free_comp(per_cpu(zcache_tfm, cpu));
+		per_cpu(zcache_tfm, cpu) = NULL;
+		kfree(per_cpu(zcache_dstmem, cpu));
+		per_cpu(zcache_dstmem, cpu) = NULL;
+	}
+}
+
+static int __init zcache_alloc_percpu(void)
+{
+	struct crypto_comp *tfm;
+	int cpu;
+
+	if (!crypto_has_comp(zcache_compressor, 0, 0)) {
+		pr_warning("compressor %s not available, using lzo\n",
+			zcache_compressor);
+		zcache_compressor = "lzo";
+	}
+
+	/* Compressed output may exceed a page before it is rejected */
+	for_each_possible_cpu(cpu) {
+		tfm = crypto_alloc_comp(zcache_compressor, 0, 0);
+		if (IS_ERR(tfm))
+			goto fail;
+		per_cpu(zcache_tfm, cpu) = tfm;
+
+		per_cpu(zcache_dstmem, cpu) = kmalloc(PAGE_SIZE * 2,
+							GFP_KERNEL);
+		if (!per_cpu(zcache_dstmem, cpu))
+			goto fail;
+	}
+
+	return 0;
+
+fail:
+	zcache_free_percpu();
+	return -ENOMEM;
+}
+
+static int __init zcache_init(void)
+{
+	int ret = -ENOMEM;
+
+	zcache_zspool = zs_create_pool("zcache");
+	if (!zcache_zspool)
+		goto out;
+
+	zcache_entry_cache = KMEM_CACHE(zcache_entry, 0);
+	if (!zcache_entry_cache)
+		goto out_pool;
+
+	ret = zcache_alloc_percpu();
+	if (ret)
+		goto out_cache;
+
+	ret = sysfs_create_group(mm_kobj, &zcache_attr_group);
+	if (ret)
+		goto out_percpu;
+
+	register_shrinker(&zcache_shrinker);
+	cleancache_register_ops(&zcache_ops);
+	pr_info("cleancache enabled using %s\n", zcache_compressor);
+	return 0;
+
+out_percpu:
+	zcache_free_percpu();
+out_cache:
+	kmem_cache_destroy(zcache_entry_cache);
+out_pool:
+	zs_destroy_pool(zcache_zspool);
+out:
+	pr_err("initialization failed: %d\n", ret);
+	return ret;
+}
+
+module_init(zcache_init);
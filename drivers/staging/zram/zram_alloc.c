@@ -0,0 +1,233 @@
+/*
+ * Compressed RAM block device
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ * Project home: http://compcache.googlecode.com
+ */
+
+#include <linux/ctype.h>
+#include <linux/highmem.h>
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/string.h>
+
+#include "zram_drv.h"
+
+/*
+ * xvmalloc objects are identified by <page, offset>. Offsets are at
+ * least 4 byte aligned, so both fit in one word even with highmem.
+ * The encoding is biased by one: pfn 0 at offset 0 is a valid object,
+ * but a handle of 0 means "no object" to the callers.
+ */
+#define XV_HANDLE_SHIFT		2
+#define XV_HANDLE_OFFSET_MASK	((1UL << (PAGE_SHIFT - XV_HANDLE_SHIFT)) - 1)
+
+static unsigned long xv_handle(struct page *page, u32 offset)
+{
+	return ((page_to_pfn(page) << (PAGE_SHIFT - XV_HANDLE_SHIFT)) |
+		(offset >> XV_HANDLE_SHIFT)) + 1;
+}
+
+static struct page *xv_handle_page(unsigned long handle)
+{
+	return pfn_to_page((handle - 1) >> (PAGE_SHIFT - XV_HANDLE_SHIFT));
+}
+
+static u32 xv_handle_offset(unsigned long handle)
+{
+	return ((handle - 1) & XV_HANDLE_OFFSET_MASK) << XV_HANDLE_SHIFT;
+}
+
+static void *xv_create_(const char *name)
+{
+	return xv_create_pool();
+}
+
+static void xv_destroy_(void *pool)
+{
+	xv_destroy_pool(pool);
+}
+
+static unsigned long xv_malloc_(void *pool, u32 size, gfp_t flags)
+{
+	u32 offset;
+	struct page *page;
+
+	if (xv_malloc(pool, size, &page, &offset, flags))
+		return 0;
+
+	return xv_handle(page, offset);
+}
+
+static void xv_free_(void *pool, unsigned long handle)
+{
+	xv_free(pool, xv_handle_page(handle), xv_handle_offset(handle));
+}
+
+static void *xv_map_(void *pool, unsigned long handle, enum zs_mapmode mm,
+			enum km_type type)
+{
+	unsigned char *base;
+
+	base = kmap_atomic(xv_handle_page(handle), type);
+	return base + xv_handle_offset(handle);
+}
+
+static void xv_unmap_(void *pool, unsigned long handle, void *addr,
+			enum km_type type)
+{
+	kunmap_atomic(addr, type);
+}
+
+static u64 xv_total_size_(void *pool)
+{
+	return xv_get_total_size_bytes(pool);
+}
+
+static void *zs_create_(const char *name)
+{
+	return zs_create_pool(name);
+}
+
+static void zs_destroy_(void *pool)
+{
+	zs_destroy_pool(pool);
+}
+
+static unsigned long zs_malloc_(void *pool, u32 size, gfp_t flags)
+{
+	return zs_malloc(pool, size, flags);
+}
+
+static void zs_free_(void *pool, unsigned long handle)
+{
+	zs_free(pool, handle);
+}
+
+static void *zs_map_(void *pool, unsigned long handle, enum zs_mapmode mm,
+			enum km_type type)
+{
+	return zs_map_object(pool, handle, mm, type);
+}
+
+static void zs_unmap_(void *pool, unsigned long handle, void *addr,
+			enum km_type type)
+{
+	zs_unmap_object(pool, handle, addr, type);
+}
+
+static u64 zs_total_size_(void *pool)
+{
+	return zs_get_total_size_bytes(pool);
+}
+
+static unsigned long zs_compact_(void *pool)
+{
+	return zs_compact(pool);
+}
+
+static const struct zram_allocator zram_allocators[] = {
+	{
+		.name		= "xvmalloc",
+		.create		= xv_create_,
+		.destroy	= xv_destroy_,
+		.malloc		= xv_malloc_,
+		.free		= xv_free_,
+		.map		= xv_map_,
+		.unmap		= xv_unmap_,
+		.total_size	= xv_total_size_,
+	},
+	{
+		.name		= "zsmalloc",
+		.create		= zs_create_,
+		.destroy	= zs_destroy_,
+		.malloc		= zs_malloc_,
+		.free		= zs_free_,
+		.map		= zs_map_,
+		.unmap		= zs_unmap_,
+		.total_size	= zs_total_size_,
+		.compact	= zs_compact_,
+	},
+};
+
+/*
+ * Look up an allocator by name. Trailing whitespace (typically the
+ * newline of a sysfs write) is ignored.
+ */
+const struct zram_allocator *zram_find_allocator(const char *name)
+{
+	int i;
+	size_t len = strlen(name);
+
+	while (len && isspace(name[len - 1]))
+		len--;
+
+	for (i = 0; i < ARRAY_SIZE(zram_allocators); i++) {
+		if (strlen(zram_allocators[i].name) == len &&
+		    !strncmp(zram_allocators[i].name, name, len))
+			return &zram_allocators[i];
+	}
+
+	return NULL;
+}
+
+const struct zram_allocator *zram_default_allocator(void)
+{
+	const struct zram_allocator *allocator;
+
+	allocator = zram_find_allocator(CONFIG_ZRAM_DEFAULT_ALLOCATOR);
+	if (!allocator)
+		allocator = &zram_allocators[0];
+
+	return allocator;
+}
+
+/*
+ * List available allocators, with the selected one in brackets.
+ */
+ssize_t zram_show_allocators(const struct zram_allocator *cur, char *buf)
+{
+	int i;
+	ssize_t sz = 0;
+
+	for (i = 0; i < ARRAY_SIZE(zram_allocators); i++) {
+		if (cur == &zram_allocators[i])
+			sz += sprintf(buf + sz, "[%s] ",
+				zram_allocators[i].name);
+		else
+			sz += sprintf(buf + sz, "%s ",
+				zram_allocators[i].name);
+	}
+
+	sz += sprintf(buf + sz, "\n");
+	return sz;
+}
+
+/*
+ * Map a stored object. Incompressible pages (size == PAGE_SIZE) are
+ * kept in a page of their own rather than in the allocator.
+ */
+void *zram_map_obj(struct zram *zram, unsigned long handle, u32 size,
+			enum zs_mapmode mm, enum km_type type)
+{
+	if (unlikely(size == PAGE_SIZE))
+		return kmap_atomic((struct page *)handle, type);
+
+	return zram->allocator->map(zram->mem_pool, handle, mm, type);
+}
+
+void zram_unmap_obj(struct zram *zram, unsigned long handle, u32 size,
+			void *addr, enum km_type type)
+{
+	if (unlikely(size == PAGE_SIZE))
+		kunmap_atomic(addr, type);
+	else
+		zram->allocator->unmap(zram->mem_pool, handle, addr, type);
+}
@@ -0,0 +1,126 @@
+/*
+ * Compressed RAM block device
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ * Project home: http://compcache.googlecode.com
+ */
+
+#include <linux/ctype.h>
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/string.h>
+
+#ifdef CONFIG_ZRAM_LZO
+#include <linux/lzo.h>
+#endif
+#ifdef CONFIG_ZRAM_SNAPPY
+#include "../snappy/csnappy.h" /* if built in drivers/staging */
+#endif
+
+#include "zram_drv.h"
+
+#if !defined(CONFIG_ZRAM_LZO) && !defined(CONFIG_ZRAM_SNAPPY)
+#error either CONFIG_ZRAM_LZO or CONFIG_ZRAM_SNAPPY must be defined
+#endif
+
+#ifdef CONFIG_ZRAM_SNAPPY
+#define SNAPPY_WMSIZE_ORDER	((PAGE_SHIFT > 14) ? (15) : (PAGE_SHIFT+1))
+
+static int snappy_compress_(const unsigned char *src, size_t src_len,
+			unsigned char *dst, size_t *dst_len, void *workmem)
+{
+	const char *end = csnappy_compress_fragment((const char *)src,
+		(uint32_t)src_len, (char *)dst, workmem, SNAPPY_WMSIZE_ORDER);
+	*dst_len = end - (char *)dst;
+	return 0;
+}
+
+static int snappy_decompress_(const unsigned char *src, size_t src_len,
+			unsigned char *dst, size_t *dst_len)
+{
+	uint32_t dst_len_ = (uint32_t)*dst_len;
+	int ret = csnappy_decompress_noheader((const char *)src, src_len,
+					(char *)dst, &dst_len_);
+	*dst_len = (size_t)dst_len_;
+	return ret;
+}
+#endif
+
+static const struct zram_compressor zram_compressors[] = {
+#ifdef CONFIG_ZRAM_LZO
+	{
+		.name		= "lzo",
+		.workmem_size	= LZO1X_MEM_COMPRESS,
+		.compress	= lzo1x_1_compress,
+		.decompress	= lzo1x_decompress_safe,
+	},
+#endif
+#ifdef CONFIG_ZRAM_SNAPPY
+	{
+		.name		= "snappy",
+		.workmem_size	= 1 << SNAPPY_WMSIZE_ORDER,
+		.compress	= snappy_compress_,
+		.decompress	= snappy_decompress_,
+	},
+#endif
+};
+
+/*
+ * Look up a compressor by name. Trailing whitespace (typically the
+ * newline of a sysfs write) is ignored.
+ */
+const struct zram_compressor *zram_find_compressor(const char *name)
+{
+	int i;
+	size_t len = strlen(name);
+
+	while (len && isspace(name[len - 1]))
+		len--;
+
+	for (i = 0; i < ARRAY_SIZE(zram_compressors); i++) {
+		if (strlen(zram_compressors[i].name) == len &&
+		    !strncmp(zram_compressors[i].name, name, len))
+			return &zram_compressors[i];
+	}
+
+	return NULL;
+}
+
+const struct zram_compressor *zram_default_compressor(void)
+{
+	const struct zram_compressor *comp;
+
+	comp = zram_find_compressor(CONFIG_ZRAM_DEFAULT_COMPRESSOR);
+	if (!comp)
+		comp = &zram_compressors[0];
+
+	return comp;
+}
+
+/*
+ * List available compressors, with the selected one in brackets.
+ */
+ssize_t zram_show_compressors(const struct zram_compressor *cur, char *buf)
+{
+	int i;
+	ssize_t sz = 0;
+
+	for (i = 0; i < ARRAY_SIZE(zram_compressors); i++) {
+		if (cur == &zram_compressors[i])
+			sz += sprintf(buf + sz, "[%s] ",
+				zram_compressors[i].name);
+		else
+			sz += sprintf(buf + sz, "%s ",
+				zram_compressors[i].name);
+	}
+
+	sz += sprintf(buf + sz, "\n");
+	return sz;
+}
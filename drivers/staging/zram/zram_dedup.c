@@ -0,0 +1,209 @@
+/*
+ * Compressed RAM block device
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ * Project home: http://compcache.googlecode.com
+ */
+
+/*
+ * Deduplication of identical pages.
+ *
+ * Every stored object gets a zram_dedup_entry indexed by a checksum of
+ * its uncompressed contents. A page whose contents match an existing
+ * object just takes a reference on that entry instead of being
+ * compressed and stored again.
+ */
+
+#include <linux/highmem.h>
+#include <linux/jhash.h>
+#include <linux/kernel.h>
+#include <linux/rbtree.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "zram_drv.h"
+
+u32 zram_dedup_checksum(void *mem)
+{
+	return jhash2(mem, PAGE_SIZE / sizeof(u32), 0);
+}
+
+/*
+ * Check if the object referenced by entry holds the same data as mem.
+ * buffer must have room for one uncompressed page.
+ */
+static int zram_dedup_match(struct zram *zram, struct zram_dedup_entry *entry,
+			void *mem, void *buffer)
+{
+	int ret, match = 0;
+	size_t clen = PAGE_SIZE;
+	unsigned char *cmem;
+
+	cmem = zram_map_obj(zram, entry->handle, entry->len, ZS_MM_RO,
+			KM_USER1);
+
+	if (entry->len == PAGE_SIZE) {
+		match = !memcmp(mem, cmem, PAGE_SIZE);
+	} else {
+		ret = zram->comp->decompress(cmem, entry->len, buffer, &clen);
+		if (!ret && clen == PAGE_SIZE)
+			match = !memcmp(mem, buffer, PAGE_SIZE);
+	}
+
+	zram_unmap_obj(zram, entry->handle, entry->len, cmem, KM_USER1);
+
+	return match;
+}
+
+/*
+ * Find an object with the same contents as mem and take a reference
+ * on it. Returns NULL if there is none.
+ *
+ * Candidates are decompressed and compared without dedup_lock held, so
+ * that writers do not serialise on it. A reference is held on each
+ * candidate meanwhile, which keeps it, and its place in the tree, alive.
+ */
+struct zram_dedup_entry *zram_dedup_find(struct zram *zram, void *mem,
+				u32 checksum, void *buffer)
+{
+	struct rb_node *node, *prev;
+	struct zram_dedup_entry *entry, *next;
+	int last;
+
+	spin_lock(&zram->dedup_lock);
+
+	node = zram->dedup_root.rb_node;
+	while (node) {
+		entry = rb_entry(node, struct zram_dedup_entry, rb_node);
+		if (checksum == entry->checksum)
+			break;
+		node = checksum < entry->checksum ?
+			node->rb_left : node->rb_right;
+	}
+
+	if (!node)
+		goto out;
+
+	/* Entries with equal checksums are adjacent; rewind to the first */
+	while ((prev = rb_prev(node))) {
+		entry = rb_entry(prev, struct zram_dedup_entry, rb_node);
+		if (entry->checksum != checksum)
+			break;
+		node = prev;
+	}
+
+	entry = rb_entry(node, struct zram_dedup_entry, rb_node);
+	entry->refcount++;
+	spin_unlock(&zram->dedup_lock);
+
+	for (;;) {
+		if (zram_dedup_match(zram, entry, mem, buffer))
+			return entry;
+
+		/* Move our reference on to the next candidate, if any */
+		spin_lock(&zram->dedup_lock);
+		next = NULL;
+		node = rb_next(&entry->rb_node);
+		if (node) {
+			next = rb_entry(node, struct zram_dedup_entry, rb_node);
+			if (next->checksum == checksum)
+				next->refcount++;
+			else
+				next = NULL;
+		}
+		last = !--entry->refcount;
+		if (last)
+			rb_erase(&entry->rb_node, &zram->dedup_root);
+		spin_unlock(&zram->dedup_lock);
+
+		/* The pages that shared it went away while we compared */
+		if (last)
+			zram_dedup_release(zram, entry);
+
+		if (!next)
+			return NULL;
+		entry = next;
+	}
+
+out:
+	spin_unlock(&zram->dedup_lock);
+	return NULL;
+}
+
+/*
+ * Start tracking a newly stored object. The returned entry holds the
+ * only reference to it.
+ */
+struct zram_dedup_entry *zram_dedup_insert(struct zram *zram,
+			unsigned long handle, u32 len, u32 checksum)
+{
+	struct rb_node **p, *parent = NULL;
+	struct zram_dedup_entry *entry, *tmp;
+
+	entry = kmalloc(sizeof(*entry), GFP_NOIO);
+	if (!entry)
+		return NULL;
+
+	entry->handle = handle;
+	entry->len = len;
+	entry->checksum = checksum;
+	entry->refcount = 1;
+
+	spin_lock(&zram->dedup_lock);
+
+	p = &zram->dedup_root.rb_node;
+	while (*p) {
+		parent = *p;
+		tmp = rb_entry(parent, struct zram_dedup_entry, rb_node);
+		if (checksum < tmp->checksum)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+
+	rb_link_node(&entry->rb_node, parent, p);
+	rb_insert_color(&entry->rb_node, &zram->dedup_root);
+
+	spin_unlock(&zram->dedup_lock);
+
+	return entry;
+}
+
+/*
+ * Returns 1 if more than one page currently references the entry.
+ */
+int zram_dedup_shared(struct zram *zram, struct zram_dedup_entry *entry)
+{
+	int shared;
+
+	spin_lock(&zram->dedup_lock);
+	shared = entry->refcount > 1;
+	spin_unlock(&zram->dedup_lock);
+
+	return shared;
+}
+
+/*
+ * Drop a reference. Returns 1 if this was the last one, in which case
+ * the entry has been unlinked and the caller must free both the object
+ * and the entry itself.
+ */
+int zram_dedup_put(struct zram *zram, struct zram_dedup_entry *entry)
+{
+	int last;
+
+	spin_lock(&zram->dedup_lock);
+	last = !--entry->refcount;
+	if (last)
+		rb_erase(&entry->rb_node, &zram->dedup_root);
+	spin_unlock(&zram->dedup_lock);
+
+	return last;
+}
@@ -19,6 +19,7 @@
 #include <linux/kernel.h>
 #include <linux/bio.h>
 #include <linux/bitops.h>
+#include <linux/bit_spinlock.h>
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
 #include <linux/device.h>
@@ -30,51 +31,6 @@
 
 #include "zram_drv.h"
 
-#if defined(CONFIG_ZRAM_LZO)
-#include <linux/lzo.h>
-#define WMSIZE		LZO1X_MEM_COMPRESS
-#define COMPRESS(s, sl, d, dl, wm)	\
-	lzo1x_1_compress(s, sl, d, dl, wm)
-#define DECOMPRESS(s, sl, d, dl)	\
-	lzo1x_decompress_safe(s, sl, d, dl)
-#elif defined(CONFIG_ZRAM_SNAPPY)
-#include "../snappy/csnappy.h" /* if built in drivers/staging */
-#define WMSIZE_ORDER	((PAGE_SHIFT > 14) ? (15) : (PAGE_SHIFT+1))
-#define WMSIZE		(1 << WMSIZE_ORDER)
-static int
-snappy_compress_(
-	const unsigned char *src,
-	size_t src_len,
-	unsigned char *dst,
-	size_t *dst_len,
-	void *workmem)
-{
-	const unsigned char *end = csnappy_compress_fragment(
-		src, (uint32_t)src_len, dst, workmem, WMSIZE_ORDER);
-	*dst_len = end - dst;
-	return 0;
-}
-static int
-snappy_decompress_(
-	const unsigned char *src,
-	size_t src_len,
-	unsigned char *dst,
-	size_t *dst_len)
-{
-	uint32_t dst_len_ = (uint32_t)*dst_len;
-	int ret = csnappy_decompress_noheader(src, src_len, dst, &dst_len_);
-	*dst_len = (size_t)dst_len_;
-	return ret;
-}
-#define COMPRESS(s, sl, d, dl, wm)	\
-	snappy_compress_(s, sl, d, dl, wm)
-#define DECOMPRESS(s, sl, d, dl)	\
-	snappy_decompress_(s, sl, d, dl)
-#else
-#error either CONFIG_ZRAM_LZO or CONFIG_ZRAM_SNAPPY must be defined
-#endif
-
-
 /* Globals */
 static int zram_major;
 struct zram *devices;
@@ -82,14 +38,14 @@ struct zram *devices;
 /* Module params (documentation at end) */
 unsigned int num_devices;
 
-static void zram_stat_inc(u32 *v)
+static void zram_stat_inc(atomic_t *v)
 {
-	*v = *v + 1;
+	atomic_inc(v);
 }
 
-static void zram_stat_dec(u32 *v)
+static void zram_stat_dec(atomic_t *v)
 {
-	*v = *v - 1;
+	atomic_dec(v);
 }
 
 static void zram_stat64_add(struct zram *zram, u64 *v, u64 inc)
@@ -129,21 +85,150 @@ static void zram_clear_flag(struct zram *zram, u32 index,
 	zram->table[index].flags &= ~BIT(flag);
 }
 
-static int page_zero_filled(void *ptr)
+/*
+ * Table entries are protected by a bit spinlock embedded in their flags,
+ * so I/O to different pages of the same device can proceed in parallel.
+ * Nothing that may sleep is allowed while the slot lock is held.
+ */
+static void zram_lock_slot(struct zram *zram, u32 index)
+{
+	bit_spin_lock(ZRAM_ACCESS, &zram->table[index].flags);
+}
+
+static void zram_unlock_slot(struct zram *zram, u32 index)
+{
+	bit_spin_unlock(ZRAM_ACCESS, &zram->table[index].flags);
+}
+
+static void zram_comp_strm_free(struct zram_comp_strm *strm)
+{
+	kfree(strm->workmem);
+	free_pages((unsigned long)strm->buffer, 1);
+	kfree(strm);
+}
+
+static struct zram_comp_strm *zram_comp_strm_alloc(struct zram *zram)
+{
+	struct zram_comp_strm *strm;
+
+	strm = kzalloc(sizeof(*strm), GFP_KERNEL);
+	if (!strm)
+		return NULL;
+
+	strm->workmem = kzalloc(zram->comp->workmem_size, GFP_KERNEL);
+	/* Compressed output of an incompressible page may exceed PAGE_SIZE */
+	strm->buffer = (void *)__get_free_pages(GFP_KERNEL | __GFP_ZERO, 1);
+	if (!strm->workmem || !strm->buffer) {
+		zram_comp_strm_free(strm);
+		return NULL;
+	}
+
+	return strm;
+}
+
+static void zram_comp_destroy_streams(struct zram *zram)
+{
+	struct zram_comp_strm *strm;
+
+	while (!list_empty(&zram->idle_strm)) {
+		strm = list_entry(zram->idle_strm.next,
+				struct zram_comp_strm, list);
+		list_del(&strm->list);
+		zram_comp_strm_free(strm);
+	}
+}
+
+static int zram_comp_create_streams(struct zram *zram)
+{
+	unsigned int i;
+	struct zram_comp_strm *strm;
+
+	for (i = 0; i < zram->max_comp_streams; i++) {
+		strm = zram_comp_strm_alloc(zram);
+		if (!strm) {
+			zram_comp_destroy_streams(zram);
+			return -ENOMEM;
+		}
+		list_add(&strm->list, &zram->idle_strm);
+	}
+
+	return 0;
+}
+
+/*
+ * Get an idle compression stream. If all of them are in use by other
+ * writers, sleep until one is released.
+ */
+static struct zram_comp_strm *zram_comp_strm_find(struct zram *zram)
+{
+	struct zram_comp_strm *strm;
+
+	for (;;) {
+		spin_lock(&zram->strm_lock);
+		if (!list_empty(&zram->idle_strm)) {
+			strm = list_entry(zram->idle_strm.next,
+					struct zram_comp_strm, list);
+			list_del(&strm->list);
+			spin_unlock(&zram->strm_lock);
+			return strm;
+		}
+		spin_unlock(&zram->strm_lock);
+
+		wait_event(zram->strm_wait, !list_empty(&zram->idle_strm));
+	}
+}
+
+static void zram_comp_strm_release(struct zram *zram,
+				struct zram_comp_strm *strm)
 {
-	unsigned int pos;
+	spin_lock(&zram->strm_lock);
+	list_add(&strm->list, &zram->idle_strm);
+	spin_unlock(&zram->strm_lock);
+
+	wake_up(&zram->strm_wait);
+}
+
+/*
+ * Check whether the page is filled with a single repeated word and
+ * return that word in *element if so.
+ */
+static int page_same_filled(void *ptr, unsigned long *element)
+{
+	unsigned int pos, last_pos;
 	unsigned long *page;
+	unsigned long val;
 
 	page = (unsigned long *)ptr;
+	last_pos = PAGE_SIZE / sizeof(*page) - 1;
+	val = page[0];
 
-	for (pos = 0; pos != PAGE_SIZE / sizeof(*page); pos++) {
-		if (page[pos])
+	/* Most pages differ at the end if they differ at all */
+	if (val != page[last_pos])
+		return 0;
+
+	for (pos = 1; pos < last_pos; pos++) {
+		if (page[pos] != val)
 			return 0;
 	}
 
+	*element = val;
 	return 1;
 }
 
+static void zram_fill_page(void *ptr, size_t len, unsigned long element)
+{
+	unsigned long *page = ptr;
+	size_t pos;
+
+	if (!element) {
+		memset(ptr, 0, len);
+		return;
+	}
+
+	for (pos = 0; pos < len / sizeof(*page); pos++)
+		page[pos] = element;
+}
+
 static u64 zram_default_disksize_bytes(void)
 {
 #if 0
@@ -159,57 +244,119 @@ static void zram_set_disksize(struct zram *zram, u64 size_bytes)
 	set_capacity(zram->disk, size_bytes >> SECTOR_SHIFT);
 }
 
-static void zram_free_page(struct zram *zram, size_t index)
+/*
+ * Locate the object backing a table entry. With deduplication the
+ * object may be shared, so it is reached through the dedup entry.
+ */
+static unsigned long zram_get_obj(struct zram *zram, u32 index, u32 *size)
 {
-	u32 clen;
-	void *obj;
+	if (zram_test_flag(zram, index, ZRAM_DEDUP)) {
+		*size = zram->table[index].entry->len;
+		return zram->table[index].entry->handle;
+	}
 
-	struct page *page = zram->table[index].page;
-	u32 offset = zram->table[index].offset;
+	if (zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))
+		*size = PAGE_SIZE;
+	else
+		*size = zram->table[index].size;
+	return zram->table[index].handle;
+}
 
-	if (unlikely(!page)) {
-		/*
-		 * No memory is allocated for zero filled pages.
-		 * Simply clear zero page flag.
-		 */
-		if (zram_test_flag(zram, index, ZRAM_ZERO)) {
-			zram_clear_flag(zram, index, ZRAM_ZERO);
-			zram_stat_dec(&zram->stats.pages_zero);
-		}
+static void zram_free_obj(struct zram *zram, unsigned long handle, u32 size)
+{
+	if (unlikely(size == PAGE_SIZE)) {
+		__free_page((struct page *)handle);
+		zram_stat_dec(&zram->stats.pages_expand);
+	} else {
+		zram->allocator->free(zram->mem_pool, handle);
+		if (size <= PAGE_SIZE / 2)
+			zram_stat_dec(&zram->stats.good_compress);
+	}
+
+	zram_stat64_sub(zram, &zram->stats.compr_size, size);
+}
+
+/*
+ * Free a dedup entry whose last reference was dropped by zram_dedup_find()
+ * rather than by zram_free_page(). The page that went away meanwhile was
+ * accounted as a duplicate leaving, so undo that here.
+ */
+void zram_dedup_release(struct zram *zram, struct zram_dedup_entry *entry)
+{
+	zram_stat_inc(&zram->stats.pages_dup);
+	zram_stat64_add(zram, &zram->stats.dup_data_size, entry->len);
+	zram_free_obj(zram, entry->handle, entry->len);
+	kfree(entry);
+}
+
+/*
+ * Release memory held by a table entry. Caller must hold the slot lock.
+ */
+static void zram_free_page(struct zram *zram, size_t index)
+{
+	u32 size;
+	struct zram_dedup_entry *entry;
+
+	zram_clear_flag(zram, index, ZRAM_IDLE);
+	/* Lets a concurrent writeback notice that the page went away */
+	zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+
+	if (zram_test_flag(zram, index, ZRAM_WB)) {
+		zram_clear_flag(zram, index, ZRAM_WB);
+		zram_bdev_free_block(zram, zram->table[index].blk_idx);
+		zram->table[index].blk_idx = 0;
+		zram_stat_dec(&zram->stats.bd_count);
+		zram_stat_dec(&zram->stats.pages_stored);
 		return;
 	}
 
-	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
-		clen = PAGE_SIZE;
-		__free_page(page);
-		zram_clear_flag(zram, index, ZRAM_UNCOMPRESSED);
-		zram_stat_dec(&zram->stats.pages_expand);
-		goto out;
+	/*
+	 * No memory is allocated for same element filled pages.
+	 * Simply clear same page flag.
+	 */
+	if (zram_test_flag(zram, index, ZRAM_SAME)) {
+		zram_clear_flag(zram, index, ZRAM_SAME);
+		if (!zram->table[index].element)
+			zram_stat_dec(&zram->stats.pages_zero);
+		zram->table[index].element = 0;
+		zram_stat_dec(&zram->stats.pages_same);
+		return;
 	}
 
-	obj = kmap_atomic(page, KM_USER0) + offset;
-	clen = xv_get_object_size(obj) - sizeof(struct zobj_header);
-	kunmap_atomic(obj, KM_USER0);
+	if (unlikely(!zram->table[index].handle))
+		return;
 
-	xv_free(zram->mem_pool, page, offset);
-	if (clen <= PAGE_SIZE / 2)
-		zram_stat_dec(&zram->stats.good_compress);
+	if (zram_test_flag(zram, index, ZRAM_DEDUP)) {
+		entry = zram->table[index].entry;
+		zram_clear_flag(zram, index, ZRAM_DEDUP);
+
+		if (zram_dedup_put(zram, entry)) {
+			zram_free_obj(zram, entry->handle, entry->len);
+			kfree(entry);
+		} else {
+			zram_stat_dec(&zram->stats.pages_dup);
+			zram_stat64_sub(zram, &zram->stats.dup_data_size,
+					entry->len);
+		}
+	} else {
+		zram_get_obj(zram, index, &size);
+		zram_free_obj(zram, zram->table[index].handle, size);
+	}
 
-out:
-	zram_stat64_sub(zram, &zram->stats.compr_size, clen);
+	zram_clear_flag(zram, index, ZRAM_UNCOMPRESSED);
 	zram_stat_dec(&zram->stats.pages_stored);
 
-	zram->table[index].page = NULL;
-	zram->table[index].offset = 0;
+	zram->table[index].handle = 0;
+	zram->table[index].size = 0;
 }
 
-static void handle_zero_page(struct bio_vec *bvec)
+static void handle_same_page(struct bio_vec *bvec, unsigned long element)
 {
 	struct page *page = bvec->bv_page;
 	void *user_mem;
 
 	user_mem = kmap_atomic(page, KM_USER0);
-	memset(user_mem + bvec->bv_offset, 0, bvec->bv_len);
+	zram_fill_page(user_mem + bvec->bv_offset, bvec->bv_len, element);
 	kunmap_atomic(user_mem, KM_USER0);
 
 	flush_dcache_page(page);
@@ -218,14 +365,17 @@ static void handle_zero_page(struct bio_vec *bvec)
 static void handle_uncompressed_page(struct zram *zram, struct bio_vec *bvec,
 				     u32 index, int offset)
 {
+	u32 size;
+	unsigned long handle;
 	struct page *page = bvec->bv_page;
 	unsigned char *user_mem, *cmem;
 
+	handle = zram_get_obj(zram, index, &size);
 	user_mem = kmap_atomic(page, KM_USER0);
-	cmem = kmap_atomic(zram->table[index].page, KM_USER1);
+	cmem = zram_map_obj(zram, handle, size, ZS_MM_RO, KM_USER1);
 
 	memcpy(user_mem + bvec->bv_offset, cmem + offset, bvec->bv_len);
-	kunmap_atomic(cmem, KM_USER1);
+	zram_unmap_obj(zram, handle, size, cmem, KM_USER1);
 	kunmap_atomic(user_mem, KM_USER0);
 
 	flush_dcache_page(page);
@@ -236,66 +386,128 @@ static inline int is_partial_io(struct bio_vec *bvec)
 	return bvec->bv_len != PAGE_SIZE;
 }
 
+static int zram_read_from_bdev(struct zram *zram, struct bio_vec *bvec,
+			unsigned long blk_idx, int offset)
+{
+	int ret;
+	struct page *page;
+	unsigned char *user_mem, *mem;
+
+	zram_stat64_inc(zram, &zram->stats.bd_reads);
+
+	if (!is_partial_io(bvec)) {
+		ret = zram_bdev_read(zram, bvec->bv_page, blk_idx);
+		goto out;
+	}
+
+	page = alloc_page(GFP_NOIO);
+	if (!page)
+		return -ENOMEM;
+
+	ret = zram_bdev_read(zram, page, blk_idx);
+	if (!ret) {
+		user_mem = kmap_atomic(bvec->bv_page, KM_USER0);
+		mem = kmap_atomic(page, KM_USER1);
+		memcpy(user_mem + bvec->bv_offset, mem + offset,
+		       bvec->bv_len);
+		kunmap_atomic(mem, KM_USER1);
+		kunmap_atomic(user_mem, KM_USER0);
+	}
+	__free_page(page);
+
+out:
+	if (unlikely(ret)) {
+		pr_err("Backing device read failed! err=%d\n", ret);
+		zram_stat64_inc(zram, &zram->stats.failed_reads);
+		return ret;
+	}
+
+	flush_dcache_page(bvec->bv_page);
+	return 0;
+}
+
 static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 			  u32 index, int offset, struct bio *bio)
 {
 	int ret;
 	size_t clen;
+	u32 size;
+	unsigned long handle;
 	struct page *page;
 	struct zobj_header *zheader;
 	unsigned char *user_mem, *cmem, *uncmem = NULL;
 
 	page = bvec->bv_page;
 
-	if (zram_test_flag(zram, index, ZRAM_ZERO)) {
-		handle_zero_page(bvec);
+	if (is_partial_io(bvec)) {
+		/*
+		 * Use a temporary buffer to decompress the page. It has
+		 * to be allocated before taking the slot lock.
+		 */
+		uncmem = kmalloc(PAGE_SIZE, GFP_KERNEL);
+		if (!uncmem) {
+			pr_info("Error allocating temp memory!\n");
+			return -ENOMEM;
+		}
+	}
+
+	zram_lock_slot(zram, index);
+	zram_clear_flag(zram, index, ZRAM_IDLE);
+
+	if (zram_test_flag(zram, index, ZRAM_SAME)) {
+		unsigned long element = zram->table[index].element;
+
+		zram_unlock_slot(zram, index);
+		kfree(uncmem);
+		handle_same_page(bvec, element);
 		return 0;
 	}
 
+	if (zram_test_flag(zram, index, ZRAM_WB)) {
+		unsigned long blk_idx = zram->table[index].blk_idx;
+
+		zram_unlock_slot(zram, index);
+		kfree(uncmem);
+		return zram_read_from_bdev(zram, bvec, blk_idx, offset);
+	}
+
 	/* Requested page is not present in compressed area */
-	if (unlikely(!zram->table[index].page)) {
+	if (unlikely(!zram->table[index].handle)) {
+		zram_unlock_slot(zram, index);
+		kfree(uncmem);
 		pr_debug("Read before write: sector=%lu, size=%u",
 			 (ulong)(bio->bi_sector), bio->bi_size);
-		handle_zero_page(bvec);
+		handle_same_page(bvec, 0);
 		return 0;
 	}
 
 	/* Page is stored uncompressed since it's incompressible */
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
 		handle_uncompressed_page(zram, bvec, index, offset);
+		zram_unlock_slot(zram, index);
+		kfree(uncmem);
 		return 0;
 	}
 
-	if (is_partial_io(bvec)) {
-		/* Use  a temporary buffer to decompress the page */
-		uncmem = kmalloc(PAGE_SIZE, GFP_KERNEL);
-		if (!uncmem) {
-			pr_info("Error allocating temp memory!\n");
-			return -ENOMEM;
-		}
-	}
-
 	user_mem = kmap_atomic(page, KM_USER0);
 	if (!is_partial_io(bvec))
 		uncmem = user_mem;
 	clen = PAGE_SIZE;
 
-	cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-		zram->table[index].offset;
+	handle = zram_get_obj(zram, index, &size);
+	cmem = zram_map_obj(zram, handle, size, ZS_MM_RO, KM_USER1);
 
-	ret = DECOMPRESS(
-			cmem + sizeof(*zheader),
-			xv_get_object_size(cmem) - sizeof(*zheader),
+	ret = zram->comp->decompress(cmem + sizeof(*zheader), size,
 			uncmem, &clen);
 
-	if (is_partial_io(bvec)) {
+	if (is_partial_io(bvec))
 		memcpy(user_mem + bvec->bv_offset, uncmem + offset,
 		       bvec->bv_len);
-		kfree(uncmem);
-	}
 
-	kunmap_atomic(cmem, KM_USER1);
+	zram_unmap_obj(zram, handle, size, cmem, KM_USER1);
 	kunmap_atomic(user_mem, KM_USER0);
+	zram_unlock_slot(zram, index);
+	kfree(uncmem);
 
 	/* Should NEVER happen. Return bio error if it does. */
 	if (unlikely(ret)) {
@@ -309,37 +521,81 @@ static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 	return 0;
 }
 
-static int zram_read_before_write(struct zram *zram, char *mem, u32 index)
+/*
+ * Copy the uncompressed contents of a page held in memory into mem.
+ * Caller must hold the slot lock, and the page must not be ZRAM_WB.
+ */
+static int zram_read_page_locked(struct zram *zram, char *mem, u32 index)
 {
 	int ret;
 	size_t clen = PAGE_SIZE;
+	u32 size;
+	unsigned long handle;
 	struct zobj_header *zheader;
 	unsigned char *cmem;
 
-	if (zram_test_flag(zram, index, ZRAM_ZERO) ||
-	    !zram->table[index].page) {
+	if (zram_test_flag(zram, index, ZRAM_SAME)) {
+		zram_fill_page(mem, PAGE_SIZE, zram->table[index].element);
+		return 0;
+	}
+
+	if (!zram->table[index].handle) {
 		memset(mem, 0, PAGE_SIZE);
 		return 0;
 	}
 
-	cmem = kmap_atomic(zram->table[index].page, KM_USER0) +
-		zram->table[index].offset;
+	handle = zram_get_obj(zram, index, &size);
+	cmem = zram_map_obj(zram, handle, size, ZS_MM_RO, KM_USER0);
 
 	/* Page is stored uncompressed since it's incompressible */
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
 		memcpy(mem, cmem, PAGE_SIZE);
-		kunmap_atomic(cmem, KM_USER0);
+		zram_unmap_obj(zram, handle, size, cmem, KM_USER0);
 		return 0;
 	}
 
-	ret = DECOMPRESS(cmem + sizeof(*zheader),
-			xv_get_object_size(cmem) - sizeof(*zheader),
+	ret = zram->comp->decompress(cmem + sizeof(*zheader), size,
 			mem, &clen);
-	kunmap_atomic(cmem, KM_USER0);
+	zram_unmap_obj(zram, handle, size, cmem, KM_USER0);
 
+	return ret;
+}
+
+static int zram_read_before_write(struct zram *zram, char *mem, u32 index)
+{
+	int ret;
+	unsigned long blk_idx;
+	struct page *page;
+	void *src;
+
+	zram_lock_slot(zram, index);
+
+	if (zram_test_flag(zram, index, ZRAM_WB)) {
+		blk_idx = zram->table[index].blk_idx;
+		zram_unlock_slot(zram, index);
+
+		zram_stat64_inc(zram, &zram->stats.bd_reads);
+		page = alloc_page(GFP_NOIO);
+		if (!page)
+			return -ENOMEM;
+
+		ret = zram_bdev_read(zram, page, blk_idx);
+		if (!ret) {
+			src = kmap_atomic(page, KM_USER0);
+			memcpy(mem, src, PAGE_SIZE);
+			kunmap_atomic(src, KM_USER0);
+		}
+		__free_page(page);
+		goto out;
+	}
+
+	ret = zram_read_page_locked(zram, mem, index);
+	zram_unlock_slot(zram, index);
+
+out:
 	/* Should NEVER happen. Return bio error if it does. */
 	if (unlikely(ret)) {
-		pr_err("Decompression failed! err=%d, page=%u\n", ret, index);
+		pr_err("Read failed! err=%d, page=%u\n", ret, index);
 		zram_stat64_inc(zram, &zram->stats.failed_reads);
 		return ret;
 	}
@@ -351,14 +607,17 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 			   int offset)
 {
 	int ret;
-	u32 store_offset;
 	size_t clen;
+	int uncompressed = 0;
+	unsigned long element, handle;
+	u32 checksum = 0;
+	struct zram_dedup_entry *entry = NULL;
 	struct zobj_header *zheader;
-	struct page *page, *page_store;
+	struct zram_comp_strm *strm = NULL;
+	struct page *page;
 	unsigned char *user_mem, *cmem, *src, *uncmem = NULL;
 
 	page = bvec->bv_page;
-	src = zram->compress_buffer;
 
 	if (is_partial_io(bvec)) {
 		/*
@@ -372,19 +631,12 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 			goto out;
 		}
 		ret = zram_read_before_write(zram, uncmem, index);
-		if (ret) {
-			kfree(uncmem);
+		if (ret)
 			goto out;
-		}
 	}
 
-	/*
-	 * System overwrites unused sectors. Free memory associated
-	 * with this sector now.
-	 */
-	if (zram->table[index].page ||
-	    zram_test_flag(zram, index, ZRAM_ZERO))
-		zram_free_page(zram, index);
+	/* May sleep, so it must be done before mapping the user page */
+	strm = zram_comp_strm_find(zram);
 
 	user_mem = kmap_atomic(page, KM_USER0);
 
@@ -394,23 +646,52 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 	else
 		uncmem = user_mem;
 
-	if (page_zero_filled(uncmem)) {
+	if (page_same_filled(uncmem, &element)) {
 		kunmap_atomic(user_mem, KM_USER0);
-		if (is_partial_io(bvec))
-			kfree(uncmem);
-		zram_stat_inc(&zram->stats.pages_zero);
-		zram_set_flag(zram, index, ZRAM_ZERO);
+		/*
+		 * System overwrites unused sectors. Free memory associated
+		 * with this sector now.
+		 */
+		zram_lock_slot(zram, index);
+		zram_free_page(zram, index);
+		zram->table[index].element = element;
+		zram_set_flag(zram, index, ZRAM_SAME);
+		zram_unlock_slot(zram, index);
+		zram_stat_inc(&zram->stats.pages_same);
+		if (!element)
+			zram_stat_inc(&zram->stats.pages_zero);
 		ret = 0;
 		goto out;
 	}
 
-	COMPRESS(uncmem, PAGE_SIZE, src, &clen,
-		zram->compress_workmem);
-	ret = 0;
+	if (zram->use_dedup) {
+		checksum = zram_dedup_checksum(uncmem);
+		entry = zram_dedup_find(zram, uncmem, checksum, strm->buffer);
+		if (entry) {
+			kunmap_atomic(user_mem, KM_USER0);
+
+			zram_lock_slot(zram, index);
+			zram_free_page(zram, index);
+			zram->table[index].entry = entry;
+			zram_set_flag(zram, index, ZRAM_DEDUP);
+			if (entry->len == PAGE_SIZE)
+				zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
+			zram_unlock_slot(zram, index);
+
+			zram_stat_inc(&zram->stats.pages_stored);
+			zram_stat_inc(&zram->stats.pages_dup);
+			zram_stat64_add(zram, &zram->stats.dup_data_size,
+					entry->len);
+			ret = 0;
+			goto out;
+		}
+	}
+
+	src = strm->buffer;
+	ret = zram->comp->compress(uncmem, PAGE_SIZE, src, &clen,
+				strm->workmem);
 
 	kunmap_atomic(user_mem, KM_USER0);
-	if (is_partial_io(bvec))
-			kfree(uncmem);
 
 	if (unlikely(ret != 0)) {
 		pr_err("Compression failed! err=%d\n", ret);
@@ -424,25 +705,25 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 	 */
 	if (unlikely(clen > max_zpage_size)) {
 		clen = PAGE_SIZE;
-		page_store = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
-		if (unlikely(!page_store)) {
+		handle = (unsigned long)alloc_page(GFP_NOIO | __GFP_HIGHMEM);
+		if (unlikely(!handle)) {
 			pr_info("Error allocating memory for "
 				"incompressible page: %u\n", index);
 			ret = -ENOMEM;
 			goto out;
 		}
 
-		store_offset = 0;
-		zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
-		zram_stat_inc(&zram->stats.pages_expand);
-		zram->table[index].page = page_store;
-		src = kmap_atomic(page, KM_USER0);
+		uncompressed = 1;
+		if (is_partial_io(bvec))
+			src = uncmem;
+		else
+			src = kmap_atomic(page, KM_USER0);
 		goto memstore;
 	}
 
-	if (xv_malloc(zram->mem_pool, clen + sizeof(*zheader),
-		      &zram->table[index].page, &store_offset,
-		      GFP_NOIO | __GFP_HIGHMEM)) {
+	handle = zram->allocator->malloc(zram->mem_pool,
+			clen + sizeof(*zheader), GFP_NOIO | __GFP_HIGHMEM);
+	if (!handle) {
 		pr_info("Error allocating memory for compressed "
 			"page: %u, size=%zu\n", index, clen);
 		ret = -ENOMEM;
@@ -450,14 +731,11 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 	}
 
 memstore:
-	zram->table[index].offset = store_offset;
-
-	cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-		zram->table[index].offset;
+	cmem = zram_map_obj(zram, handle, clen, ZS_MM_WO, KM_USER1);
 
 #if 0
 	/* Back-reference needed for memory defragmentation */
-	if (!zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) {
+	if (!uncompressed) {
 		zheader = (struct zobj_header *)cmem;
 		zheader->table_idx = index;
 		cmem += sizeof(*zheader);
@@ -466,19 +744,47 @@ memstore:
 
 	memcpy(cmem, src, clen);
 
-	kunmap_atomic(cmem, KM_USER1);
-	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
+	zram_unmap_obj(zram, handle, clen, cmem, KM_USER1);
+	if (unlikely(uncompressed) && !is_partial_io(bvec))
 		kunmap_atomic(src, KM_USER0);
 
+	zram_comp_strm_release(zram, strm);
+	strm = NULL;
+
+	/* Without a dedup entry the object is simply not shared */
+	if (zram->use_dedup)
+		entry = zram_dedup_insert(zram, handle, clen, checksum);
+
+	/*
+	 * Free memory associated with the old contents of this sector
+	 * and publish the new object.
+	 */
+	zram_lock_slot(zram, index);
+	zram_free_page(zram, index);
+	if (entry) {
+		zram->table[index].entry = entry;
+		zram_set_flag(zram, index, ZRAM_DEDUP);
+	} else {
+		zram->table[index].handle = handle;
+		zram->table[index].size = clen;
+	}
+	if (unlikely(uncompressed))
+		zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
+	zram_unlock_slot(zram, index);
+
 	/* Update stats */
 	zram_stat64_add(zram, &zram->stats.compr_size, clen);
 	zram_stat_inc(&zram->stats.pages_stored);
-	if (clen <= PAGE_SIZE / 2)
+	if (unlikely(uncompressed))
+		zram_stat_inc(&zram->stats.pages_expand);
+	else if (clen <= PAGE_SIZE / 2)
 		zram_stat_inc(&zram->stats.good_compress);
 
-	return 0;
-
 out:
+	if (strm)
+		zram_comp_strm_release(zram, strm);
+	if (is_partial_io(bvec))
+		kfree(uncmem);
 	if (ret)
 		zram_stat64_inc(zram, &zram->stats.failed_writes);
 	return ret;
@@ -489,14 +795,17 @@ static int zram_bvec_rw(struct zram *zram, struct bio_vec *bvec, u32 index,
 {
 	int ret;
 
-	if (rw == READ) {
-		down_read(&zram->lock);
-		ret = zram_bvec_read(zram, bvec, index, offset, bio);
-		up_read(&zram->lock);
+	if (rw == READ)
+		return zram_bvec_read(zram, bvec, index, offset, bio);
+
+	if (is_partial_io(bvec)) {
+		down_write(&zram->partial_io_lock);
+		ret = zram_bvec_write(zram, bvec, index, offset);
+		up_write(&zram->partial_io_lock);
 	} else {
-		down_write(&zram->lock);
+		down_read(&zram->partial_io_lock);
 		ret = zram_bvec_write(zram, bvec, index, offset);
-		up_write(&zram->lock);
+		up_read(&zram->partial_io_lock);
 	}
 
 	return ret;
@@ -604,41 +913,167 @@ static int zram_make_request(struct request_queue *queue, struct bio *bio)
 	return 0;
 }
 
-void zram_reset_device(struct zram *zram)
+/*
+ * Mark all pages currently held in memory as idle. Any later access
+ * clears the mark, so ZRAM_WB_IDLE writeback only picks pages that were
+ * not touched in between.
+ */
+void zram_mark_idle(struct zram *zram)
 {
 	size_t index;
 
-	mutex_lock(&zram->init_lock);
-	zram->init_done = 0;
+	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
+		zram_lock_slot(zram, index);
+		if ((zram->table[index].handle ||
+		     zram_test_flag(zram, index, ZRAM_SAME)) &&
+		    !zram_test_flag(zram, index, ZRAM_WB))
+			zram_set_flag(zram, index, ZRAM_IDLE);
+		zram_unlock_slot(zram, index);
+	}
+}
 
-	/* Free various per-device buffers */
-	kfree(zram->compress_workmem);
-	free_pages((unsigned long)zram->compress_buffer, 1);
+static int zram_wb_candidate(struct zram *zram, u32 index,
+			enum zram_wb_mode mode)
+{
+	/* Same filled pages take no memory */
+	if (!zram->table[index].handle ||
+	    zram_test_flag(zram, index, ZRAM_SAME) ||
+	    zram_test_flag(zram, index, ZRAM_WB) ||
+	    zram_test_flag(zram, index, ZRAM_UNDER_WB))
+		return 0;
 
-	zram->compress_workmem = NULL;
-	zram->compress_buffer = NULL;
+	/*
+	 * With use_dedup every stored page has a dedup entry. Writing back
+	 * one page of a shared object frees no memory, so keep those in RAM.
+	 */
+	if (zram_test_flag(zram, index, ZRAM_DEDUP) &&
+	    zram_dedup_shared(zram, zram->table[index].entry))
+		return 0;
+
+	if (mode == ZRAM_WB_HUGE)
+		return zram_test_flag(zram, index, ZRAM_UNCOMPRESSED);
+
+	return zram_test_flag(zram, index, ZRAM_IDLE);
+}
+
+/*
+ * Move pages selected by mode to the backing device. Returns the number
+ * of pages written or a negative error.
+ */
+int zram_writeback(struct zram *zram, enum zram_wb_mode mode)
+{
+	int ret = 0, written = 0;
+	size_t index;
+	unsigned long blk_idx;
+	struct page *page;
+	void *mem;
+
+	if (!zram->bdev)
+		return -ENODEV;
+
+	page = alloc_page(GFP_KERNEL);
+	if (!page)
+		return -ENOMEM;
 
-	/* Free all pages that are still in this zram device */
 	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
-		struct page *page;
-		u16 offset;
+		zram_lock_slot(zram, index);
+		if (!zram_wb_candidate(zram, index, mode)) {
+			zram_unlock_slot(zram, index);
+			continue;
+		}
+
+		mem = kmap_atomic(page, KM_USER1);
+		ret = zram_read_page_locked(zram, mem, index);
+		kunmap_atomic(mem, KM_USER1);
+		if (ret) {
+			zram_unlock_slot(zram, index);
+			break;
+		}
 
-		page = zram->table[index].page;
-		offset = zram->table[index].offset;
+		zram_set_flag(zram, index, ZRAM_UNDER_WB);
+		zram_unlock_slot(zram, index);
 
-		if (!page)
+		ret = zram_bdev_alloc_block(zram, &blk_idx);
+		if (!ret) {
+			ret = zram_bdev_write(zram, page, blk_idx);
+			if (ret)
+				zram_bdev_free_block(zram, blk_idx);
+		}
+
+		zram_lock_slot(zram, index);
+		if (ret) {
+			zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+			zram_unlock_slot(zram, index);
+			break;
+		}
+
+		/*
+		 * The page was overwritten, freed, or (for idle writeback)
+		 * accessed while it was being written. Keep it in memory.
+		 */
+		if (!zram_test_flag(zram, index, ZRAM_UNDER_WB) ||
+		    (mode == ZRAM_WB_IDLE &&
+		     !zram_test_flag(zram, index, ZRAM_IDLE))) {
+			zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+			zram_unlock_slot(zram, index);
+			zram_bdev_free_block(zram, blk_idx);
 			continue;
+		}
 
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-			__free_page(page);
-		else
-			xv_free(zram->mem_pool, page, offset);
+		zram_free_page(zram, index);
+		zram->table[index].blk_idx = blk_idx;
+		zram_set_flag(zram, index, ZRAM_WB);
+		zram_unlock_slot(zram, index);
+
+		zram_stat_inc(&zram->stats.pages_stored);
+		zram_stat_inc(&zram->stats.bd_count);
+		zram_stat64_inc(zram, &zram->stats.bd_writes);
+		written++;
 	}
 
+	__free_page(page);
+
+	return ret ? ret : written;
+}
+
+/*
+ * Move objects out of sparsely used allocator pages so that those can
+ * be freed. Returns the number of pages released.
+ */
+unsigned long zram_compact(struct zram *zram)
+{
+	unsigned long freed;
+
+	if (!zram->allocator->compact)
+		return 0;
+
+	freed = zram->allocator->compact(zram->mem_pool);
+	zram_stat64_add(zram, &zram->stats.pages_compacted, freed);
+
+	return freed;
+}
+
+void zram_reset_device(struct zram *zram)
+{
+	size_t index;
+
+	mutex_lock(&zram->init_lock);
+	zram->init_done = 0;
+
+	/* Free various per-device buffers */
+	zram_comp_destroy_streams(zram);
+
+	/* Free all pages that are still in this zram device */
+	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++)
+		zram_free_page(zram, index);
+
 	vfree(zram->table);
 	zram->table = NULL;
 
-	xv_destroy_pool(zram->mem_pool);
+	zram_reset_backing_dev(zram);
+
+	if (zram->mem_pool)
+		zram->allocator->destroy(zram->mem_pool);
 	zram->mem_pool = NULL;
 
 	/* Reset stats */
@@ -660,18 +1095,9 @@ int zram_init_device(struct zram *zram)
 		return 0;
 	}
 
-	zram->compress_workmem = kzalloc(WMSIZE, GFP_KERNEL);
-	if (!zram->compress_workmem) {
-		pr_err("Error allocating compressor working memory!\n");
-		ret = -ENOMEM;
-		goto fail_no_table;
-	}
-
-	zram->compress_buffer =
-		(void *)__get_free_pages(GFP_KERNEL | __GFP_ZERO, 1);
-	if (!zram->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
-		ret = -ENOMEM;
+	ret = zram_comp_create_streams(zram);
+	if (ret) {
+		pr_err("Error allocating compression streams\n");
 		goto fail_no_table;
 	}
 
@@ -687,7 +1113,7 @@ int zram_init_device(struct zram *zram)
 	/* zram devices sort of resembles non-rotational disks */
 	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, zram->disk->queue);
 
-	zram->mem_pool = xv_create_pool();
+	zram->mem_pool = zram->allocator->create(zram->disk->disk_name);
 	if (!zram->mem_pool) {
 		pr_err("Error creating memory pool\n");
 		ret = -ENOMEM;
@@ -717,7 +1143,9 @@ static void zram_slot_free_notify(struct block_device *bdev,
 	struct zram *zram;
 
 	zram = bdev->bd_disk->private_data;
+	zram_lock_slot(zram, index);
 	zram_free_page(zram, index);
+	zram_unlock_slot(zram, index);
 	zram_stat64_inc(zram, &zram->stats.notify_free);
 }
 
@@ -730,10 +1158,19 @@ static int create_device(struct zram *zram, int device_id)
 {
 	int ret = 0;
 
-	init_rwsem(&zram->lock);
 	mutex_init(&zram->init_lock);
+	init_rwsem(&zram->partial_io_lock);
 	spin_lock_init(&zram->stat64_lock);
 
+	INIT_LIST_HEAD(&zram->idle_strm);
+	spin_lock_init(&zram->strm_lock);
+	init_waitqueue_head(&zram->strm_wait);
+	spin_lock_init(&zram->dedup_lock);
+	zram->dedup_root = RB_ROOT;
+	zram->max_comp_streams = num_online_cpus();
+	zram->comp = zram_default_compressor();
+	zram->allocator = zram_default_allocator();
+
 	zram->queue = blk_alloc_queue(GFP_KERNEL);
 	if (!zram->queue) {
 		pr_err("Error allocating disk queue for device %d\n",
@@ -848,6 +1285,9 @@ static int __init zram_init(void)
 			goto free_devices;
 	}
 
+	/* Failure only costs the frontswap backend, not the devices */
+	zram_frontswap_init();
+
 	return 0;
 
 free_devices:
@@ -17,8 +17,12 @@
 
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
+#include <linux/rwsem.h>
+#include <linux/rbtree.h>
+#include <linux/wait.h>
 
 #include "xvmalloc.h"
+#include "zsmalloc.h"
 
 /*
  * Some arbitrary value. This is just to catch
@@ -53,6 +57,8 @@ static const size_t max_zpage_size = PAGE_SIZE / 4 * 3;
  * NOTE: max_zpage_size must be less than or equal to:
  *   XV_MAX_ALLOC_SIZE - sizeof(struct zobj_header)
  * otherwise, xv_malloc() would always return failure.
+ * Incompressible pages are stored in a page of their own, never
+ * through the allocator.
  */
 
 /*-- End of configurable params */
@@ -71,22 +77,106 @@ enum zram_pageflags {
 	/* Page is stored uncompressed */
 	ZRAM_UNCOMPRESSED,
 
-	/* Page consists entirely of zeros */
-	ZRAM_ZERO,
+	/*
+	 * Page consists of a single repeated word (e.g. all zeros),
+	 * which is kept in table[page_no].element
+	 */
+	ZRAM_SAME,
+
+	/* Object is shared, table[page_no].entry points to its dedup entry */
+	ZRAM_DEDUP,
+
+	/* Page lives on the backing device at block table[page_no].blk_idx */
+	ZRAM_WB,
+
+	/* Page is being written to the backing device */
+	ZRAM_UNDER_WB,
+
+	/* Page has not been accessed since it was last marked idle */
+	ZRAM_IDLE,
+
+	/* Table entry is locked, see zram_lock_slot() */
+	ZRAM_ACCESS,
 
 	__NR_ZRAM_PAGEFLAGS,
 };
 
 /*-- Data structures */
 
+/*
+ * Stored object that may be shared by several table entries when
+ * deduplication is enabled. Indexed by checksum of the uncompressed
+ * contents in zram->dedup_root.
+ */
+struct zram_dedup_entry {
+	struct rb_node rb_node;
+	u32 checksum;
+	u32 len;		/* object size, PAGE_SIZE if uncompressed */
+	unsigned int refcount;	/* protected by zram->dedup_lock */
+	unsigned long handle;	/* see table.handle */
+};
+
 /* Allocated for each disk page */
 struct table {
-	struct page *page;
-	u16 offset;
+	union {
+		/*
+		 * Allocator handle of the object, or the struct page
+		 * holding a ZRAM_UNCOMPRESSED page
+		 */
+		unsigned long handle;
+		unsigned long element;	/* fill pattern of ZRAM_SAME page */
+		struct zram_dedup_entry *entry;	/* ZRAM_DEDUP page */
+		unsigned long blk_idx;	/* ZRAM_WB page */
+	};
+	unsigned long flags;	/* also holds the ZRAM_ACCESS lock bit */
+	u16 size;	/* compressed object size */
 	u8 count;	/* object ref count (not yet used) */
-	u8 flags;
 } __attribute__((aligned(4)));
 
+/*
+ * Compression backend. Selected per device through the 'comp_algorithm'
+ * sysfs node before the device is initialized.
+ */
+struct zram_compressor {
+	const char *name;
+	size_t workmem_size;
+	int (*compress)(const unsigned char *src, size_t src_len,
+			unsigned char *dst, size_t *dst_len, void *workmem);
+	int (*decompress)(const unsigned char *src, size_t src_len,
+			unsigned char *dst, size_t *dst_len);
+};
+
+/*
+ * Memory allocator for compressed objects. Objects are identified by
+ * an opaque (non-zero) handle and have to be mapped to be accessed.
+ * Selected per device through the 'allocator' sysfs node before the
+ * device is initialized.
+ */
+struct zram_allocator {
+	const char *name;
+	void *(*create)(const char *name);
+	void (*destroy)(void *pool);
+	unsigned long (*malloc)(void *pool, u32 size, gfp_t flags);
+	void (*free)(void *pool, unsigned long handle);
+	void *(*map)(void *pool, unsigned long handle, enum zs_mapmode mm,
+			enum km_type type);
+	void (*unmap)(void *pool, unsigned long handle, void *addr,
+			enum km_type type);
+	u64 (*total_size)(void *pool);
+	/* Optional. Returns the number of pages released */
+	unsigned long (*compact)(void *pool);
+};
+
+/*
+ * Compression workspace. Each writer borrows one from the per-device
+ * pool for the duration of a single page write.
+ */
+struct zram_comp_strm {
+	void *workmem;
+	void *buffer;		/* compressed output, 2 pages */
+	struct list_head list;
+};
+
 struct zram_stats {
 	u64 compr_size;		/* compressed size of pages stored */
 	u64 num_reads;		/* failed + successful */
@@ -95,25 +185,59 @@ struct zram_stats {
 	u64 failed_writes;	/* can happen when memory is too low */
 	u64 invalid_io;		/* non-page-aligned I/O requests */
 	u64 notify_free;	/* no. of swap slot free notifications */
-	u32 pages_zero;		/* no. of zero filled pages */
-	u32 pages_stored;	/* no. of pages currently stored */
-	u32 good_compress;	/* % of pages with compression ratio<=50% */
-	u32 pages_expand;	/* % of incompressible pages */
+	atomic_t pages_same;	/* no. of same element filled pages */
+	atomic_t pages_zero;	/* zero filled subset of pages_same */
+	atomic_t pages_stored;	/* no. of pages currently stored */
+	atomic_t good_compress;	/* % of pages with compression ratio<=50% */
+	atomic_t pages_expand;	/* % of incompressible pages */
+	u64 dup_data_size;	/* object bytes not stored thanks to dedup */
+	atomic_t pages_dup;	/* no. of pages sharing an existing object */
+	atomic_t bd_count;	/* no. of pages on the backing device */
+	u64 bd_reads;		/* no. of reads from the backing device */
+	u64 bd_writes;		/* no. of writes to the backing device */
+	u64 pages_compacted;	/* no. of pages freed by compaction */
+};
+
+enum zram_wb_mode {
+	ZRAM_WB_IDLE,		/* pages marked idle and not accessed since */
+	ZRAM_WB_HUGE,		/* incompressible pages */
 };
 
 struct zram {
-	struct xv_pool *mem_pool;
-	void *compress_workmem;
-	void *compress_buffer;
+	void *mem_pool;
+	const struct zram_allocator *allocator;
+	const struct zram_compressor *comp;
 	struct table *table;
 	spinlock_t stat64_lock;	/* protect 64-bit stats */
-        struct rw_semaphore lock; /* protect compression buffers and table
-                                   * against concurrent read and writes */
+
+	/* Pool of compression streams shared by concurrent writers */
+	struct list_head idle_strm;
+	spinlock_t strm_lock;	/* protects idle_strm */
+	wait_queue_head_t strm_wait;
+	unsigned int max_comp_streams;
+
+	/* Deduplication of identical pages, see zram_dedup.c */
+	int use_dedup;
+	struct rb_root dedup_root;
+	spinlock_t dedup_lock;	/* protects dedup_root and refcounts */
+
+	/* Backing device for writeback, see zram_wb.c */
+	char *backing_dev;
+	struct block_device *bdev;
+	unsigned long *bdev_bitmap;	/* allocated blocks */
+	unsigned long bdev_nr_pages;
+
 	struct request_queue *queue;
 	struct gendisk *disk;
 	int init_done;
 	/* Prevent concurrent execution of device init and reset */
 	struct mutex init_lock;
+	/*
+	 * A partial write reads the old page and publishes the merged one
+	 * without holding the slot lock in between, so it excludes all other
+	 * writes. Full page writes take it shared.
+	 */
+	struct rw_semaphore partial_io_lock;
 	/*
 	 * This is the limit on amount of *uncompressed* worth of data
 	 * we can store in a disk.
@@ -129,7 +253,53 @@ extern unsigned int num_devices;
 extern struct attribute_group zram_disk_attr_group;
 #endif
 
+extern const struct zram_compressor *zram_find_compressor(const char *name);
+extern const struct zram_compressor *zram_default_compressor(void);
+extern ssize_t zram_show_compressors(const struct zram_compressor *cur,
+				char *buf);
+
+extern const struct zram_allocator *zram_find_allocator(const char *name);
+extern const struct zram_allocator *zram_default_allocator(void);
+extern ssize_t zram_show_allocators(const struct zram_allocator *cur,
+				char *buf);
+extern void *zram_map_obj(struct zram *zram, unsigned long handle, u32 size,
+			enum zs_mapmode mm, enum km_type type);
+extern void zram_unmap_obj(struct zram *zram, unsigned long handle, u32 size,
+			void *addr, enum km_type type);
+
+extern u32 zram_dedup_checksum(void *mem);
+extern struct zram_dedup_entry *zram_dedup_find(struct zram *zram, void *mem,
+				u32 checksum, void *buffer);
+extern struct zram_dedup_entry *zram_dedup_insert(struct zram *zram,
+			unsigned long handle, u32 len, u32 checksum);
+extern int zram_dedup_shared(struct zram *zram,
+			struct zram_dedup_entry *entry);
+extern int zram_dedup_put(struct zram *zram, struct zram_dedup_entry *entry);
+extern void zram_dedup_release(struct zram *zram,
+			struct zram_dedup_entry *entry);
+
+extern int zram_set_backing_dev(struct zram *zram, const char *buf);
+extern void zram_reset_backing_dev(struct zram *zram);
+extern int zram_bdev_alloc_block(struct zram *zram, unsigned long *blk_idx);
+extern void zram_bdev_free_block(struct zram *zram, unsigned long blk_idx);
+extern int zram_bdev_write(struct zram *zram, struct page *page,
+			unsigned long blk_idx);
+extern int zram_bdev_read(struct zram *zram, struct page *page,
+			unsigned long blk_idx);
+
 extern int zram_init_device(struct zram *zram);
 extern void zram_reset_device(struct zram *zram);
+extern void zram_mark_idle(struct zram *zram);
+extern int zram_writeback(struct zram *zram, enum zram_wb_mode mode);
+extern unsigned long zram_compact(struct zram *zram);
+
+#ifdef CONFIG_ZRAM_FRONTSWAP
+extern int zram_frontswap_init(void);
+#else
+static inline int zram_frontswap_init(void)
+{
+	return 0;
+}
+#endif
 
 #endif
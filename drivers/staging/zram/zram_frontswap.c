@@ -0,0 +1,567 @@
+/*
+ * Compressed RAM block device
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ * Project home: http://compcache.googlecode.com
+ */
+
+/*
+ * Frontswap backend.
+ *
+ * Pages on their way to any swap device are compressed with a zram
+ * compressor and kept in a zram allocator pool instead. Pages that do
+ * not compress well, or arrive while the pool is full, go to the swap
+ * device as usual. Once the pool grows past its high watermark the
+ * least recently stored pages are written back to their slots on the
+ * swap device, so the device becomes a cold tier behind the compressed
+ * one.
+ *
+ * Writeback reads a page back through the swap cache (which gets it
+ * from us), drops it from frontswap and hands it to swap_writepage().
+ * Holding the locked swap cache page keeps every other reader and
+ * writer of the slot away meanwhile.
+ */
+
+#define KMSG_COMPONENT "zram"
+#define pr_fmt(fmt) KMSG_COMPONENT ": " fmt
+
+#include <linux/frontswap.h>
+#include <linux/highmem.h>
+#include <linux/kernel.h>
+#include <linux/kobject.h>
+#include <linux/list.h>
+#include <linux/mm.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/pagemap.h>
+#include <linux/percpu.h>
+#include <linux/rbtree.h>
+#include <linux/slab.h>
+#include <linux/swap.h>
+#include <linux/swapfile.h>
+#include <linux/swapops.h>
+#include <linux/sysfs.h>
+#include <linux/workqueue.h>
+#include <linux/writeback.h>
+
+#include "zram_drv.h"
+
+/* Writeback starts above the high and stops below the low watermark */
+#define ZFS_WB_HIGH	90	/* % of the pool limit */
+#define ZFS_WB_LOW	80
+#define ZFS_WB_BATCH	64	/* pages per work item run */
+
+/* put_page runs in reclaim with preemption off, it must not sleep */
+#define ZFS_GFP_MASK	(GFP_NOWAIT | __GFP_NOWARN | __GFP_NOMEMALLOC | \
+			 __GFP_HIGHMEM)
+
+struct zfs_entry {
+	struct rb_node node;
+	struct list_head lru;
+	unsigned type;
+	pgoff_t offset;
+	unsigned long handle;
+	u16 size;
+};
+
+struct zfs_stats {
+	unsigned long puts;
+	unsigned long gets;
+	unsigned long flushes;
+	unsigned long rejects;		/* compressed size too large */
+	unsigned long pool_full;	/* sent to disk, pool at its limit */
+	unsigned long alloc_fails;
+	unsigned long written_back;
+	unsigned long stored_pages;
+	unsigned long compr_bytes;
+};
+
+static DEFINE_SPINLOCK(zfs_lock);	/* trees, LRU and stats */
+static struct rb_root zfs_trees[MAX_SWAPFILES];
+static LIST_HEAD(zfs_lru);
+static struct zfs_stats zfs_stats;
+
+static const struct zram_compressor *zfs_comp;
+static const struct zram_allocator *zfs_allocator;
+static void *zfs_pool;
+static struct kmem_cache *zfs_entry_cache;
+
+static DEFINE_PER_CPU(void *, zfs_workmem);
+static DEFINE_PER_CPU(void *, zfs_buffer);
+
+static DEFINE_MUTEX(zfs_wb_mutex);
+static struct page *zfs_wb_page;	/* page being written back */
+static void zfs_wb_work_fn(struct work_struct *work);
+static DECLARE_WORK(zfs_wb_work, zfs_wb_work_fn);
+
+static int zfs_enabled = 1;
+module_param_named(frontswap, zfs_enabled, bool, 0444);
+MODULE_PARM_DESC(frontswap, "Compress swapped out pages in RAM");
+
+static unsigned int zfs_max_pool_percent = 20;
+module_param_named(frontswap_max_pool_percent, zfs_max_pool_percent,
+			uint, 0644);
+MODULE_PARM_DESC(frontswap_max_pool_percent,
+			"Frontswap pool size limit in percent of RAM");
+
+static int zfs_writeback = 1;
+module_param_named(frontswap_writeback, zfs_writeback, bool, 0644);
+MODULE_PARM_DESC(frontswap_writeback,
+			"Write cold pages to swap when the pool fills");
+
+static u64 zfs_pool_limit(unsigned int percent)
+{
+	return ((u64)totalram_pages * zfs_max_pool_percent / 100 * percent
+		/ 100) << PAGE_SHIFT;
+}
+
+static u64 zfs_pool_size(void)
+{
+	return zfs_allocator->total_size(zfs_pool);
+}
+
+static struct zfs_entry *zfs_lookup(unsigned type, pgoff_t offset)
+{
+	struct rb_node *node = zfs_trees[type].rb_node;
+	struct zfs_entry *entry;
+
+	while (node) {
+		entry = rb_entry(node, struct zfs_entry, node);
+		if (offset < entry->offset)
+			node = node->rb_left;
+		else if (offset > entry->offset)
+			node = node->rb_right;
+		else
+			return entry;
+	}
+
+	return NULL;
+}
+
+/* Returns the entry this one replaced, if any */
+static struct zfs_entry *zfs_insert(struct zfs_entry *entry)
+{
+	struct rb_root *root = &zfs_trees[entry->type];
+	struct rb_node **link = &root->rb_node, *parent = NULL;
+	struct zfs_entry *cur;
+
+	while (*link) {
+		parent = *link;
+		cur = rb_entry(parent, struct zfs_entry, node);
+		if (entry->offset < cur->offset) {
+			link = &parent->rb_left;
+		} else if (entry->offset > cur->offset) {
+			link = &parent->rb_right;
+		} else {
+			rb_replace_node(&cur->node, &entry->node, root);
+			return cur;
+		}
+	}
+
+	rb_link_node(&entry->node, parent, link);
+	rb_insert_color(&entry->node, root);
+	return NULL;
+}
+
+/* Called with zfs_lock held */
+static void zfs_unlink(struct zfs_entry *entry, int in_tree)
+{
+	if (in_tree)
+		rb_erase(&entry->node, &zfs_trees[entry->type]);
+	list_del(&entry->lru);
+	zfs_stats.stored_pages--;
+	zfs_stats.compr_bytes -= entry->size;
+}
+
+static void zfs_free_entry(struct zfs_entry *entry)
+{
+	zfs_allocator->free(zfs_pool, entry->handle);
+	kmem_cache_free(zfs_entry_cache, entry);
+}
+
+static void zfs_drop(unsigned type, pgoff_t offset)
+{
+	struct zfs_entry *entry;
+
+	spin_lock(&zfs_lock);
+	entry = zfs_lookup(type, offset);
+	if (entry)
+		zfs_unlink(entry, 1);
+	spin_unlock(&zfs_lock);
+
+	if (entry)
+		zfs_free_entry(entry);
+}
+
+/*
+ * frontswap clears its bit when a put over an existing page fails, but
+ * does not flush the old copy, so do that here.
+ */
+static int zfs_put_failed(unsigned type, pgoff_t offset, unsigned long *stat)
+{
+	spin_lock(&zfs_lock);
+	(*stat)++;
+	spin_unlock(&zfs_lock);
+
+	zfs_drop(type, offset);
+	return -1;
+}
+
+static void zfs_init(unsigned type)
+{
+	spin_lock(&zfs_lock);
+	WARN_ON(!RB_EMPTY_ROOT(&zfs_trees[type]));
+	zfs_trees[type] = RB_ROOT;
+	spin_unlock(&zfs_lock);
+}
+
+static int zfs_put_page(unsigned type, pgoff_t offset, struct page *page)
+{
+	struct zfs_entry *entry, *old;
+	size_t clen = PAGE_SIZE * 2;
+	unsigned long handle;
+	void *src, *dst, *obj;
+	int cpu, ret;
+
+	/* Being written back, frontswap has dropped it already */
+	if (page == zfs_wb_page)
+		return -1;
+
+	if (zfs_pool_size() >= zfs_pool_limit(100)) {
+		if (zfs_writeback)
+			schedule_work(&zfs_wb_work);
+		return zfs_put_failed(type, offset, &zfs_stats.pool_full);
+	}
+
+	entry = kmem_cache_alloc(zfs_entry_cache, ZFS_GFP_MASK);
+	if (!entry)
+		return zfs_put_failed(type, offset, &zfs_stats.alloc_fails);
+
+	cpu = get_cpu();
+	dst = per_cpu(zfs_buffer, cpu);
+	src = kmap_atomic(page, KM_USER0);
+	ret = zfs_comp->compress(src, PAGE_SIZE, dst, &clen,
+				 per_cpu(zfs_workmem, cpu));
+	kunmap_atomic(src, KM_USER0);
+
+	if (unlikely(ret) || clen > max_zpage_size) {
+		put_cpu();
+		kmem_cache_free(zfs_entry_cache, entry);
+		return zfs_put_failed(type, offset, &zfs_stats.rejects);
+	}
+
+	handle = zfs_allocator->malloc(zfs_pool, clen, ZFS_GFP_MASK);
+	if (!handle) {
+		put_cpu();
+		kmem_cache_free(zfs_entry_cache, entry);
+		return zfs_put_failed(type, offset, &zfs_stats.alloc_fails);
+	}
+
+	obj = zfs_allocator->map(zfs_pool, handle, ZS_MM_WO, KM_USER0);
+	memcpy(obj, dst, clen);
+	zfs_allocator->unmap(zfs_pool, handle, obj, KM_USER0);
+	put_cpu();
+
+	entry->type = type;
+	entry->offset = offset;
+	entry->handle = handle;
+	entry->size = clen;
+
+	spin_lock(&zfs_lock);
+	old = zfs_insert(entry);
+	if (old)
+		zfs_unlink(old, 0);
+	list_add(&entry->lru, &zfs_lru);
+	zfs_stats.puts++;
+	zfs_stats.stored_pages++;
+	zfs_stats.compr_bytes += clen;
+	spin_unlock(&zfs_lock);
+
+	if (old)
+		zfs_free_entry(old);
+
+	if (zfs_writeback && zfs_pool_size() > zfs_pool_limit(ZFS_WB_HIGH))
+		schedule_work(&zfs_wb_work);
+
+	return 0;
+}
+
+/*
+ * Only called for pages frontswap knows we have. The entry is not
+ * freed while we decompress it: the swap cache page for the slot is
+ * locked, so nobody can put or write back the slot, and flush_page
+ * only comes once the slot is unused.
+ */
+static int zfs_get_page(unsigned type, pgoff_t offset, struct page *page)
+{
+	struct zfs_entry *entry;
+	size_t dlen = PAGE_SIZE;
+	void *src, *dst;
+	int ret;
+
+	spin_lock(&zfs_lock);
+	entry = zfs_lookup(type, offset);
+	if (entry)
+		zfs_stats.gets++;
+	spin_unlock(&zfs_lock);
+
+	if (!entry)
+		return -1;
+
+	src = zfs_allocator->map(zfs_pool, entry->handle, ZS_MM_RO, KM_USER0);
+	dst = kmap_atomic(page, KM_USER1);
+	ret = zfs_comp->decompress(src, entry->size, dst, &dlen);
+	kunmap_atomic(dst, KM_USER1);
+	zfs_allocator->unmap(zfs_pool, entry->handle, src, KM_USER0);
+
+	if (unlikely(ret || dlen != PAGE_SIZE)) {
+		pr_err("frontswap: decompression failed, type %u offset %lu\n",
+			type, (unsigned long)offset);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void zfs_flush_page(unsigned type, pgoff_t offset)
+{
+	spin_lock(&zfs_lock);
+	zfs_stats.flushes++;
+	spin_unlock(&zfs_lock);
+
+	zfs_drop(type, offset);
+}
+
+static void zfs_flush_area(unsigned type)
+{
+	struct zfs_entry *entry;
+	struct rb_node *node;
+
+	spin_lock(&zfs_lock);
+	while ((node = rb_first(&zfs_trees[type]))) {
+		entry = rb_entry(node, struct zfs_entry, node);
+		zfs_unlink(entry, 1);
+		zfs_free_entry(entry);
+	}
+	spin_unlock(&zfs_lock);
+}
+
+static struct frontswap_ops zfs_ops = {
+	.init = zfs_init,
+	.put_page = zfs_put_page,
+	.get_page = zfs_get_page,
+	.flush_page = zfs_flush_page,
+	.flush_area = zfs_flush_area,
+};
+
+/*
+ * Move one stored page to its slot on the swap device. Returns 0 if
+ * the page was written (or its slot turned out to be unused).
+ */
+static int zfs_writeback_one(unsigned type, pgoff_t offset)
+{
+	struct writeback_control wbc = {
+		.sync_mode = WB_SYNC_NONE,
+	};
+	swp_entry_t swp = swp_entry(type, offset);
+	struct page *page;
+	int ret = -EBUSY;
+
+	/* Reads the page through frontswap unless it is cached already */
+	page = read_swap_cache_async(swp, GFP_KERNEL, NULL, 0);
+	if (!page)
+		return -ENOMEM;
+
+	lock_page(page);
+	/*
+	 * A dirty or in-flight page will be written (and put again) by
+	 * reclaim, and a page that is no longer this slot's is none of
+	 * our business.
+	 */
+	if (!PageSwapCache(page) || page_private(page) != swp.val ||
+	    !PageUptodate(page) || PageDirty(page) || PageWriteback(page)) {
+		unlock_page(page);
+		goto out;
+	}
+
+	spin_lock(&swap_lock);
+	__frontswap_flush_page(type, offset);
+	spin_unlock(&swap_lock);
+
+	/* Let reclaim drop the page as soon as the write is done */
+	SetPageReclaim(page);
+
+	zfs_wb_page = page;
+	ret = swap_writepage(page, &wbc);	/* unlocks the page */
+	zfs_wb_page = NULL;
+
+	if (!ret) {
+		spin_lock(&zfs_lock);
+		zfs_stats.written_back++;
+		spin_unlock(&zfs_lock);
+	}
+out:
+	page_cache_release(page);
+	return ret;
+}
+
+static void zfs_wb_work_fn(struct work_struct *work)
+{
+	struct zfs_entry *entry;
+	unsigned type;
+	pgoff_t offset;
+	int i;
+
+	mutex_lock(&zfs_wb_mutex);
+	for (i = 0; i < ZFS_WB_BATCH && zfs_writeback; i++) {
+		if (zfs_pool_size() <= zfs_pool_limit(ZFS_WB_LOW))
+			break;
+
+		spin_lock(&zfs_lock);
+		if (list_empty(&zfs_lru)) {
+			spin_unlock(&zfs_lock);
+			break;
+		}
+		/* Rotate, so an entry we fail on is not retried at once */
+		entry = list_entry(zfs_lru.prev, struct zfs_entry, lru);
+		list_move(&entry->lru, &zfs_lru);
+		type = entry->type;
+		offset = entry->offset;
+		spin_unlock(&zfs_lock);
+
+		zfs_writeback_one(type, offset);
+	}
+	mutex_unlock(&zfs_wb_mutex);
+
+	if (i == ZFS_WB_BATCH)
+		schedule_work(&zfs_wb_work);
+}
+
+#define ZFS_STAT_ATTR(_name)						\
+static ssize_t _name##_show(struct kobject *kobj,			\
+			struct kobj_attribute *attr, char *buf)		\
+{									\
+	return sprintf(buf, "%lu\n", zfs_stats._name);			\
+}									\
+static struct kobj_attribute _name##_attr = __ATTR_RO(_name)
+
+ZFS_STAT_ATTR(puts);
+ZFS_STAT_ATTR(gets);
+ZFS_STAT_ATTR(flushes);
+ZFS_STAT_ATTR(rejects);
+ZFS_STAT_ATTR(pool_full);
+ZFS_STAT_ATTR(alloc_fails);
+ZFS_STAT_ATTR(written_back);
+ZFS_STAT_ATTR(stored_pages);
+ZFS_STAT_ATTR(compr_bytes);
+
+static ssize_t pool_bytes_show(struct kobject *kobj,
+			struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%llu\n", (unsigned long long)zfs_pool_size());
+}
+static struct kobj_attribute pool_bytes_attr = __ATTR_RO(pool_bytes);
+
+static struct attribute *zfs_attrs[] = {
+	&puts_attr.attr,
+	&gets_attr.attr,
+	&flushes_attr.attr,
+	&rejects_attr.attr,
+	&pool_full_attr.attr,
+	&alloc_fails_attr.attr,
+	&written_back_attr.attr,
+	&stored_pages_attr.attr,
+	&compr_bytes_attr.attr,
+	&pool_bytes_attr.attr,
+	NULL,
+};
+
+static struct attribute_group zfs_attr_group = {
+	.attrs = zfs_attrs,
+	.name = "zram_frontswap",
+};
+
+static void zfs_free_percpu(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		kfree(per_cpu(zfs_workmem, cpu));
+		per_cpu(zfs_workmem, cpu) = NULL;
+		free_pages((unsigned long)per_cpu(zfs_buffer, cpu), 1);
+		per_cpu(zfs_buffer, cpu) = NULL;
+	}
+}
+
+static int __init zfs_alloc_percpu(void)
+{
+	int cpu;
+
+	/* Compressed output may exceed a page before it is rejected */
+	for_each_possible_cpu(cpu) {
+		per_cpu(zfs_workmem, cpu) = kzalloc(zfs_comp->workmem_size,
+							GFP_KERNEL);
+		per_cpu(zfs_buffer, cpu) = (void *)__get_free_pages(
+							GFP_KERNEL, 1);
+		if (!per_cpu(zfs_workmem, cpu) || !per_cpu(zfs_buffer, cpu)) {
+			zfs_free_percpu();
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Registers the frontswap backend. frontswap cannot unregister, so
+ * this is only built with zram built in. It has to run before swapon
+ * for frontswap to cover a swap device.
+ */
+int __init zram_frontswap_init(void)
+{
+	int ret = -ENOMEM;
+
+	if (!zfs_enabled)
+		return 0;
+
+	zfs_comp = zram_default_compressor();
+	zfs_allocator = zram_default_allocator();
+
+	zfs_pool = zfs_allocator->create("zram_frontswap");
+	if (!zfs_pool)
+		goto out;
+
+	zfs_entry_cache = KMEM_CACHE(zfs_entry, 0);
+	if (!zfs_entry_cache)
+		goto out_pool;
+
+	ret = zfs_alloc_percpu();
+	if (ret)
+		goto out_cache;
+
+	ret = sysfs_create_group(mm_kobj, &zfs_attr_group);
+	if (ret)
+		goto out_percpu;
+
+	frontswap_register_ops(&zfs_ops);
+	pr_info("frontswap enabled using %s and %s\n", zfs_comp->name,
+		zfs_allocator->name);
+	return 0;
+
+out_percpu:
+	zfs_free_percpu();
+out_cache:
+	kmem_cache_destroy(zfs_entry_cache);
+out_pool:
+	zfs_allocator->destroy(zfs_pool);
+out:
+	pr_err("frontswap initialization failed: %d\n", ret);
+	return ret;
+}
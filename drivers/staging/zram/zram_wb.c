@@ -0,0 +1,217 @@
+/*
+ * Compressed RAM block device
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ * Project home: http://compcache.googlecode.com
+ */
+
+/*
+ * Backing device support.
+ *
+ * Incompressible or idle pages can be written back to a block device
+ * (a partition, or a loop device for a file) to release their memory.
+ * The backing device is managed in PAGE_SIZE blocks tracked by a bitmap.
+ */
+
+#define KMSG_COMPONENT "zram"
+#define pr_fmt(fmt) KMSG_COMPONENT ": " fmt
+
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/completion.h>
+#include <linux/ctype.h>
+#include <linux/err.h>
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+
+#include "zram_drv.h"
+
+#define ZRAM_BDEV_MODE	(FMODE_READ | FMODE_WRITE)
+
+void zram_reset_backing_dev(struct zram *zram)
+{
+	if (!zram->bdev)
+		return;
+
+	close_bdev_exclusive(zram->bdev, ZRAM_BDEV_MODE);
+	zram->bdev = NULL;
+
+	vfree(zram->bdev_bitmap);
+	zram->bdev_bitmap = NULL;
+	zram->bdev_nr_pages = 0;
+
+	kfree(zram->backing_dev);
+	zram->backing_dev = NULL;
+}
+
+int zram_set_backing_dev(struct zram *zram, const char *buf)
+{
+	int ret;
+	char *path;
+	size_t len, bitmap_size;
+	unsigned long nr_pages;
+	struct block_device *bdev;
+
+	len = strlen(buf);
+	while (len && isspace(buf[len - 1]))
+		len--;
+	if (!len)
+		return -EINVAL;
+
+	path = kmalloc(len + 1, GFP_KERNEL);
+	if (!path)
+		return -ENOMEM;
+	memcpy(path, buf, len);
+	path[len] = '\0';
+
+	bdev = open_bdev_exclusive(path, ZRAM_BDEV_MODE, zram);
+	if (IS_ERR(bdev)) {
+		pr_info("Cannot open backing device %s\n", path);
+		ret = PTR_ERR(bdev);
+		goto fail;
+	}
+
+	nr_pages = i_size_read(bdev->bd_inode) >> PAGE_SHIFT;
+	if (!nr_pages) {
+		ret = -EINVAL;
+		goto fail_close;
+	}
+
+	bitmap_size = BITS_TO_LONGS(nr_pages) * sizeof(long);
+	zram_reset_backing_dev(zram);
+
+	zram->bdev_bitmap = vmalloc(bitmap_size);
+	if (!zram->bdev_bitmap) {
+		ret = -ENOMEM;
+		goto fail_close;
+	}
+	memset(zram->bdev_bitmap, 0, bitmap_size);
+
+	zram->bdev = bdev;
+	zram->bdev_nr_pages = nr_pages;
+	zram->backing_dev = path;
+
+	pr_info("Using %s as backing device (%lu pages)\n", path, nr_pages);
+	return 0;
+
+fail_close:
+	close_bdev_exclusive(bdev, ZRAM_BDEV_MODE);
+fail:
+	kfree(path);
+	return ret;
+}
+
+int zram_bdev_alloc_block(struct zram *zram, unsigned long *blk_idx)
+{
+	unsigned long idx = 0;
+
+	for (;;) {
+		idx = find_next_zero_bit(zram->bdev_bitmap,
+					zram->bdev_nr_pages, idx);
+		if (idx >= zram->bdev_nr_pages)
+			return -ENOSPC;
+		if (!test_and_set_bit(idx, zram->bdev_bitmap))
+			break;
+	}
+
+	*blk_idx = idx;
+	return 0;
+}
+
+void zram_bdev_free_block(struct zram *zram, unsigned long blk_idx)
+{
+	WARN_ON(!test_and_clear_bit(blk_idx, zram->bdev_bitmap));
+}
+
+static void zram_bdev_end_io(struct bio *bio, int err)
+{
+	complete(bio->bi_private);
+}
+
+/*
+ * Synchronous single page I/O to the backing device. Must not be called
+ * from zram's make_request function: bios submitted from there are only
+ * dispatched once it returns.
+ */
+static int zram_bdev_rw(struct zram *zram, struct page *page,
+			unsigned long blk_idx, int rw)
+{
+	int ret = 0;
+	struct bio *bio;
+	DECLARE_COMPLETION_ONSTACK(done);
+
+	bio = bio_alloc(GFP_NOIO, 1);
+	if (!bio)
+		return -ENOMEM;
+
+	bio->bi_bdev = zram->bdev;
+	bio->bi_sector = (sector_t)blk_idx << SECTORS_PER_PAGE_SHIFT;
+	bio->bi_end_io = zram_bdev_end_io;
+	bio->bi_private = &done;
+	if (!bio_add_page(bio, page, PAGE_SIZE, 0)) {
+		bio_put(bio);
+		return -EIO;
+	}
+
+	submit_bio(rw, bio);
+	wait_for_completion(&done);
+
+	if (!test_bit(BIO_UPTODATE, &bio->bi_flags))
+		ret = -EIO;
+	bio_put(bio);
+
+	return ret;
+}
+
+int zram_bdev_write(struct zram *zram, struct page *page,
+			unsigned long blk_idx)
+{
+	return zram_bdev_rw(zram, page, blk_idx, WRITE);
+}
+
+struct zram_bdev_work {
+	struct work_struct work;
+	struct zram *zram;
+	struct page *page;
+	unsigned long blk_idx;
+	int ret;
+};
+
+static void zram_bdev_read_work(struct work_struct *work)
+{
+	struct zram_bdev_work *zw =
+		container_of(work, struct zram_bdev_work, work);
+
+	zw->ret = zram_bdev_rw(zw->zram, zw->page, zw->blk_idx, READ);
+}
+
+/*
+ * Read a page back from the backing device. This is called from the
+ * zram I/O path, so the bio is submitted and waited for in a worker.
+ */
+int zram_bdev_read(struct zram *zram, struct page *page,
+			unsigned long blk_idx)
+{
+	struct zram_bdev_work zw;
+
+	zw.zram = zram;
+	zw.page = page;
+	zw.blk_idx = blk_idx;
+
+	INIT_WORK(&zw.work, zram_bdev_read_work);
+	schedule_work(&zw.work);
+	flush_work(&zw.work);
+
+	return zw.ret;
+}
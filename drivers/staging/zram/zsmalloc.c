@@ -0,0 +1,558 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+/*
+ * Size class based allocator for compressed pages.
+ *
+ * Allocation sizes are rounded up to one of ZS_NR_CLASSES size classes.
+ * Each class packs its objects back to back into zspages made of a few
+ * 0-order (possibly highmem) pages, so an object may span two pages.
+ * All metadata is kept off-page.
+ *
+ * Unlike xvmalloc, objects are only reachable through a handle, so
+ * zs_compact() can move them out of sparsely used zspages and give the
+ * emptied pages back to the system.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/bit_spinlock.h>
+#include <linux/highmem.h>
+#include <linux/percpu.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "zsmalloc.h"
+#include "zsmalloc_int.h"
+
+static int get_size_class_index(u32 size)
+{
+	if (size <= ZS_MIN_ALLOC_SIZE)
+		return 0;
+
+	return DIV_ROUND_UP(size - ZS_MIN_ALLOC_SIZE, ZS_SIZE_CLASS_DELTA);
+}
+
+/*
+ * Pick the zspage size (in pages) that wastes the smallest fraction
+ * of its space for the given object size.
+ */
+static unsigned int get_pages_per_zspage(u32 size)
+{
+	unsigned int i, best = 1;
+	unsigned long zspage_size, usedpc, max_usedpc = 0;
+
+	for (i = 1; i <= ZS_MAX_PAGES_PER_ZSPAGE; i++) {
+		zspage_size = i * PAGE_SIZE;
+		usedpc = (zspage_size - zspage_size % size) * 100 / zspage_size;
+		if (usedpc > max_usedpc) {
+			max_usedpc = usedpc;
+			best = i;
+		}
+	}
+
+	return best;
+}
+
+static int zspage_full(struct zspage *zspage)
+{
+	return zspage->inuse == zspage->class->objs_per_zspage;
+}
+
+/* Offset of an object within the zspage as a whole */
+static unsigned long obj_offset(struct zspage *zspage, unsigned int idx)
+{
+	return (unsigned long)idx * zspage->class->size;
+}
+
+static int obj_spans_pages(struct zspage *zspage, unsigned int idx)
+{
+	unsigned long off = obj_offset(zspage, idx) & ~PAGE_MASK;
+
+	return off + zspage->class->size > PAGE_SIZE;
+}
+
+static unsigned int obj_take_slot(struct zspage *zspage, unsigned long handle)
+{
+	unsigned int idx = zspage->freelist;
+
+	zspage->freelist = OBJ_FREE_NEXT(zspage->handles[idx]);
+	zspage->handles[idx] = handle;
+	zspage->inuse++;
+
+	return idx;
+}
+
+static void obj_put_slot(struct zspage *zspage, unsigned int idx)
+{
+	zspage->handles[idx] = OBJ_FREE_ENCODE(zspage->freelist);
+	zspage->freelist = idx;
+	zspage->inuse--;
+}
+
+/*
+ * Copy an object to or from buf, mapping one page at a time so a
+ * single kmap slot is enough for objects that span two pages.
+ */
+static void obj_copy_buf(struct zspage *zspage, unsigned int idx, char *buf,
+			int to_obj, enum km_type type)
+{
+	u32 len, done = 0, size = zspage->class->size;
+	unsigned long off = obj_offset(zspage, idx);
+	unsigned char *addr;
+
+	while (done < size) {
+		len = min_t(u32, size - done, PAGE_SIZE - (off & ~PAGE_MASK));
+		addr = kmap_atomic(zspage->pages[off >> PAGE_SHIFT], type);
+		if (to_obj)
+			memcpy(addr + (off & ~PAGE_MASK), buf + done, len);
+		else
+			memcpy(buf + done, addr + (off & ~PAGE_MASK), len);
+		kunmap_atomic(addr, type);
+
+		done += len;
+		off += len;
+	}
+}
+
+/* Copy an object between two slots of the same class */
+static void obj_copy(struct zspage *src, unsigned int sidx,
+			struct zspage *dst, unsigned int didx)
+{
+	u32 len, done = 0, size = src->class->size;
+	unsigned long soff = obj_offset(src, sidx);
+	unsigned long doff = obj_offset(dst, didx);
+	unsigned char *saddr, *daddr;
+
+	while (done < size) {
+		len = min_t(u32, size - done, PAGE_SIZE - (soff & ~PAGE_MASK));
+		len = min_t(u32, len, PAGE_SIZE - (doff & ~PAGE_MASK));
+
+		saddr = kmap_atomic(src->pages[soff >> PAGE_SHIFT], KM_USER0);
+		daddr = kmap_atomic(dst->pages[doff >> PAGE_SHIFT], KM_USER1);
+		memcpy(daddr + (doff & ~PAGE_MASK), saddr + (soff & ~PAGE_MASK),
+			len);
+		kunmap_atomic(daddr, KM_USER1);
+		kunmap_atomic(saddr, KM_USER0);
+
+		done += len;
+		soff += len;
+		doff += len;
+	}
+}
+
+static void free_zspage(struct zs_pool *pool, struct zspage *zspage)
+{
+	unsigned int i;
+	unsigned int nr_pages = zspage->class->pages_per_zspage;
+
+	for (i = 0; i < nr_pages; i++) {
+		if (zspage->pages[i])
+			__free_page(zspage->pages[i]);
+	}
+
+	atomic_sub(nr_pages, &pool->total_pages);
+	kfree(zspage);
+}
+
+static struct zspage *alloc_zspage(struct zs_pool *pool,
+			struct size_class *class, gfp_t flags)
+{
+	unsigned int i, next;
+	struct zspage *zspage;
+
+	zspage = kzalloc(sizeof(*zspage) +
+			class->objs_per_zspage * sizeof(unsigned long),
+			flags & ~__GFP_HIGHMEM);
+	if (!zspage)
+		return NULL;
+
+	zspage->class = class;
+	INIT_LIST_HEAD(&zspage->list);
+	/* Accounted up front so that free_zspage() can undo a partial zspage */
+	atomic_add(class->pages_per_zspage, &pool->total_pages);
+
+	for (i = 0; i < class->pages_per_zspage; i++) {
+		zspage->pages[i] = alloc_page(flags);
+		if (!zspage->pages[i]) {
+			free_zspage(pool, zspage);
+			return NULL;
+		}
+	}
+
+	for (i = 0; i < class->objs_per_zspage; i++) {
+		next = i + 1 < class->objs_per_zspage ? i + 1 : OBJ_NONE;
+		zspage->handles[i] = OBJ_FREE_ENCODE(next);
+	}
+	zspage->freelist = 0;
+
+	return zspage;
+}
+
+/*
+ * Create a memory pool. name is used to tell apart the handle caches
+ * of different pools.
+ */
+struct zs_pool *zs_create_pool(const char *name)
+{
+	int i, cpu;
+	struct zs_pool *pool;
+	struct size_class *class;
+
+	pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+	if (!pool)
+		return NULL;
+
+	for (i = 0; i < ZS_NR_CLASSES; i++) {
+		class = &pool->size_class[i];
+		spin_lock_init(&class->lock);
+		INIT_LIST_HEAD(&class->partial);
+		INIT_LIST_HEAD(&class->full);
+		class->size = ZS_MIN_ALLOC_SIZE + i * ZS_SIZE_CLASS_DELTA;
+		class->pages_per_zspage = get_pages_per_zspage(class->size);
+		class->objs_per_zspage = class->pages_per_zspage * PAGE_SIZE /
+					class->size;
+	}
+
+	pool->name = kasprintf(GFP_KERNEL, "zs_handle-%s", name);
+	if (!pool->name)
+		goto fail;
+
+	pool->handle_cachep = kmem_cache_create(pool->name,
+				sizeof(struct zs_handle), 0, 0, NULL);
+	if (!pool->handle_cachep)
+		goto fail;
+
+	pool->map_area = alloc_percpu(struct zs_map_area);
+	if (!pool->map_area)
+		goto fail;
+
+	for_each_possible_cpu(cpu) {
+		struct zs_map_area *area = per_cpu_ptr(pool->map_area, cpu);
+
+		area->buf = kmalloc(ZS_MAX_ALLOC_SIZE, GFP_KERNEL);
+		if (!area->buf)
+			goto fail;
+	}
+
+	return pool;
+
+fail:
+	zs_destroy_pool(pool);
+	return NULL;
+}
+EXPORT_SYMBOL_GPL(zs_create_pool);
+
+static void destroy_zspage_list(struct zs_pool *pool, struct list_head *head)
+{
+	unsigned int i;
+	struct zspage *zspage, *tmp;
+
+	list_for_each_entry_safe(zspage, tmp, head, list) {
+		for (i = 0; i < zspage->class->objs_per_zspage; i++) {
+			if (!(zspage->handles[i] & OBJ_FREE))
+				kmem_cache_free(pool->handle_cachep,
+					(void *)zspage->handles[i]);
+		}
+		list_del(&zspage->list);
+		free_zspage(pool, zspage);
+	}
+}
+
+void zs_destroy_pool(struct zs_pool *pool)
+{
+	int i, cpu;
+	struct size_class *class;
+
+	for (i = 0; i < ZS_NR_CLASSES; i++) {
+		class = &pool->size_class[i];
+		if (!list_empty(&class->partial) || !list_empty(&class->full))
+			pr_info("zsmalloc: freeing non-empty size class %u\n",
+				class->size);
+		destroy_zspage_list(pool, &class->partial);
+		destroy_zspage_list(pool, &class->full);
+	}
+
+	if (pool->map_area) {
+		for_each_possible_cpu(cpu)
+			kfree(per_cpu_ptr(pool->map_area, cpu)->buf);
+		free_percpu(pool->map_area);
+	}
+
+	if (pool->handle_cachep)
+		kmem_cache_destroy(pool->handle_cachep);
+	kfree(pool->name);
+	kfree(pool);
+}
+EXPORT_SYMBOL_GPL(zs_destroy_pool);
+
+/**
+ * zs_malloc - Allocate block of given size from pool.
+ * @pool: pool to allocate from
+ * @size: size of block to allocate
+ * @flags: gfp flags for any new pages (may include __GFP_HIGHMEM)
+ *
+ * Returns a handle to the new object, or 0 on failure. The object can
+ * only be accessed through zs_map_object().
+ */
+unsigned long zs_malloc(struct zs_pool *pool, u32 size, gfp_t flags)
+{
+	unsigned int idx;
+	struct zs_handle *handle;
+	struct size_class *class;
+	struct zspage *zspage;
+
+	if (unlikely(!size || size > ZS_MAX_ALLOC_SIZE))
+		return 0;
+
+	handle = kmem_cache_alloc(pool->handle_cachep, flags & ~__GFP_HIGHMEM);
+	if (!handle)
+		return 0;
+	handle->flags = 0;
+
+	class = &pool->size_class[get_size_class_index(size)];
+
+	spin_lock(&class->lock);
+	if (list_empty(&class->partial)) {
+		spin_unlock(&class->lock);
+
+		zspage = alloc_zspage(pool, class, flags);
+		if (!zspage) {
+			kmem_cache_free(pool->handle_cachep, handle);
+			return 0;
+		}
+
+		spin_lock(&class->lock);
+		list_add(&zspage->list, &class->partial);
+	}
+
+	zspage = list_first_entry(&class->partial, struct zspage, list);
+	idx = obj_take_slot(zspage, (unsigned long)handle);
+	handle->zspage = zspage;
+	handle->idx = idx;
+
+	if (zspage_full(zspage))
+		list_move(&zspage->list, &class->full);
+	spin_unlock(&class->lock);
+
+	return (unsigned long)handle;
+}
+EXPORT_SYMBOL_GPL(zs_malloc);
+
+void zs_free(struct zs_pool *pool, unsigned long obj)
+{
+	int was_full, empty;
+	struct zs_handle *handle = (struct zs_handle *)obj;
+	struct size_class *class;
+	struct zspage *zspage;
+
+	/* Keeps zs_compact() from moving the object under us */
+	bit_spin_lock(HANDLE_PIN, &handle->flags);
+	zspage = handle->zspage;
+	class = zspage->class;
+
+	spin_lock(&class->lock);
+	was_full = zspage_full(zspage);
+	obj_put_slot(zspage, handle->idx);
+
+	empty = !zspage->inuse;
+	if (empty)
+		list_del(&zspage->list);
+	else if (was_full)
+		list_move(&zspage->list, &class->partial);
+	spin_unlock(&class->lock);
+
+	bit_spin_unlock(HANDLE_PIN, &handle->flags);
+	kmem_cache_free(pool->handle_cachep, handle);
+
+	if (empty)
+		free_zspage(pool, zspage);
+}
+EXPORT_SYMBOL_GPL(zs_free);
+
+/**
+ * zs_map_object - get address of allocated object from handle.
+ * @pool: pool from which the object was allocated
+ * @handle: handle returned from zs_malloc
+ * @mm: how the mapping is going to be used
+ * @type: kmap_atomic slot to use
+ *
+ * The object is pinned in place until zs_unmap_object() and the
+ * caller must not sleep in between. Only one mapping per pool may be
+ * held on a cpu at any time: an object that spans two pages is copied
+ * into a per-cpu buffer (and written back on unmap unless mm is
+ * ZS_MM_RO).
+ */
+void *zs_map_object(struct zs_pool *pool, unsigned long handle,
+			enum zs_mapmode mm, enum km_type type)
+{
+	unsigned long off;
+	struct zs_handle *h = (struct zs_handle *)handle;
+	struct zs_map_area *area;
+	struct zspage *zspage;
+
+	bit_spin_lock(HANDLE_PIN, &h->flags);
+	zspage = h->zspage;
+	off = obj_offset(zspage, h->idx);
+
+	if (!obj_spans_pages(zspage, h->idx))
+		return (unsigned char *)kmap_atomic(zspage->pages[
+				off >> PAGE_SHIFT], type) + (off & ~PAGE_MASK);
+
+	/* The pin disabled preemption, so we stay on this cpu */
+	area = per_cpu_ptr(pool->map_area, smp_processor_id());
+	area->mm = mm;
+	if (mm != ZS_MM_WO)
+		obj_copy_buf(zspage, h->idx, area->buf, 0, type);
+
+	return area->buf;
+}
+EXPORT_SYMBOL_GPL(zs_map_object);
+
+void zs_unmap_object(struct zs_pool *pool, unsigned long handle,
+			void *addr, enum km_type type)
+{
+	struct zs_handle *h = (struct zs_handle *)handle;
+	struct zs_map_area *area;
+	struct zspage *zspage = h->zspage;
+
+	if (!obj_spans_pages(zspage, h->idx)) {
+		kunmap_atomic(addr, type);
+	} else {
+		area = per_cpu_ptr(pool->map_area, smp_processor_id());
+		if (area->mm != ZS_MM_RO)
+			obj_copy_buf(zspage, h->idx, area->buf, 1, type);
+	}
+
+	bit_spin_unlock(HANDLE_PIN, &h->flags);
+}
+EXPORT_SYMBOL_GPL(zs_unmap_object);
+
+/*
+ * Find the least used partial zspage of a class to empty, and the most
+ * used one to move its objects to. Returns 0 if there is nothing to do.
+ */
+static int find_compact_pair(struct size_class *class, struct zspage **src,
+			struct zspage **dst)
+{
+	struct zspage *zspage;
+
+	*src = *dst = NULL;
+	list_for_each_entry(zspage, &class->partial, list) {
+		if (!*src || zspage->inuse < (*src)->inuse)
+			*src = zspage;
+	}
+
+	list_for_each_entry(zspage, &class->partial, list) {
+		if (zspage == *src)
+			continue;
+		if (!*dst || zspage->inuse > (*dst)->inuse)
+			*dst = zspage;
+	}
+
+	return *src && *dst;
+}
+
+/*
+ * Move objects from src to dst until either src is empty or dst is
+ * full. Pinned objects are skipped; returns 1 if there were any.
+ */
+static int migrate_zspage(struct zspage *src, struct zspage *dst)
+{
+	int busy = 0;
+	unsigned int i, idx;
+	struct zs_handle *handle;
+
+	for (i = 0; i < src->class->objs_per_zspage; i++) {
+		if (!src->inuse || zspage_full(dst))
+			break;
+		if (src->handles[i] & OBJ_FREE)
+			continue;
+
+		handle = (struct zs_handle *)src->handles[i];
+		if (!bit_spin_trylock(HANDLE_PIN, &handle->flags)) {
+			busy = 1;
+			continue;
+		}
+
+		idx = obj_take_slot(dst, (unsigned long)handle);
+		obj_copy(src, i, dst, idx);
+		handle->zspage = dst;
+		handle->idx = idx;
+		obj_put_slot(src, i);
+
+		bit_spin_unlock(HANDLE_PIN, &handle->flags);
+	}
+
+	return busy;
+}
+
+static unsigned long compact_class(struct zs_pool *pool,
+			struct size_class *class)
+{
+	int busy;
+	unsigned long freed = 0;
+	struct zspage *src, *dst;
+
+	spin_lock(&class->lock);
+	while (find_compact_pair(class, &src, &dst)) {
+		busy = migrate_zspage(src, dst);
+
+		if (zspage_full(dst))
+			list_move(&dst->list, &class->full);
+
+		if (!src->inuse) {
+			list_del(&src->list);
+			free_zspage(pool, src);
+			freed += class->pages_per_zspage;
+		} else if (busy) {
+			break;
+		}
+	}
+	spin_unlock(&class->lock);
+
+	return freed;
+}
+
+/**
+ * zs_compact - release sparsely used zspages
+ * @pool: pool to compact
+ *
+ * Objects of each size class are moved from its least used zspages
+ * into the most used ones, and the emptied zspages are freed. Objects
+ * that are mapped at the time are left alone. Returns the number of
+ * pages released.
+ */
+unsigned long zs_compact(struct zs_pool *pool)
+{
+	int i;
+	unsigned long freed = 0;
+
+	for (i = 0; i < ZS_NR_CLASSES; i++) {
+		freed += compact_class(pool, &pool->size_class[i]);
+		cond_resched();
+	}
+
+	return freed;
+}
+EXPORT_SYMBOL_GPL(zs_compact);
+
+/*
+ * Returns total memory in zspages (objects + unused slots)
+ */
+u64 zs_get_total_size_bytes(struct zs_pool *pool)
+{
+	return (u64)atomic_read(&pool->total_pages) << PAGE_SHIFT;
+}
+EXPORT_SYMBOL_GPL(zs_get_total_size_bytes);
+
+MODULE_LICENSE("Dual BSD/GPL");
+MODULE_DESCRIPTION("Size class based allocator for compressed pages");
@@ -0,0 +1,106 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZS_MALLOC_INT_H_
+#define _ZS_MALLOC_INT_H_
+
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+
+#include "zsmalloc.h"
+
+/* User configurable params */
+
+/*
+ * A zspage is a group of up to this many 0-order pages holding
+ * objects of a single size class. Using more than one page lets
+ * sizes that do not divide PAGE_SIZE waste less space at the end.
+ */
+#define ZS_MAX_PAGES_PER_ZSPAGE	4
+
+#define ZS_MIN_ALLOC_SIZE	32
+#define ZS_MAX_ALLOC_SIZE	PAGE_SIZE
+
+/*
+ * Size classes are separated by ZS_SIZE_CLASS_DELTA bytes. This is
+ * 16 for 4k pages; larger pages get proportionally coarser classes.
+ */
+#define ZS_SIZE_CLASS_DELTA	(PAGE_SIZE >> 8)
+#define ZS_NR_CLASSES	((ZS_MAX_ALLOC_SIZE - ZS_MIN_ALLOC_SIZE) \
+				/ ZS_SIZE_CLASS_DELTA + 1)
+
+/* End of user params */
+
+enum handleflags {
+	/* Object is mapped or being freed and must not be moved */
+	HANDLE_PIN,
+	__NR_HANDLEFLAGS,
+};
+
+/*
+ * zspage->handles[] holds the handle of each allocated object. Free
+ * slots are chained through the same array, with the low bit set to
+ * tell them apart from (aligned) handle pointers.
+ */
+#define OBJ_FREE		1UL
+#define OBJ_FREE_NEXT(v)	((v) >> 1)
+#define OBJ_FREE_ENCODE(next)	(((unsigned long)(next) << 1) | OBJ_FREE)
+#define OBJ_NONE		((1UL << (BITS_PER_LONG - 1)) - 1)
+
+struct size_class;
+
+struct zspage {
+	struct list_head list;		/* class partial or full list */
+	struct size_class *class;
+	unsigned int inuse;		/* no. of allocated objects */
+	unsigned long freelist;		/* first free slot or OBJ_NONE */
+	struct page *pages[ZS_MAX_PAGES_PER_ZSPAGE];
+	unsigned long handles[0];
+};
+
+/*
+ * Objects are referenced through a handle rather than by address,
+ * so compaction can move them to another zspage behind the user's
+ * back.
+ */
+struct zs_handle {
+	unsigned long flags;		/* HANDLE_PIN bit lock */
+	struct zspage *zspage;
+	unsigned int idx;
+};
+
+struct size_class {
+	spinlock_t lock;		/* protects lists and zspages */
+	u32 size;			/* object size */
+	unsigned int pages_per_zspage;
+	unsigned int objs_per_zspage;
+
+	struct list_head partial;	/* zspages with free slots */
+	struct list_head full;
+};
+
+/* Per-cpu copy of an object that spans two pages, see zs_map_object() */
+struct zs_map_area {
+	char *buf;
+	enum zs_mapmode mm;
+};
+
+struct zs_pool {
+	char *name;			/* of the handle cache */
+	struct kmem_cache *handle_cachep;
+	struct zs_map_area *map_area;	/* per-cpu */
+
+	atomic_t total_pages;		/* stats */
+	struct size_class size_class[ZS_NR_CLASSES];
+};
+
+#endif
@@ -0,0 +1,134 @@
+/*
+ * Squashfs - a compressed read only filesystem for Linux
+ *
+ * Copyright (c) 2002, 2003, 2004, 2005, 2006, 2007, 2008
+ * Phillip Lougher <phillip@lougher.demon.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * snappy_wrapper.c
+ */
+
+#include <linux/types.h>
+#include <linux/mutex.h>
+#include <linux/buffer_head.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+
+#include "../../drivers/staging/snappy/csnappy.h"
+
+#include "squashfs_fs.h"
+#include "squashfs_fs_sb.h"
+#include "squashfs_fs_i.h"
+#include "squashfs.h"
+#include "decompressor.h"
+
+/*
+ * Each block is a complete snappy stream, which starts with the
+ * uncompressed length.  As with LZO the input is gathered into a flat
+ * buffer and decompressed into a second one.
+ */
+struct squashfs_snappy {
+	void	*input;
+	void	*output;
+};
+
+static void snappy_free(void *strm);
+
+static void *snappy_init(struct squashfs_sb_info *msblk)
+{
+	int block_size = max_t(int, msblk->block_size, SQUASHFS_METADATA_SIZE);
+	struct squashfs_snappy *stream = kzalloc(sizeof(*stream), GFP_KERNEL);
+
+	if (stream == NULL)
+		goto failed;
+	stream->input = vmalloc(block_size);
+	if (stream->input == NULL)
+		goto failed;
+	stream->output = vmalloc(block_size);
+	if (stream->output == NULL)
+		goto failed;
+
+	return stream;
+
+failed:
+	ERROR("Failed to allocate snappy workspace\n");
+	snappy_free(stream);
+	return NULL;
+}
+
+
+static void snappy_free(void *strm)
+{
+	struct squashfs_snappy *stream = strm;
+
+	if (stream) {
+		vfree(stream->input);
+		vfree(stream->output);
+	}
+	kfree(stream);
+}
+
+
+static int snappy_uncompress(struct squashfs_sb_info *msblk, void *strm,
+	void **buffer, struct buffer_head **bh, int b, int offset, int length,
+	int srclength, int pages)
+{
+	struct squashfs_snappy *stream = strm;
+	void *buff = stream->input;
+	int avail, i, bytes = length, res;
+	uint32_t out_len;
+
+	for (i = 0; i < b; i++) {
+		avail = min(bytes, msblk->devblksize - offset);
+		memcpy(buff, bh[i]->b_data + offset, avail);
+		buff += avail;
+		bytes -= avail;
+		offset = 0;
+	}
+
+	res = csnappy_get_uncompressed_length(stream->input, length,
+					&out_len);
+	if (res < 0 || out_len > srclength)
+		goto failed;
+
+	res = csnappy_decompress(stream->input, length, stream->output,
+					out_len);
+	if (res != CSNAPPY_E_OK)
+		goto failed;
+
+	res = bytes = (int)out_len;
+	for (i = 0, buff = stream->output; bytes && i < pages; i++) {
+		avail = min_t(int, bytes, PAGE_CACHE_SIZE);
+		memcpy(buffer[i], buff, avail);
+		buff += avail;
+		bytes -= avail;
+	}
+
+	return res;
+
+failed:
+	ERROR("snappy decompression failed, data probably corrupt\n");
+	return -EIO;
+}
+
+const struct squashfs_decompressor squashfs_snappy_comp_ops = {
+	.init = snappy_init,
+	.free = snappy_free,
+	.decompress = snappy_uncompress,
+	.id = SNAPPY_COMPRESSION,
+	.name = "snappy",
+	.supported = 1
+};
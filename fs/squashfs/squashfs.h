@@ -65,6 +65,20 @@ extern int squashfs_get_id(struct super_block *, unsigned int, unsigned int *);
 extern __le64 *squashfs_read_id_index_table(struct super_block *, u64,
 				unsigned short);
 
+/* stream.c */
+#define SQUASHFS_THREADS_SINGLE		0
+#define SQUASHFS_THREADS_MULTI		1
+#define SQUASHFS_THREADS_PERCPU		2
+
+extern int squashfs_stream_init(struct squashfs_sb_info *, int);
+extern void squashfs_stream_destroy(struct squashfs_sb_info *);
+extern int squashfs_stream_parallel(struct squashfs_sb_info *);
+extern int squashfs_decompress(struct squashfs_sb_info *, void **,
+				struct buffer_head **, int, int, int, int, int);
+
+/* decompressor.c */
+extern const struct squashfs_decompressor *squashfs_lookup_decompressor(int);
+
 /* inode.c */
 extern struct inode *squashfs_iget(struct super_block *, long long,
 				unsigned int);
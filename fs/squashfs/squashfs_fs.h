@@ -212,6 +212,10 @@ struct meta_index {
  * definitions for structures on disk
  */
 #define ZLIB_COMPRESSION	 1
+#define LZMA_COMPRESSION	 2
+#define LZO_COMPRESSION		 3
+#define XZ_COMPRESSION		 4
+#define SNAPPY_COMPRESSION	 7
 
 struct squashfs_super_block {
 	__le32			s_magic;
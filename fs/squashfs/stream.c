@@ -0,0 +1,288 @@
+/*
+ * Squashfs - a compressed read only filesystem for Linux
+ *
+ * Copyright (c) 2002, 2003, 2004, 2005, 2006, 2007, 2008
+ * Phillip Lougher <phillip@lougher.demon.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * stream.c
+ */
+
+/*
+ * This file implements the decompressor streams used by squashfs_read_data.
+ * A stream is whatever state the filesystem's decompressor needs to
+ * decompress one block, e.g. a z_stream and its workspace for zlib.
+ * How many blocks can be decompressed at once is chosen per mount with the
+ * threads= option:
+ *
+ * single - one stream shared by all readers under a mutex.  Smallest
+ *	    memory use, but readers serialise on one CPU.
+ * multi  - a pool of streams, grown on demand up to twice the number of
+ *	    online CPUs.  Readers wait only when every stream is busy.
+ * percpu - one stream for each possible CPU, allocated at mount.  A reader
+ *	    uses the stream of the CPU it is running on; the stream mutex
+ *	    only matters if the reader is migrated while decompressing.
+ */
+
+#include <linux/fs.h>
+#include <linux/vfs.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/sched.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/cpumask.h>
+#include <linux/smp.h>
+#include <linux/buffer_head.h>
+
+#include "squashfs_fs.h"
+#include "squashfs_fs_sb.h"
+#include "squashfs_fs_i.h"
+#include "decompressor.h"
+#include "squashfs.h"
+
+struct squashfs_stream {
+	struct list_head	list;
+	struct mutex		mutex;
+	void			*stream;
+};
+
+struct squashfs_stream_pool {
+	int			mode;
+	int			nr_streams;
+	int			max_streams;
+	spinlock_t		lock;
+	wait_queue_head_t	wait_queue;
+	struct list_head	idle;
+	struct squashfs_stream	**stream;
+};
+
+
+static struct squashfs_stream *squashfs_stream_alloc(
+	struct squashfs_sb_info *msblk)
+{
+	struct squashfs_stream *stream = kmalloc(sizeof(*stream), GFP_KERNEL);
+
+	if (stream == NULL)
+		return NULL;
+
+	stream->stream = msblk->decompressor->init(msblk);
+	if (stream->stream == NULL) {
+		kfree(stream);
+		return NULL;
+	}
+
+	INIT_LIST_HEAD(&stream->list);
+	mutex_init(&stream->mutex);
+	return stream;
+}
+
+
+static void squashfs_stream_free(struct squashfs_sb_info *msblk,
+	struct squashfs_stream *stream)
+{
+	if (stream) {
+		msblk->decompressor->free(stream->stream);
+		kfree(stream);
+	}
+}
+
+
+int squashfs_stream_init(struct squashfs_sb_info *msblk, int mode)
+{
+	struct squashfs_stream_pool *pool;
+	struct squashfs_stream *stream;
+	int cpu;
+
+	pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+	if (pool == NULL)
+		return -ENOMEM;
+
+	pool->mode = mode;
+	spin_lock_init(&pool->lock);
+	init_waitqueue_head(&pool->wait_queue);
+	INIT_LIST_HEAD(&pool->idle);
+	msblk->stream_pool = pool;
+
+	if (mode == SQUASHFS_THREADS_MULTI) {
+		/* Start with one stream, the rest are made on demand */
+		pool->max_streams = 2 * num_online_cpus();
+		stream = squashfs_stream_alloc(msblk);
+		if (stream == NULL)
+			goto failed;
+		list_add(&stream->list, &pool->idle);
+		pool->nr_streams = 1;
+		return 0;
+	}
+
+	pool->max_streams = mode == SQUASHFS_THREADS_PERCPU ? nr_cpu_ids : 1;
+	pool->stream = kcalloc(pool->max_streams, sizeof(*pool->stream),
+		GFP_KERNEL);
+	if (pool->stream == NULL)
+		goto failed;
+
+	if (mode == SQUASHFS_THREADS_PERCPU) {
+		for_each_possible_cpu(cpu) {
+			pool->stream[cpu] = squashfs_stream_alloc(msblk);
+			if (pool->stream[cpu] == NULL)
+				goto failed;
+		}
+	} else {
+		pool->stream[0] = squashfs_stream_alloc(msblk);
+		if (pool->stream[0] == NULL)
+			goto failed;
+	}
+
+	return 0;
+
+failed:
+	ERROR("Failed to allocate decompressor streams\n");
+	squashfs_stream_destroy(msblk);
+	return -ENOMEM;
+}
+
+
+void squashfs_stream_destroy(struct squashfs_sb_info *msblk)
+{
+	struct squashfs_stream_pool *pool = msblk->stream_pool;
+	struct squashfs_stream *stream, *next;
+	int i;
+
+	if (pool == NULL)
+		return;
+
+	list_for_each_entry_safe(stream, next, &pool->idle, list)
+		squashfs_stream_free(msblk, stream);
+
+	if (pool->stream) {
+		for (i = 0; i < pool->max_streams; i++)
+			squashfs_stream_free(msblk, pool->stream[i]);
+		kfree(pool->stream);
+	}
+
+	kfree(pool);
+	msblk->stream_pool = NULL;
+}
+
+
+/*
+ * Number of blocks that can usefully be decompressed at once, used to size
+ * the data block cache so parallel readers are not serialised on it.
+ */
+int squashfs_stream_parallel(struct squashfs_sb_info *msblk)
+{
+	if (msblk->stream_pool->mode == SQUASHFS_THREADS_SINGLE)
+		return 1;
+
+	return num_online_cpus();
+}
+
+
+/*
+ * Get a stream to decompress into.  This may sleep, and the caller must
+ * hand the stream back with squashfs_stream_put.
+ */
+static struct squashfs_stream *squashfs_stream_get(
+	struct squashfs_sb_info *msblk)
+{
+	struct squashfs_stream_pool *pool = msblk->stream_pool;
+	struct squashfs_stream *stream;
+	int alloc_failed = 0;
+
+	if (pool->mode == SQUASHFS_THREADS_SINGLE) {
+		stream = pool->stream[0];
+		mutex_lock(&stream->mutex);
+		return stream;
+	}
+
+	if (pool->mode == SQUASHFS_THREADS_PERCPU) {
+		stream = pool->stream[raw_smp_processor_id()];
+		mutex_lock(&stream->mutex);
+		return stream;
+	}
+
+	spin_lock(&pool->lock);
+	while (1) {
+		if (!list_empty(&pool->idle)) {
+			stream = list_entry(pool->idle.next,
+				struct squashfs_stream, list);
+			list_del(&stream->list);
+			break;
+		}
+
+		if (!alloc_failed && pool->nr_streams < pool->max_streams) {
+			pool->nr_streams++;
+			spin_unlock(&pool->lock);
+
+			stream = squashfs_stream_alloc(msblk);
+			if (stream)
+				return stream;
+
+			/*
+			 * Out of memory, so wait for one of the existing
+			 * streams instead.  There is always at least one.
+			 */
+			spin_lock(&pool->lock);
+			pool->nr_streams--;
+			alloc_failed = 1;
+			continue;
+		}
+
+		spin_unlock(&pool->lock);
+		wait_event(pool->wait_queue, !list_empty(&pool->idle));
+		spin_lock(&pool->lock);
+	}
+	spin_unlock(&pool->lock);
+
+	return stream;
+}
+
+
+static void squashfs_stream_put(struct squashfs_sb_info *msblk,
+	struct squashfs_stream *stream)
+{
+	struct squashfs_stream_pool *pool = msblk->stream_pool;
+
+	if (pool->mode != SQUASHFS_THREADS_MULTI) {
+		mutex_unlock(&stream->mutex);
+		return;
+	}
+
+	spin_lock(&pool->lock);
+	list_add(&stream->list, &pool->idle);
+	spin_unlock(&pool->lock);
+
+	wake_up(&pool->wait_queue);
+}
+
+
+/*
+ * Decompress a block whose buffer_heads have all been read, using
+ * whichever stream is free.  Returns the uncompressed length or -EIO.
+ */
+int squashfs_decompress(struct squashfs_sb_info *msblk, void **buffer,
+	struct buffer_head **bh, int b, int offset, int length, int srclength,
+	int pages)
+{
+	struct squashfs_stream *stream = squashfs_stream_get(msblk);
+	int res;
+
+	res = msblk->decompressor->decompress(msblk, stream->stream, buffer,
+		bh, b, offset, length, srclength, pages);
+	squashfs_stream_put(msblk, stream);
+
+	return res;
+}
@@ -35,34 +35,104 @@
 #include <linux/pagemap.h>
 #include <linux/init.h>
 #include <linux/module.h>
-#include <linux/zlib.h>
 #include <linux/magic.h>
+#include <linux/parser.h>
+#include <linux/seq_file.h>
+#include <linux/mount.h>
 
 #include "squashfs_fs.h"
 #include "squashfs_fs_sb.h"
 #include "squashfs_fs_i.h"
 #include "squashfs.h"
+#include "decompressor.h"
 
 static struct file_system_type squashfs_fs_type;
 static const struct super_operations squashfs_super_ops;
 
-static int supported_squashfs_filesystem(short major, short minor, short comp)
+#if defined(CONFIG_SQUASHFS_DECOMP_MULTI_PERCPU)
+#define SQUASHFS_THREADS_DEFAULT	SQUASHFS_THREADS_PERCPU
+#elif defined(CONFIG_SQUASHFS_DECOMP_MULTI)
+#define SQUASHFS_THREADS_DEFAULT	SQUASHFS_THREADS_MULTI
+#else
+#define SQUASHFS_THREADS_DEFAULT	SQUASHFS_THREADS_SINGLE
+#endif
+
+static const char *squashfs_threads_name[] = {
+	[SQUASHFS_THREADS_SINGLE] = "single",
+	[SQUASHFS_THREADS_MULTI] = "multi",
+	[SQUASHFS_THREADS_PERCPU] = "percpu",
+};
+
+enum {
+	Opt_threads, Opt_err
+};
+
+static const match_table_t squashfs_tokens = {
+	{Opt_threads, "threads=%s"},
+	{Opt_err, NULL}
+};
+
+static int squashfs_parse_options(char *options, int *threads)
+{
+	substring_t args[MAX_OPT_ARGS];
+	char mode[8];
+	char *p;
+	int i;
+
+	*threads = SQUASHFS_THREADS_DEFAULT;
+
+	if (options == NULL)
+		return 0;
+
+	while ((p = strsep(&options, ",")) != NULL) {
+		if (!*p)
+			continue;
+
+		switch (match_token(p, squashfs_tokens, args)) {
+		case Opt_threads:
+			match_strlcpy(mode, &args[0], sizeof(mode));
+			for (i = 0; i < ARRAY_SIZE(squashfs_threads_name); i++)
+				if (!strcmp(mode, squashfs_threads_name[i]))
+					break;
+			if (i == ARRAY_SIZE(squashfs_threads_name)) {
+				ERROR("Unknown threads= mode \"%s\"\n", mode);
+				return -EINVAL;
+			}
+			*threads = i;
+			break;
+		default:
+			WARNING("Ignoring unknown mount option \"%s\"\n", p);
+			break;
+		}
+	}
+
+	return 0;
+}
+
+static const struct squashfs_decompressor *supported_squashfs_filesystem(short
+	major, short minor, short id)
 {
+	const struct squashfs_decompressor *decompressor;
+
 	if (major < SQUASHFS_MAJOR) {
 		ERROR("Major/Minor mismatch, older Squashfs %d.%d "
 			"filesystems are unsupported\n", major, minor);
-		return -EINVAL;
+		return NULL;
 	} else if (major > SQUASHFS_MAJOR || minor > SQUASHFS_MINOR) {
 		ERROR("Major/Minor mismatch, trying to mount newer "
 			"%d.%d filesystem\n", major, minor);
 		ERROR("Please update your kernel\n");
-		return -EINVAL;
+		return NULL;
 	}
 
-	if (comp != ZLIB_COMPRESSION)
-		return -EINVAL;
+	decompressor = squashfs_lookup_decompressor(id);
+	if (!decompressor->supported) {
+		ERROR("Filesystem uses \"%s\" compression. This is not "
+			"supported\n", decompressor->name);
+		return NULL;
+	}
 
-	return 0;
+	return decompressor;
 }
 
 
@@ -87,11 +157,11 @@ static int squashfs_fill_super(struct super_block *sb, void *data, int silent)
 	}
 	msblk = sb->s_fs_info;
 
-	msblk->stream.workspace = kmalloc(zlib_inflate_workspacesize(),
-		GFP_KERNEL);
-	if (msblk->stream.workspace == NULL) {
-		ERROR("Failed to allocate zlib workspace\n");
-		goto failure;
+	err = squashfs_parse_options(data, &msblk->threads);
+	if (err) {
+		kfree(sb->s_fs_info);
+		sb->s_fs_info = NULL;
+		return err;
 	}
 
 	sblk = kzalloc(sizeof(*sblk), GFP_KERNEL);
@@ -103,7 +173,6 @@ static int squashfs_fill_super(struct super_block *sb, void *data, int silent)
 	msblk->devblksize = sb_min_blocksize(sb, BLOCK_SIZE);
 	msblk->devblksize_log2 = ffz(~msblk->devblksize);
 
-	mutex_init(&msblk->read_data_mutex);
 	mutex_init(&msblk->meta_index_mutex);
 
 	/*
@@ -130,12 +199,15 @@ static int squashfs_fill_super(struct super_block *sb, void *data, int silent)
 		goto failed_mount;
 	}
 
-	/* Check the MAJOR & MINOR versions and compression type */
-	err = supported_squashfs_filesystem(le16_to_cpu(sblk->s_major),
+	/* Check the MAJOR & MINOR versions and lookup compression type */
+	msblk->decompressor = supported_squashfs_filesystem(
+			le16_to_cpu(sblk->s_major),
 			le16_to_cpu(sblk->s_minor),
 			le16_to_cpu(sblk->compression));
-	if (err < 0)
+	if (msblk->decompressor == NULL) {
+		err = -EINVAL;
 		goto failed_mount;
+	}
 
 	err = -EINVAL;
 
@@ -172,6 +244,12 @@ static int squashfs_fill_super(struct super_block *sb, void *data, int silent)
 	if (msblk->block_log > SQUASHFS_FILE_MAX_LOG)
 		goto failed_mount;
 
+	/* Streams are sized from the block size, so set them up now */
+	err = squashfs_stream_init(msblk, msblk->threads);
+	if (err)
+		goto failed_mount;
+	err = -EINVAL;
+
 	/* Check the root inode for sanity */
 	root_inode = le64_to_cpu(sblk->root_inode);
 	if (SQUASHFS_INODE_OFFSET(root_inode) > SQUASHFS_METADATA_SIZE)
@@ -183,6 +261,7 @@ static int squashfs_fill_super(struct super_block *sb, void *data, int silent)
 	flags = le16_to_cpu(sblk->flags);
 
 	TRACE("Found valid superblock on %s\n", bdevname(sb->s_bdev, b));
+	TRACE("Compression: %s\n", msblk->decompressor->name);
 	TRACE("Inodes are %scompressed\n", SQUASHFS_UNCOMPRESSED_INODES(flags)
 				? "un" : "");
 	TRACE("Data is %scompressed\n", SQUASHFS_UNCOMPRESSED_DATA(flags)
@@ -210,8 +289,12 @@ static int squashfs_fill_super(struct super_block *sb, void *data, int silent)
 	if (msblk->block_cache == NULL)
 		goto failed_mount;
 
-	/* Allocate read_page block */
-	msblk->read_page = squashfs_cache_init("data", 1, msblk->block_size);
+	/*
+	 * Allocate read_page blocks, one for each block that can be
+	 * decompressed in parallel
+	 */
+	msblk->read_page = squashfs_cache_init("data",
+		squashfs_stream_parallel(msblk), msblk->block_size);
 	if (msblk->read_page == NULL) {
 		ERROR("Failed to allocate read_page block\n");
 		goto failed_mount;
@@ -295,14 +378,13 @@ failed_mount:
 	kfree(msblk->inode_lookup_table);
 	kfree(msblk->fragment_index);
 	kfree(msblk->id_table);
-	kfree(msblk->stream.workspace);
+	squashfs_stream_destroy(msblk);
 	kfree(sb->s_fs_info);
 	sb->s_fs_info = NULL;
 	kfree(sblk);
 	return err;
 
 failure:
-	kfree(msblk->stream.workspace);
 	kfree(sb->s_fs_info);
 	sb->s_fs_info = NULL;
 	return -ENOMEM;
@@ -337,6 +419,18 @@ static int squashfs_remount(struct super_block *sb, int *flags, char *data)
 }
 
 
+static int squashfs_show_options(struct seq_file *seq, struct vfsmount *mnt)
+{
+	struct squashfs_sb_info *msblk = mnt->mnt_sb->s_fs_info;
+
+	if (msblk->threads != SQUASHFS_THREADS_DEFAULT)
+		seq_printf(seq, ",threads=%s",
+			squashfs_threads_name[msblk->threads]);
+
+	return 0;
+}
+
+
 static void squashfs_put_super(struct super_block *sb)
 {
 	lock_kernel();
@@ -349,7 +443,7 @@ static void squashfs_put_super(struct super_block *sb)
 		kfree(sbi->id_table);
 		kfree(sbi->fragment_index);
 		kfree(sbi->meta_index);
-		kfree(sbi->stream.workspace);
+		squashfs_stream_destroy(sbi);
 		kfree(sb->s_fs_info);
 		sb->s_fs_info = NULL;
 	}
@@ -449,7 +543,8 @@ static const struct super_operations squashfs_super_ops = {
 	.destroy_inode = squashfs_destroy_inode,
 	.statfs = squashfs_statfs,
 	.put_super = squashfs_put_super,
-	.remount_fs = squashfs_remount
+	.remount_fs = squashfs_remount,
+	.show_options = squashfs_show_options
 };
 
 module_init(init_squashfs_fs);
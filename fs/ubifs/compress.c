@@ -71,6 +71,22 @@ static struct ubifs_compressor zlib_compr = {
 };
 #endif
 
+#ifdef CONFIG_UBIFS_FS_SNAPPY
+static DEFINE_MUTEX(snappy_mutex);
+
+static struct ubifs_compressor snappy_compr = {
+	.compr_type = UBIFS_COMPR_SNAPPY,
+	.comp_mutex = &snappy_mutex,
+	.name = "snappy",
+	.capi_name = "snappy",
+};
+#else
+static struct ubifs_compressor snappy_compr = {
+	.compr_type = UBIFS_COMPR_SNAPPY,
+	.name = "snappy",
+};
+#endif
+
 /* All UBIFS compressors */
 struct ubifs_compressor *ubifs_compressors[UBIFS_COMPR_TYPES_CNT];
 
@@ -158,6 +174,11 @@ int ubifs_decompress(const void *in_buf, int in_len, void *out_buf,
 
 	compr = ubifs_compressors[compr_type];
 
+	if (unlikely(!compr)) {
+		ubifs_err("invalid compression type %d", compr_type);
+		return -EINVAL;
+	}
+
 	if (unlikely(!compr->capi_name)) {
 		ubifs_err("%s compression is not compiled in", compr->name);
 		return -EINVAL;
@@ -233,9 +254,15 @@ int __init ubifs_compressors_init(void)
 	if (err)
 		goto out_lzo;
 
+	err = compr_init(&snappy_compr);
+	if (err)
+		goto out_zlib;
+
 	ubifs_compressors[UBIFS_COMPR_NONE] = &none_compr;
 	return 0;
 
+out_zlib:
+	compr_exit(&zlib_compr);
 out_lzo:
 	compr_exit(&lzo_compr);
 	return err;
@@ -248,4 +275,5 @@ void ubifs_compressors_exit(void)
 {
 	compr_exit(&lzo_compr);
 	compr_exit(&zlib_compr);
+	compr_exit(&snappy_compr);
 }
@@ -444,7 +444,8 @@ static int validate_sb(struct ubifs_info *c, struct ubifs_sb_node *sup)
 		goto failed;
 	}
 
-	if (c->default_compr < 0 || c->default_compr >= UBIFS_COMPR_TYPES_CNT) {
+	if (c->default_compr < 0 || c->default_compr >= UBIFS_COMPR_TYPES_CNT ||
+	    !ubifs_compressors[c->default_compr]) {
 		err = 13;
 		goto failed;
 	}
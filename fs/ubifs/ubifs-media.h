@@ -332,12 +332,18 @@ enum {
  * UBIFS_COMPR_NONE: no compression
  * UBIFS_COMPR_LZO: LZO compression
  * UBIFS_COMPR_ZLIB: ZLIB compression
- * UBIFS_COMPR_TYPES_CNT: count of supported compression types
+ * UBIFS_COMPR_SNAPPY: Snappy compression
+ * UBIFS_COMPR_TYPES_CNT: count of compression type numbers
+ *
+ * Snappy has no mainline type number, so it is kept clear of the ones
+ * mainline hands out from 3 upwards. Types 3 to 6 are unknown to this
+ * implementation and are rejected.
  */
 enum {
 	UBIFS_COMPR_NONE,
 	UBIFS_COMPR_LZO,
 	UBIFS_COMPR_ZLIB,
+	UBIFS_COMPR_SNAPPY = 7,
 	UBIFS_COMPR_TYPES_CNT,
 };
 
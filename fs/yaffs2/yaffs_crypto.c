@@ -95,9 +95,16 @@ static void AES_cbc(const u8 *iv, int iv_length,
 	crypto_free_blkcipher(cipher);
 }
 
-static void AES_xts(struct crypto_blkcipher *cipher, int tweak,
-		    const u8 *input, u8 *output,
-		    int length, int encrypt)
+/*
+ * Page encryption runs synchronously on the caller's thread. Readers share
+ * the device lock, so concurrent readers still decrypt on different CPUs.
+ * The cipher only holds the key: the tweak is passed per call in the
+ * descriptor, so one cipher can be used by all of them at once without
+ * allocating anything per chunk.
+ */
+static int AES_xts(struct crypto_blkcipher *cipher, int tweak,
+		   const u8 *input, u8 *output,
+		   int length, int encrypt)
 {
 	struct blkcipher_desc desc;
 	struct scatterlist dst[1];
@@ -117,24 +124,29 @@ static void AES_xts(struct crypto_blkcipher *cipher, int tweak,
 	desc.info = tweak_bytes;
 
 	if (encrypt)
-		crypto_blkcipher_encrypt_iv(&desc, &dst[0], &src[0], length);
+		return crypto_blkcipher_encrypt_iv(&desc, &dst[0], &src[0],
+						   length);
 	else
-		crypto_blkcipher_decrypt_iv(&desc, &dst[0], &src[0], length);
+		return crypto_blkcipher_decrypt_iv(&desc, &dst[0], &src[0],
+						   length);
 }
 
-void AES_xts_encrypt(struct crypto_blkcipher *cipher,
-		     const u8 *page_plaintext, u8 *page_ciphertext,
-		     int page_tweak, int page_size,
-		     const u8 *tags_plaintext, u8 *tags_ciphertext,
-		     int tags_tweak, int tags_size)
+int AES_xts_encrypt(struct crypto_blkcipher *cipher,
+		    const u8 *page_plaintext, u8 *page_ciphertext,
+		    int page_tweak, int page_size,
+		    const u8 *tags_plaintext, u8 *tags_ciphertext,
+		    int tags_tweak, int tags_size)
 {
 	int missing_bytes;
+	int ret;
 	u8 block_aligned_tags_plaintext[AES_BLOCK_SIZE];
 	u8 block_aligned_tags_ciphertext[AES_BLOCK_SIZE];
 
-	AES_xts(cipher, page_tweak,
-		page_plaintext, page_ciphertext,
-		page_size, 1);
+	ret = AES_xts(cipher, page_tweak,
+		      page_plaintext, page_ciphertext,
+		      page_size, 1);
+	if (ret)
+		return ret;
 
 	missing_bytes = sizeof(block_aligned_tags_plaintext) - tags_size;
 
@@ -143,24 +155,29 @@ void AES_xts_encrypt(struct crypto_blkcipher *cipher,
 	       page_ciphertext + (page_size - missing_bytes),
 	       missing_bytes);
 
-	AES_xts(cipher, tags_tweak,
-		block_aligned_tags_plaintext, block_aligned_tags_ciphertext,
-		sizeof(block_aligned_tags_plaintext), 1);
+	ret = AES_xts(cipher, tags_tweak,
+		      block_aligned_tags_plaintext,
+		      block_aligned_tags_ciphertext,
+		      sizeof(block_aligned_tags_plaintext), 1);
+	if (ret)
+		return ret;
 
 	memcpy(page_ciphertext + (page_size-missing_bytes),
 	       block_aligned_tags_ciphertext,
 	       missing_bytes);
 	memcpy(tags_ciphertext, block_aligned_tags_ciphertext + missing_bytes,
 	       tags_size);
+	return 0;
 }
 
-void AES_xts_decrypt(struct crypto_blkcipher *cipher,
-		     u8 *page_ciphertext, u8 *page_plaintext,
-		     int page_tweak, int page_size,
-		     u8 *tags_ciphertext, u8 *tags_plaintext,
-		     int tags_tweak, int tags_size)
+int AES_xts_decrypt(struct crypto_blkcipher *cipher,
+		    u8 *page_ciphertext, u8 *page_plaintext,
+		    int page_tweak, int page_size,
+		    u8 *tags_ciphertext, u8 *tags_plaintext,
+		    int tags_tweak, int tags_size)
 {
 	int missing_bytes;
+	int ret;
 	u8 block_aligned_tags_ciphertext[AES_BLOCK_SIZE];
 	u8 block_aligned_tags_plaintext[AES_BLOCK_SIZE];
 
@@ -173,18 +190,37 @@ void AES_xts_decrypt(struct crypto_blkcipher *cipher,
 	       tags_ciphertext,
 	       tags_size);
 
-	AES_xts(cipher, tags_tweak,
-		block_aligned_tags_ciphertext, block_aligned_tags_plaintext,
-		sizeof(block_aligned_tags_ciphertext), 0);
+	ret = AES_xts(cipher, tags_tweak,
+		      block_aligned_tags_ciphertext,
+		      block_aligned_tags_plaintext,
+		      sizeof(block_aligned_tags_ciphertext), 0);
+	if (ret)
+		return ret;
 
 	memcpy(tags_plaintext, block_aligned_tags_plaintext, tags_size);
 	memcpy(page_ciphertext + (page_size - missing_bytes),
 	       block_aligned_tags_plaintext + tags_size,
 	       missing_bytes);
 
-	AES_xts(cipher, page_tweak,
-		page_ciphertext, page_plaintext,
-		page_size, 0);
+	return AES_xts(cipher, page_tweak,
+		       page_ciphertext, page_plaintext,
+		       page_size, 0);
+}
+
+struct crypto_blkcipher *yaffs_xts_alloc(const u8 *keys, int key_length)
+{
+	struct crypto_blkcipher *cipher;
+
+	cipher = crypto_alloc_blkcipher("xts(aes)", 0, 0);
+	if (IS_ERR(cipher))
+		return NULL;
+
+	if (crypto_blkcipher_setkey(cipher, keys, key_length)) {
+		crypto_free_blkcipher(cipher);
+		return NULL;
+	}
+
+	return cipher;
 }
 
 int yaffs_generate_keys(u8 *key_buffer, int key_size)
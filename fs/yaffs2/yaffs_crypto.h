@@ -38,17 +38,19 @@ struct yaffs_key_descriptor_block {
 };
 
 
-void AES_xts_encrypt(struct crypto_blkcipher *cipher,
-		     const u8 *page_plaintext, u8 *page_ciphertext,
-		     int page_tweak, int page_size,
-		     const u8 *tags_plaintext, u8 *tags_ciphertext,
-		     int tags_tweak, int tags_size);
-
-void AES_xts_decrypt(struct crypto_blkcipher *cipher,
-		     u8 *page_ciphertext, u8 *page_plaintext,
-		     int page_tweak, int page_size,
-		     u8 *tags_ciphertext, u8 *tags_plaintext,
-		     int tags_tweak, int tags_size);
+struct crypto_blkcipher *yaffs_xts_alloc(const u8 *keys, int key_length);
+
+int AES_xts_encrypt(struct crypto_blkcipher *cipher,
+		    const u8 *page_plaintext, u8 *page_ciphertext,
+		    int page_tweak, int page_size,
+		    const u8 *tags_plaintext, u8 *tags_ciphertext,
+		    int tags_tweak, int tags_size);
+
+int AES_xts_decrypt(struct crypto_blkcipher *cipher,
+		    u8 *page_ciphertext, u8 *page_plaintext,
+		    int page_tweak, int page_size,
+		    u8 *tags_ciphertext, u8 *tags_plaintext,
+		    int tags_tweak, int tags_size);
 
 int yaffs_generate_keys(u8 *key_buffer, int key_size);
 
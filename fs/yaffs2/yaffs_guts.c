@@ -32,6 +32,8 @@
 /* Note YAFFS_GC_GOOD_ENOUGH must be <= YAFFS_GC_PASSIVE_THRESHOLD */
 #define YAFFS_GC_GOOD_ENOUGH 2
 #define YAFFS_GC_PASSIVE_THRESHOLD 4
+/* Number of gc steps an urgent background pass may take at once */
+#define YAFFS_BG_GC_BURST 4
 
 #include "yaffs_ecc.h"
 
@@ -126,6 +128,7 @@ static int yaffs_init_tmp_buffers(struct yaffs_dev *dev)
 	u8 *buf = (u8 *) 1;
 
 	memset(dev->temp_buffer, 0, sizeof(dev->temp_buffer));
+	spin_lock_init(&dev->shared_lock);
 
 	for (i = 0; buf && i < YAFFS_N_TEMP_BUFFERS; i++) {
 		dev->temp_buffer[i].in_use = 0;
@@ -140,6 +143,7 @@ u8 *yaffs_get_temp_buffer(struct yaffs_dev * dev)
 {
 	int i;
 
+	spin_lock(&dev->shared_lock);
 	dev->temp_in_use++;
 	if (dev->temp_in_use > dev->max_temp)
 		dev->max_temp = dev->temp_in_use;
@@ -147,17 +151,20 @@ u8 *yaffs_get_temp_buffer(struct yaffs_dev * dev)
 	for (i = 0; i < YAFFS_N_TEMP_BUFFERS; i++) {
 		if (dev->temp_buffer[i].in_use == 0) {
 			dev->temp_buffer[i].in_use = 1;
+			spin_unlock(&dev->shared_lock);
 			return dev->temp_buffer[i].buffer;
 		}
 	}
 
-	yaffs_trace(YAFFS_TRACE_BUFFERS, "Out of temp buffers");
 	/*
 	 * If we got here then we have to allocate an unmanaged one
 	 * This is not good.
 	 */
 
 	dev->unmanaged_buffer_allocs++;
+	spin_unlock(&dev->shared_lock);
+
+	yaffs_trace(YAFFS_TRACE_BUFFERS, "Out of temp buffers");
 	return kmalloc(dev->data_bytes_per_chunk, GFP_NOFS);
 
 }
@@ -166,20 +173,25 @@ void yaffs_release_temp_buffer(struct yaffs_dev *dev, u8 *buffer)
 {
 	int i;
 
+	spin_lock(&dev->shared_lock);
 	dev->temp_in_use--;
 
 	for (i = 0; i < YAFFS_N_TEMP_BUFFERS; i++) {
 		if (dev->temp_buffer[i].buffer == buffer) {
 			dev->temp_buffer[i].in_use = 0;
+			spin_unlock(&dev->shared_lock);
 			return;
 		}
 	}
 
+	if (buffer)
+		dev->unmanaged_buffer_deallocs++;
+	spin_unlock(&dev->shared_lock);
+
 	if (buffer) {
 		/* assume it is an unmanaged one. */
 		yaffs_trace(YAFFS_TRACE_BUFFERS, "Releasing unmanaged temp buffer");
 		kfree(buffer);
-		dev->unmanaged_buffer_deallocs++;
 	}
 
 }
@@ -235,6 +247,9 @@ static void yaffs_handle_chunk_update(struct yaffs_dev *dev, int nand_chunk,
 void yaffs_handle_chunk_error(struct yaffs_dev *dev,
 			      struct yaffs_block_info *bi)
 {
+	int struck_out = 0;
+
+	spin_lock(&dev->shared_lock);
 	if (!bi->gc_prioritise) {
 		bi->gc_prioritise = 1;
 		dev->has_pending_prioritised_gc = 1;
@@ -242,11 +257,13 @@ void yaffs_handle_chunk_error(struct yaffs_dev *dev,
 
 		if (bi->chunk_error_strikes > 3) {
 			bi->needs_retiring = 1;	/* Too many stikes, so retire */
-			yaffs_trace(YAFFS_TRACE_ALWAYS,
-				"yaffs: Block struck out");
-
+			struck_out = 1;
 		}
 	}
+	spin_unlock(&dev->shared_lock);
+
+	if (struck_out)
+		yaffs_trace(YAFFS_TRACE_ALWAYS, "yaffs: Block struck out");
 }
 
 static void yaffs_handle_chunk_wr_error(struct yaffs_dev *dev, int nand_chunk,
@@ -670,6 +687,41 @@ static u16 yaffs_calc_name_sum(const YCHAR *name)
 	return sum;
 }
 
+/*
+ * Directory entries are hashed by parent and name sum so that
+ * yaffs_find_by_name() does not have to walk the whole directory.
+ * Only objects whose sum is known to match their name on NAND are
+ * hashed. The others (lazy loaded, not yet written, lost+found) sit on
+ * their directory's unhashed list, which is still searched linearly and
+ * moves them into the hash once they qualify.
+ */
+static struct list_head *yaffs_name_bucket(struct yaffs_obj *dir, u16 sum)
+{
+	return &dir->my_dev->name_bucket[(dir->obj_id * 31 + sum) %
+					 YAFFS_NNAME_BUCKETS];
+}
+
+static int yaffs_name_hashable(struct yaffs_obj *obj)
+{
+	return obj->name_valid && !obj->lazy_loaded && obj->hdr_chunk > 0 &&
+	    obj->obj_id != YAFFS_OBJECTID_LOSTNFOUND;
+}
+
+static void yaffs_hash_obj_name(struct yaffs_obj *obj)
+{
+	struct yaffs_obj *parent = obj->parent;
+
+	list_del_init(&obj->name_link);
+	if (!parent)
+		return;
+
+	if (yaffs_name_hashable(obj))
+		list_add(&obj->name_link, yaffs_name_bucket(parent, obj->sum));
+	else
+		list_add(&obj->name_link,
+			 &parent->variant.dir_variant.unhashed);
+}
+
 void yaffs_set_obj_name(struct yaffs_obj *obj, const YCHAR * name)
 {
 	memset(obj->short_name, 0, sizeof(obj->short_name));
@@ -680,6 +732,9 @@ void yaffs_set_obj_name(struct yaffs_obj *obj, const YCHAR * name)
 	else
 		obj->short_name[0] = _Y('\0');
 	obj->sum = yaffs_calc_name_sum(name);
+	obj->name_valid = (name && name[0]);
+	if (obj->parent)
+		yaffs_hash_obj_name(obj);
 }
 
 void yaffs_set_obj_name_from_oh(struct yaffs_obj *obj,
@@ -1263,6 +1318,7 @@ static void yaffs_remove_obj_from_dir(struct yaffs_obj *obj)
 		dev->param.remove_obj_fn(obj);
 
 	list_del_init(&obj->siblings);
+	list_del_init(&obj->name_link);
 	obj->parent = NULL;
 
 	yaffs_verify_dir(parent);
@@ -1296,6 +1352,7 @@ void yaffs_add_obj_to_dir(struct yaffs_obj *directory, struct yaffs_obj *obj)
 	/* Now add it */
 	list_add(&obj->siblings, &directory->variant.dir_variant.children);
 	obj->parent = directory;
+	yaffs_hash_obj_name(obj);
 
 	if (directory == obj->my_dev->unlinked_dir
 	    || directory == obj->my_dev->del_dir) {
@@ -1552,6 +1609,7 @@ static void yaffs_use_cache(struct yaffs_dev *dev, struct yaffs_cache *cache,
 	if (dev->param.n_caches < 1)
 		return;
 
+	spin_lock(&dev->shared_lock);
 	if (dev->cache_last_use < 0 ||
 		dev->cache_last_use > 100000000) {
 		/* Reset the cache usages */
@@ -1565,6 +1623,7 @@ static void yaffs_use_cache(struct yaffs_dev *dev, struct yaffs_cache *cache,
 
 	if (is_write)
 		cache->dirty = 1;
+	spin_unlock(&dev->shared_lock);
 }
 
 /* Invalidate a single cache page.
@@ -1819,12 +1878,14 @@ static struct yaffs_obj *yaffs_alloc_empty_obj(struct yaffs_dev *dev)
 	INIT_LIST_HEAD(&(obj->hard_links));
 	INIT_LIST_HEAD(&(obj->hash_link));
 	INIT_LIST_HEAD(&obj->siblings);
+	INIT_LIST_HEAD(&obj->name_link);
 
 	/* Now make the directory sane */
 	if (dev->root_dir) {
 		obj->parent = dev->root_dir;
 		list_add(&(obj->siblings),
 			 &dev->root_dir->variant.dir_variant.children);
+		yaffs_hash_obj_name(obj);
 	}
 
 	/* Add it to the lost and found directory.
@@ -1960,6 +2021,7 @@ struct yaffs_obj *yaffs_new_obj(struct yaffs_dev *dev, int number,
 	case YAFFS_OBJECT_TYPE_DIRECTORY:
 		INIT_LIST_HEAD(&the_obj->variant.dir_variant.children);
 		INIT_LIST_HEAD(&the_obj->variant.dir_variant.dirty);
+		INIT_LIST_HEAD(&the_obj->variant.dir_variant.unhashed);
 		break;
 	case YAFFS_OBJECT_TYPE_SYMLINK:
 	case YAFFS_OBJECT_TYPE_HARDLINK:
@@ -2008,6 +2070,9 @@ static void yaffs_init_tnodes_and_objs(struct yaffs_dev *dev)
 		INIT_LIST_HEAD(&dev->obj_bucket[i].list);
 		dev->obj_bucket[i].count = 0;
 	}
+
+	for (i = 0; i < YAFFS_NNAME_BUCKETS; i++)
+		INIT_LIST_HEAD(&dev->name_bucket[i]);
 }
 
 struct yaffs_obj *yaffs_find_or_create_by_number(struct yaffs_dev *dev,
@@ -2748,11 +2813,13 @@ static unsigned yaffs_find_gc_block(struct yaffs_dev *dev,
 
 	/*
 	 * If nothing has been selected for a while, try the oldest dirty
-	 * because that's gumming up the works.
+	 * because that's gumming up the works. An urgent background pass
+	 * goes straight there rather than waiting for the writers to stall.
 	 */
 
 	if (!selected && dev->param.is_yaffs2 &&
-	    dev->gc_not_done >= (background ? 10 : 20)) {
+	    (background > 1 ||
+	     dev->gc_not_done >= (background ? 10 : 20))) {
 		yaffs2_find_oldest_dirty_seq(dev);
 		if (dev->oldest_dirty_block > 0) {
 			selected = dev->oldest_dirty_block;
@@ -2802,6 +2869,9 @@ static unsigned yaffs_find_gc_block(struct yaffs_dev *dev,
  *
  * The idea is to help clear out space in a more spread-out manner.
  * Dunno if it really does anything useful.
+ *
+ * background is 0 for writers, 1 for the background thread and 2 for an
+ * urgent background pass.
  */
 static int yaffs_check_gc(struct yaffs_dev *dev, int background)
 {
@@ -2811,6 +2881,7 @@ static int yaffs_check_gc(struct yaffs_dev *dev, int background)
 	int min_erased;
 	int erased_chunks;
 	int checkpt_block_adjust;
+	u64 gc_time;
 
 	if (dev->param.gc_control && (dev->param.gc_control(dev) & 1) == 0)
 		return YAFFS_OK;
@@ -2819,6 +2890,9 @@ static int yaffs_check_gc(struct yaffs_dev *dev, int background)
 		/* Bail out so we don't get recursive gc */
 		return YAFFS_OK;
 
+	if (!background && dev->param.gc_wake_fn)
+		dev->param.gc_wake_fn(dev);
+
 	/* This loop should pass the first time.
 	 * Only loops here if the collection does not increase space.
 	 */
@@ -2878,7 +2952,14 @@ static int yaffs_check_gc(struct yaffs_dev *dev, int background)
 				"yaffs: GC n_erased_blocks %d aggressive %d",
 				dev->n_erased_blocks, aggressive);
 
+			gc_time = Y_CLOCK_US();
 			gc_ok = yaffs_gc_block(dev, dev->gc_block, aggressive);
+			gc_time = Y_CLOCK_US() - gc_time;
+
+			if (background)
+				dev->bg_gc_time_us += gc_time;
+			else
+				dev->fg_gc_time_us += gc_time;
 		}
 
 		if (dev->n_erased_blocks < (dev->param.n_reserved_blocks) &&
@@ -2897,15 +2978,24 @@ static int yaffs_check_gc(struct yaffs_dev *dev, int background)
 /*
  * yaffs_bg_gc()
  * Garbage collects. Intended to be called from a background thread.
+ * An urgency above 1 means erased blocks are running low, so take a few
+ * gc steps at once and fall back to the oldest dirty block.
  * Returns non-zero if at least half the free chunks are erased.
  */
 int yaffs_bg_gc(struct yaffs_dev *dev, unsigned urgency)
 {
-	int erased_chunks = dev->n_erased_blocks * dev->param.chunks_per_block;
+	int erased_chunks;
+	int passes = urgency > 1 ? YAFFS_BG_GC_BURST : 1;
+	u32 gcs;
 
 	yaffs_trace(YAFFS_TRACE_BACKGROUND, "Background gc %u", urgency);
 
-	yaffs_check_gc(dev, 1);
+	do {
+		gcs = dev->all_gcs;
+		yaffs_check_gc(dev, urgency > 1 ? 2 : 1);
+	} while (--passes > 0 && dev->all_gcs != gcs);
+
+	erased_chunks = dev->n_erased_blocks * dev->param.chunks_per_block;
 	return erased_chunks > dev->n_free_chunks / 2;
 }
 
@@ -3422,7 +3512,8 @@ int yaffs_update_oh(struct yaffs_obj *in, const YCHAR *name, int force,
  * Curve-balls: the first chunk might also be the last chunk.
  */
 
-int yaffs_file_rd(struct yaffs_obj *in, u8 * buffer, loff_t offset, int n_bytes)
+static int yaffs_file_rd_worker(struct yaffs_obj *in, u8 *buffer,
+				loff_t offset, int n_bytes, int shared)
 {
 	int chunk;
 	u32 start;
@@ -3454,7 +3545,11 @@ int yaffs_file_rd(struct yaffs_obj *in, u8 * buffer, loff_t offset, int n_bytes)
 		 */
 		if (cache || n_copy != dev->data_bytes_per_chunk ||
 		    dev->param.inband_tags) {
-			if (dev->param.n_caches > 0) {
+			/* A shared reader may not grab (and so possibly
+			 * flush) a cache slot, so misses go via a temp
+			 * buffer instead.
+			 */
+			if (dev->param.n_caches > 0 && (cache || !shared)) {
 
 				/* If we can't find the data in the cache,
 				 * then load it up. */
@@ -3483,6 +3578,9 @@ int yaffs_file_rd(struct yaffs_obj *in, u8 * buffer, loff_t offset, int n_bytes)
 
 				u8 *local_buffer =
 				    yaffs_get_temp_buffer(dev);
+
+				if (!local_buffer)
+					return -ENOMEM;
 				yaffs_rd_data_obj(in, chunk, local_buffer);
 
 				memcpy(buffer, &local_buffer[start], n_copy);
@@ -3501,6 +3599,22 @@ int yaffs_file_rd(struct yaffs_obj *in, u8 * buffer, loff_t offset, int n_bytes)
 	return n_done;
 }
 
+int yaffs_file_rd(struct yaffs_obj *in, u8 * buffer, loff_t offset, int n_bytes)
+{
+	return yaffs_file_rd_worker(in, buffer, offset, n_bytes, 0);
+}
+
+/*
+ * Like yaffs_file_rd() but only for callers that hold the device lock
+ * shared: it never modifies the chunk cache contents, so several readers
+ * may run at once. Writes, GC and checkpointing still exclude it.
+ */
+int yaffs_file_rd_shared(struct yaffs_obj *in, u8 *buffer, loff_t offset,
+			 int n_bytes)
+{
+	return yaffs_file_rd_worker(in, buffer, offset, n_bytes, 1);
+}
+
 int yaffs_do_file_wr(struct yaffs_obj *in, const u8 *buffer, loff_t offset,
 		     int n_bytes, int write_trhrough)
 {
@@ -4307,6 +4421,7 @@ struct yaffs_obj *yaffs_find_by_name(struct yaffs_obj *directory,
 {
 	int sum;
 	struct list_head *i;
+	struct list_head *n;
 	YCHAR buffer[YAFFS_MAX_NAME_LENGTH + 1];
 	struct yaffs_obj *l;
 
@@ -4329,13 +4444,26 @@ struct yaffs_obj *yaffs_find_by_name(struct yaffs_obj *directory,
 
 	sum = yaffs_calc_name_sum(name);
 
-	list_for_each(i, &directory->variant.dir_variant.children) {
-		l = list_entry(i, struct yaffs_obj, siblings);
+	list_for_each(i, yaffs_name_bucket(directory, sum)) {
+		l = list_entry(i, struct yaffs_obj, name_link);
+
+		if (l->parent != directory || l->sum != sum)
+			continue;
+
+		yaffs_get_obj_name(l, buffer, YAFFS_MAX_NAME_LENGTH + 1);
+		if (strncmp(name, buffer, YAFFS_MAX_NAME_LENGTH) == 0)
+			return l;
+	}
+
+	list_for_each_safe(i, n, &directory->variant.dir_variant.unhashed) {
+		l = list_entry(i, struct yaffs_obj, name_link);
 
 		if (l->parent != directory)
 			BUG();
 
 		yaffs_check_obj_details_loaded(l);
+		/* Now that its details are loaded it may belong in the hash */
+		yaffs_hash_obj_name(l);
 
 		/* Special case for lost-n-found */
 		if (l->obj_id == YAFFS_OBJECTID_LOSTNFOUND) {
@@ -4731,6 +4859,10 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 	dev->passive_gc_count = 0;
 	dev->oldest_dirty_gc_count = 0;
 	dev->bg_gcs = 0;
+	dev->bg_gc_wakes = 0;
+	dev->fg_gc_time_us = 0;
+	dev->bg_gc_time_us = 0;
+	dev->crypto_time_us = 0;
 	dev->gc_block_finder = 0;
 	dev->buffered_block = -1;
 	dev->doing_buffered_block_rewrite = 0;
@@ -57,6 +57,7 @@
 #define YAFFS_ALLOCATION_NLINKS		100
 
 #define YAFFS_NOBJECT_BUCKETS		256
+#define YAFFS_NNAME_BUCKETS		512
 
 #define YAFFS_OBJECT_SPACE		0x40000
 #define YAFFS_MAX_OBJECT_ID		(YAFFS_OBJECT_SPACE - 1)
@@ -360,6 +361,7 @@ struct yaffs_file_var {
 struct yaffs_dir_var {
 	struct list_head children;	/* list of child links */
 	struct list_head dirty;	/* Entry for list of dirty directories */
+	struct list_head unhashed;	/* children not in the name hash */
 };
 
 struct yaffs_symlink_var {
@@ -409,6 +411,7 @@ struct yaffs_obj {
 				 * or not. */
 	u8 has_xattr:1;		/* This object has xattribs.
 				 * Only valid if xattr_known. */
+	u8 name_valid:1;	/* sum was calculated from a real name */
 
 	u8 serial;		/* serial number of chunk in NAND.*/
 	u16 sum;		/* sum of the name to speed searching */
@@ -417,6 +420,9 @@ struct yaffs_obj {
 
 	struct list_head hash_link;	/* list of objects in hash bucket */
 
+	struct list_head name_link;	/* name hash bucket or parent's
+					 * unhashed list */
+
 	struct list_head hard_links;	/* hard linked object chain*/
 
 	/* directory structure stuff */
@@ -572,6 +578,10 @@ struct yaffs_param {
 	/*  Callback to control garbage collection. */
 	unsigned (*gc_control) (struct yaffs_dev *dev);
 
+	/* Callback to let a background collector know that writers are
+	 * doing inline gc, so it can run ahead of them. */
+	void (*gc_wake_fn) (struct yaffs_dev *dev);
+
 	/* Debug control flags. Don't use unless you know what you're doing */
 	int use_header_file_size;	/* Flag to determine if we should use
 					 * file sizes from the header */
@@ -671,6 +681,9 @@ struct yaffs_dev {
 	struct yaffs_obj_bucket obj_bucket[YAFFS_NOBJECT_BUCKETS];
 	u32 bucket_finder;
 
+	/* Directory entries by parent and name sum */
+	struct list_head name_bucket[YAFFS_NNAME_BUCKETS];
+
 	int n_free_chunks;
 
 	/* Garbage collection control */
@@ -717,6 +730,10 @@ struct yaffs_dev {
 	int unmanaged_buffer_allocs;
 	int unmanaged_buffer_deallocs;
 
+	/* Guards the temp buffers, cache LRU stamps and block error marks,
+	 * which readers holding the device lock shared may update. */
+	spinlock_t shared_lock;
+
 	/* yaffs2 runtime stuff */
 	unsigned seq_number;	/* Sequence number of currently
 					allocating block */
@@ -748,6 +765,10 @@ struct yaffs_dev {
 	u32 oldest_dirty_gc_count;
 	u32 n_gc_blocks;
 	u32 bg_gcs;
+	u32 bg_gc_wakes;
+	u64 fg_gc_time_us;	/* Time spent in gc by writers */
+	u64 bg_gc_time_us;	/* Time spent in gc by the background thread */
+	u64 crypto_time_us;	/* Time spent encrypting and decrypting pages */
 	u32 n_retired_writes;
 	u32 n_retired_blocks;
 	u32 n_ecc_fixed;
@@ -828,6 +849,8 @@ int yaffs_get_obj_link_count(struct yaffs_obj *obj);
 /* File operations */
 int yaffs_file_rd(struct yaffs_obj *obj, u8 * buffer, loff_t offset,
 		  int n_bytes);
+int yaffs_file_rd_shared(struct yaffs_obj *obj, u8 *buffer, loff_t offset,
+			 int n_bytes);
 int yaffs_wr_file(struct yaffs_obj *obj, const u8 * buffer, loff_t offset,
 		  int n_bytes, int write_trhrough);
 int yaffs_resize_file(struct yaffs_obj *obj, loff_t new_size);
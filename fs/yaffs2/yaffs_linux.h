@@ -24,7 +24,8 @@ struct yaffs_linux_context {
 	struct super_block *super;
 	struct task_struct *bg_thread;	/* Background thread for this device */
 	int bg_running;
-	struct mutex gross_lock;	/* Gross locking mutex*/
+	int bg_gc_kick;		/* Writers want the background gc to run */
+	struct rw_semaphore gross_lock;	/* Gross locking semaphore */
 	u8 *spare_buffer;	/* For mtdif2 use. Don't know the buffer size
 				 * at compile time so we have to allocate it.
 				 */
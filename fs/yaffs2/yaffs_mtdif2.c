@@ -27,6 +27,16 @@
 #include "yaffs_linux.h"
 #include "yaffs_crypto.h"
 
+/* Readers may decrypt concurrently, so the stat update needs the lock. */
+static void nandmtd2_account_crypto(struct yaffs_dev *dev, u64 start)
+{
+	u64 elapsed = Y_CLOCK_US() - start;
+
+	spin_lock(&dev->shared_lock);
+	dev->crypto_time_us += elapsed;
+	spin_unlock(&dev->shared_lock);
+}
+
 /* NB For use with inband tags....
  * We assume that the data buffer is of size total_bytes_per_chunk so
  * that we can also use it to load the tags.
@@ -48,6 +58,7 @@ int nandmtd2_write_chunk_tags(struct yaffs_dev *dev, int nand_chunk,
 	struct yaffs_packed_tags2 pt;
 
 	u8 *encrypted_data = NULL;
+	u64 crypto_start;
 
 	int packed_tags_size =
 	    dev->param.no_tags_ecc ? sizeof(pt.t) : sizeof(pt);
@@ -82,15 +93,27 @@ int nandmtd2_write_chunk_tags(struct yaffs_dev *dev, int nand_chunk,
 			BUG();
 
 		encrypted_data = yaffs_get_temp_buffer(dev);
+		if (!encrypted_data)
+			return YAFFS_FAIL;
 		memcpy(encrypted_data, data, dev->param.total_bytes_per_chunk);
 
-		AES_xts_encrypt(dev->cipher,
+		crypto_start = Y_CLOCK_US();
+		retval = AES_xts_encrypt(dev->cipher,
 				encrypted_data, encrypted_data,
 				nand_chunk * 2, dev->param.total_bytes_per_chunk,
 				packed_tags_ptr+SEQUENCE_OFFSET,
 				packed_tags_ptr+SEQUENCE_OFFSET,
 				(nand_chunk * 2) + 1,
 				packed_tags_size-SEQUENCE_OFFSET);
+		nandmtd2_account_crypto(dev, crypto_start);
+
+		if (retval) {
+			yaffs_trace(YAFFS_TRACE_ERROR,
+				"encrypting chunk %d failed %d",
+				nand_chunk, retval);
+			yaffs_release_temp_buffer(dev, encrypted_data);
+			return YAFFS_FAIL;
+		}
 	}
 
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 17))
@@ -129,11 +152,14 @@ int nandmtd2_read_chunk_tags(struct yaffs_dev *dev, int nand_chunk,
 	struct mtd_info *mtd = yaffs_dev_to_mtd(dev);
 #if (MTD_VERSION_CODE > MTD_VERSION(2, 6, 17))
 	struct mtd_oob_ops ops;
+	u8 *oob_buf;
 #endif
 	size_t dummy;
 
 	struct yaffs_ext_tags placeholder_tags;
 	u8 *encrypted_data = NULL;
+	u64 crypto_start;
+	int crypto_ret = 0;
 
 	int retval = 0;
 	int local_data = 0;
@@ -154,8 +180,10 @@ int nandmtd2_read_chunk_tags(struct yaffs_dev *dev, int nand_chunk,
 	if (dev->param.inband_tags) {
 
 		if (!data) {
-			local_data = 1;
 			data = yaffs_get_temp_buffer(dev);
+			if (!data)
+				return YAFFS_FAIL;
+			local_data = 1;
 		}
 
 	}
@@ -163,6 +191,8 @@ int nandmtd2_read_chunk_tags(struct yaffs_dev *dev, int nand_chunk,
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 17))
 	if (dev->is_encrypted_fs) {
 		encrypted_data = yaffs_get_temp_buffer(dev);
+		if (!encrypted_data)
+			goto out_nomem;
 
 		if (!tags)
 			tags = &placeholder_tags;
@@ -180,8 +210,16 @@ int nandmtd2_read_chunk_tags(struct yaffs_dev *dev, int nand_chunk,
 		ops.len = (data || encrypted_data) ? dev->data_bytes_per_chunk : packed_tags_size;
 		ops.ooboffs = 0;
 		ops.datbuf = dev->is_encrypted_fs ? encrypted_data : data;
-		ops.oobbuf = yaffs_dev_to_lc(dev)->spare_buffer;
+		/* The NAND driver may DMA into the OOB buffer, so it must
+		 * not be on the stack. Concurrent readers can not share the
+		 * spare buffer either, so use a temp buffer of our own. */
+		oob_buf = yaffs_get_temp_buffer(dev);
+		if (!oob_buf)
+			goto out_nomem;
+		ops.oobbuf = oob_buf;
 		retval = mtd->read_oob(mtd, addr, &ops);
+		memcpy(packed_tags_ptr, oob_buf, packed_tags_size);
+		yaffs_release_temp_buffer(dev, oob_buf);
 	}
 #else
 	if (!dev->param.inband_tags && data && tags) {
@@ -212,13 +250,17 @@ int nandmtd2_read_chunk_tags(struct yaffs_dev *dev, int nand_chunk,
 		}
 	} else {
 		if (tags) {
+#if (LINUX_VERSION_CODE <= KERNEL_VERSION(2, 6, 17))
 			memcpy(packed_tags_ptr,
 			       yaffs_dev_to_lc(dev)->spare_buffer,
 			       packed_tags_size);
+#endif
 
 			if (dev->is_encrypted_fs) {
 				if (pt.t.seq_number != 0xFFFFFFFF) {
-					AES_xts_decrypt(dev->cipher,
+					crypto_start = Y_CLOCK_US();
+					crypto_ret =
+					    AES_xts_decrypt(dev->cipher,
 							encrypted_data,
 							encrypted_data,
 							nand_chunk * 2,
@@ -227,6 +269,8 @@ int nandmtd2_read_chunk_tags(struct yaffs_dev *dev, int nand_chunk,
 							packed_tags_ptr+SEQUENCE_OFFSET,
 							(nand_chunk * 2) + 1,
 							packed_tags_size-SEQUENCE_OFFSET);
+					nandmtd2_account_crypto(dev,
+								crypto_start);
 				}
 
 				if (data)
@@ -253,10 +297,28 @@ int nandmtd2_read_chunk_tags(struct yaffs_dev *dev, int nand_chunk,
 		tags->ecc_result = YAFFS_ECC_RESULT_FIXED;
 		dev->n_ecc_fixed++;
 	}
+	if (crypto_ret) {
+		yaffs_trace(YAFFS_TRACE_ERROR,
+			"decrypting chunk %d failed %d",
+			nand_chunk, crypto_ret);
+		return YAFFS_FAIL;
+	}
+
 	if (retval == 0)
 		return YAFFS_OK;
 	else
 		return YAFFS_FAIL;
+
+#if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 17))
+out_nomem:
+	yaffs_trace(YAFFS_TRACE_ERROR,
+		"no buffer to read chunk %d", nand_chunk);
+	if (encrypted_data)
+		yaffs_release_temp_buffer(dev, encrypted_data);
+	if (local_data)
+		yaffs_release_temp_buffer(dev, data);
+	return YAFFS_FAIL;
+#endif
 }
 
 int nandmtd2_mark_block_bad(struct yaffs_dev *dev, int block_no)
@@ -180,6 +180,8 @@ unsigned int yaffs_wr_attempts = YAFFS_WR_ATTEMPTS;
 unsigned int yaffs_auto_checkpoint = 1;
 unsigned int yaffs_gc_control = 1;
 unsigned int yaffs_bg_enable = 1;
+unsigned int yaffs_bg_gc_watermark = 8;
+unsigned int yaffs_bg_idle_ms = 2000;
 unsigned int yaffs_auto_select = 1;
 /* Module Parameters */
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 5, 0))
@@ -188,6 +190,8 @@ module_param(yaffs_wr_attempts, uint, 0644);
 module_param(yaffs_auto_checkpoint, uint, 0644);
 module_param(yaffs_gc_control, uint, 0644);
 module_param(yaffs_bg_enable, uint, 0644);
+module_param(yaffs_bg_gc_watermark, uint, 0644);
+module_param(yaffs_bg_idle_ms, uint, 0644);
 #else
 MODULE_PARM(yaffs_trace_mask, "i");
 MODULE_PARM(yaffs_wr_attempts, "i");
@@ -502,17 +506,56 @@ static unsigned yaffs_gc_control_callback(struct yaffs_dev *dev)
 	return yaffs_gc_control;
 }
 
+/*
+ * Called by writers about to do inline gc. Once erased blocks drop below
+ * the watermark, kick the background thread so it reclaims ahead of them.
+ * The writer holds the gross lock, so bg_gc_kick needs no further locking.
+ */
+static void yaffs_gc_wake_callback(struct yaffs_dev *dev)
+{
+	struct yaffs_linux_context *context = yaffs_dev_to_lc(dev);
+
+	if (!context->bg_thread || context->bg_gc_kick || !yaffs_bg_enable)
+		return;
+
+	if (dev->n_erased_blocks >=
+	    dev->param.n_reserved_blocks + yaffs_bg_gc_watermark)
+		return;
+
+	context->bg_gc_kick = 1;
+	dev->bg_gc_wakes++;
+	wake_up_process(context->bg_thread);
+}
+
 static void yaffs_gross_lock(struct yaffs_dev *dev)
 {
 	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs locking %p", current);
-	mutex_lock(&(yaffs_dev_to_lc(dev)->gross_lock));
+	down_write(&(yaffs_dev_to_lc(dev)->gross_lock));
 	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs locked %p", current);
 }
 
 static void yaffs_gross_unlock(struct yaffs_dev *dev)
 {
 	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs unlocking %p", current);
-	mutex_unlock(&(yaffs_dev_to_lc(dev)->gross_lock));
+	up_write(&(yaffs_dev_to_lc(dev)->gross_lock));
+}
+
+/*
+ * Shared locking is for paths that only look things up: cached chunk
+ * reads, tnode walks and symlink aliases. Anything that can write to
+ * flash, run GC or touch the object tree must take the lock exclusively.
+ */
+static void yaffs_gross_lock_read(struct yaffs_dev *dev)
+{
+	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs read locking %p", current);
+	down_read(&(yaffs_dev_to_lc(dev)->gross_lock));
+	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs read locked %p", current);
+}
+
+static void yaffs_gross_unlock_read(struct yaffs_dev *dev)
+{
+	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs read unlocking %p", current);
+	up_read(&(yaffs_dev_to_lc(dev)->gross_lock));
 }
 
 #ifdef YAFFS_COMPILE_EXPORTFS
@@ -706,11 +749,11 @@ static int yaffs_readlink(struct dentry *dentry, char __user * buffer,
 
 	struct yaffs_dev *dev = yaffs_dentry_to_obj(dentry)->my_dev;
 
-	yaffs_gross_lock(dev);
+	yaffs_gross_lock_read(dev);
 
 	alias = yaffs_get_symlink_alias(yaffs_dentry_to_obj(dentry));
 
-	yaffs_gross_unlock(dev);
+	yaffs_gross_unlock_read(dev);
 
 	if (!alias)
 		return -ENOMEM;
@@ -733,10 +776,10 @@ static int yaffs_follow_link(struct dentry *dentry, struct nameidata *nd)
 	int ret_int = 0;
 	struct yaffs_dev *dev = yaffs_dentry_to_obj(dentry)->my_dev;
 
-	yaffs_gross_lock(dev);
+	yaffs_gross_lock_read(dev);
 
 	alias = yaffs_get_symlink_alias(yaffs_dentry_to_obj(dentry));
-	yaffs_gross_unlock(dev);
+	yaffs_gross_unlock_read(dev);
 
 	if (!alias) {
 		ret_int = -ENOMEM;
@@ -992,12 +1035,13 @@ static int yaffs_readpage_nolock(struct file *f, struct page *pg)
 	pg_buf = kmap(pg);
 	/* FIXME: Can kmap fail? */
 
-	yaffs_gross_lock(dev);
+	yaffs_gross_lock_read(dev);
 
-	ret = yaffs_file_rd(obj, pg_buf,
-			    pg->index << PAGE_CACHE_SHIFT, PAGE_CACHE_SIZE);
+	ret = yaffs_file_rd_shared(obj, pg_buf,
+				   pg->index << PAGE_CACHE_SHIFT,
+				   PAGE_CACHE_SIZE);
 
-	yaffs_gross_unlock(dev);
+	yaffs_gross_unlock_read(dev);
 
 	if (ret >= 0)
 		ret = 0;
@@ -2184,7 +2228,12 @@ static void yaffs_flush_super(struct super_block *sb, int do_checkpoint)
 		yaffs_checkpoint_save(dev);
 }
 
-static unsigned yaffs_bg_gc_urgency(struct yaffs_dev *dev)
+/*
+ * 0: no gc needed, 1: leisurely gc, 2: erased blocks are running low.
+ * An idle device gets leisurely gc even when plenty is erased, so that
+ * the writers find clean blocks when they come back.
+ */
+static unsigned yaffs_bg_gc_urgency(struct yaffs_dev *dev, int idle)
 {
 	unsigned erased_chunks =
 	    dev->n_erased_blocks * dev->param.chunks_per_block;
@@ -2198,8 +2247,11 @@ static unsigned yaffs_bg_gc_urgency(struct yaffs_dev *dev)
 		return 0;
 	else if (scattered < (dev->param.chunks_per_block * 2))
 		return 0;
+	else if (dev->n_erased_blocks <
+		 dev->param.n_reserved_blocks + yaffs_bg_gc_watermark)
+		return 2;
 	else if (erased_chunks > dev->n_free_chunks / 2)
-		return 0;
+		return idle ? 1 : 0;
 	else if (erased_chunks > dev->n_free_chunks / 4)
 		return 1;
 	else
@@ -2211,7 +2263,7 @@ static int yaffs_do_sync_fs(struct super_block *sb, int request_checkpoint)
 
 	struct yaffs_dev *dev = yaffs_super_to_dev(sb);
 	unsigned int oneshot_checkpoint = (yaffs_auto_checkpoint & 4);
-	unsigned gc_urgent = yaffs_bg_gc_urgency(dev);
+	unsigned gc_urgent = yaffs_bg_gc_urgency(dev, 0);
 	int do_checkpoint;
 
 	yaffs_trace(YAFFS_TRACE_OS | YAFFS_TRACE_SYNC | YAFFS_TRACE_BACKGROUND,
@@ -2262,8 +2314,12 @@ static int yaffs_bg_thread_fn(void *data)
 	unsigned long now = jiffies;
 	unsigned long next_dir_update = now;
 	unsigned long next_gc = now;
+	unsigned long last_active = now;
 	unsigned long expires;
 	unsigned int urgency;
+	u32 last_writes = dev->n_page_writes;
+	int idle;
+	int kicked;
 
 	int gc_result;
 	struct timer_list timer;
@@ -2287,16 +2343,28 @@ static int yaffs_bg_thread_fn(void *data)
 		yaffs_gross_lock(dev);
 
 		now = jiffies;
+		kicked = context->bg_gc_kick;
+		context->bg_gc_kick = 0;
+
+		/* Any page writes since the last pass mean we're not idle. */
+		if (dev->n_page_writes != last_writes) {
+			last_writes = dev->n_page_writes;
+			last_active = now;
+		}
+		idle = time_after(now, last_active +
+				  msecs_to_jiffies(yaffs_bg_idle_ms));
 
 		if (time_after(now, next_dir_update) && yaffs_bg_enable) {
 			yaffs_update_dirty_dirs(dev);
 			next_dir_update = now + HZ;
 		}
 
-		if (time_after(now, next_gc) && yaffs_bg_enable) {
+		if ((kicked || time_after(now, next_gc)) && yaffs_bg_enable) {
 			if (!dev->is_checkpointed) {
-				urgency = yaffs_bg_gc_urgency(dev);
+				urgency = yaffs_bg_gc_urgency(dev, idle);
 				gc_result = yaffs_bg_gc(dev, urgency);
+				/* Our own gc writes are not activity. */
+				last_writes = dev->n_page_writes;
 				if (urgency > 1)
 					next_gc = now + HZ / 20 + 1;
 				else if (urgency > 0)
@@ -2326,7 +2394,9 @@ static int yaffs_bg_thread_fn(void *data)
 
 		set_current_state(TASK_INTERRUPTIBLE);
 		add_timer(&timer);
-		schedule();
+		if (!context->bg_gc_kick)
+			schedule();
+		__set_current_state(TASK_RUNNING);
 		del_timer_sync(&timer);
 #else
 		msleep(10);
@@ -2516,6 +2586,9 @@ static void yaffs_put_super(struct super_block *sb)
 		yaffs_dev_to_lc(dev)->spare_buffer = NULL;
 	}
 
+	if (dev->cipher)
+		crypto_free_blkcipher(dev->cipher);
+
 	kfree(dev);
 }
 
@@ -2746,8 +2819,11 @@ static int yaffs_create_encrypted_filesystem(struct yaffs_dev *dev,
 		return -1;
 	}
 
-	dev->cipher = crypto_alloc_blkcipher("xts(aes)", 0, 0);
-	crypto_blkcipher_setkey(dev->cipher, keys, sizeof(keys));
+	dev->cipher = yaffs_xts_alloc(keys, sizeof(keys));
+	if (!dev->cipher) {
+		printk(KERN_INFO "Allocating xts(aes) cipher failed!\n");
+		return -1;
+	}
 	dev->param.start_block = key_management_block + 1;
 
 	printk(KERN_INFO "Creating encrypted FS success!\n");
@@ -2801,12 +2877,11 @@ static int yaffs_load_keys(struct yaffs_dev *dev, char *password,
 
 	printk(KERN_INFO "Tags ObjectID, SEQ#: %d, %d\n", tags.obj_id, tags.seq_number);
 
-	dev->cipher = crypto_alloc_blkcipher("xts(aes)", 0, 0);
-	crypto_blkcipher_setkey(dev->cipher, keys, sizeof(keys));
+	dev->cipher = yaffs_xts_alloc(keys, sizeof(keys));
 
 	kfree(page);
 
-	return 1;
+	return dev->cipher ? 1 : -1;
 }
 
 static int yaffs_unlock_encrypted_filesystem(struct yaffs_dev *dev,
@@ -3153,6 +3228,7 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 
 	param->sb_dirty_fn = yaffs_touch_super;
 	param->gc_control = yaffs_gc_control_callback;
+	param->gc_wake_fn = yaffs_gc_wake_callback;
 
 	yaffs_dev_to_lc(dev)->super = sb;
 
@@ -3184,7 +3260,7 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 	INIT_LIST_HEAD(&(yaffs_dev_to_lc(dev)->search_contexts));
 	param->remove_obj_fn = yaffs_remove_obj_callback;
 
-	mutex_init(&(yaffs_dev_to_lc(dev)->gross_lock));
+	init_rwsem(&(yaffs_dev_to_lc(dev)->gross_lock));
 
 	yaffs_gross_lock(dev);
 
@@ -3432,6 +3508,11 @@ static char *yaffs_dump_dev_part1(char *buf, struct yaffs_dev *dev)
 				dev->oldest_dirty_gc_count);
 	buf += sprintf(buf, "n_gc_blocks.......... %u\n", dev->n_gc_blocks);
 	buf += sprintf(buf, "bg_gcs............... %u\n", dev->bg_gcs);
+	buf += sprintf(buf, "bg_gc_wakes.......... %u\n", dev->bg_gc_wakes);
+	buf += sprintf(buf, "fg_gc_time_us........ %llu\n",
+				(unsigned long long)dev->fg_gc_time_us);
+	buf += sprintf(buf, "bg_gc_time_us........ %llu\n",
+				(unsigned long long)dev->bg_gc_time_us);
 	buf += sprintf(buf, "n_retired_writes..... %u\n",
 				dev->n_retired_writes);
 	buf += sprintf(buf, "n_retired_blocks..... %u\n",
@@ -3448,6 +3529,8 @@ static char *yaffs_dump_dev_part1(char *buf, struct yaffs_dev *dev)
 				dev->n_unlinked_files);
 	buf += sprintf(buf, "refresh_count........ %u\n", dev->refresh_count);
 	buf += sprintf(buf, "is_encrypted......... %d\n", dev->is_encrypted_fs);
+	buf += sprintf(buf, "crypto_time_us....... %llu\n",
+				(unsigned long long)dev->crypto_time_us);
 	buf += sprintf(buf, "n_bg_deletions....... %u\n", dev->n_bg_deletions);
 	buf += sprintf(buf, "tags_used............ %u\n", dev->tags_used);
 	buf += sprintf(buf, "summary_used......... %u\n", dev->summary_used);
@@ -300,6 +300,9 @@ int yaffs1_scan(struct yaffs_dev *dev)
 						INIT_LIST_HEAD(&parent->
 							variant.dir_variant.
 							children);
+						INIT_LIST_HEAD(&parent->
+							variant.dir_variant.
+							unhashed);
 					} else if (!parent ||
 						parent->variant_type !=
 						YAFFS_OBJECT_TYPE_DIRECTORY) {
@@ -1262,6 +1262,8 @@ static inline int yaffs2_scan_chunk(struct yaffs_dev *dev,
 					YAFFS_OBJECT_TYPE_DIRECTORY;
 				INIT_LIST_HEAD(&parent->
 						variant.dir_variant.children);
+				INIT_LIST_HEAD(&parent->
+						variant.dir_variant.unhashed);
 			} else if (!parent ||
 				   parent->variant_type !=
 					YAFFS_OBJECT_TYPE_DIRECTORY) {
@@ -48,6 +48,7 @@
 #include <linux/stat.h>
 #include <linux/sort.h>
 #include <linux/bitops.h>
+#include <linux/ktime.h>
 
 /*  These type wrappings are used to support Unicode names in WinCE. */
 #define YCHAR char
@@ -69,6 +70,9 @@
 #define Y_TIME_CONVERT(x) (x)
 #endif
 
+/* Monotonic clock in microseconds, used for timing statistics. */
+#define Y_CLOCK_US() ((u64) ktime_to_us(ktime_get()))
+
 #define compile_time_assertion(assertion) \
 	({ int x = __builtin_choose_expr(assertion, 0, (void)0); (void) x; })
 
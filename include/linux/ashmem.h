@@ -32,6 +32,21 @@ struct ashmem_pin {
 	__u32 len;	/* length forward from offset, in bytes, page-aligned */
 };
 
+/*
+ * Argument to ASHMEM_PIN_BATCH and ASHMEM_UNPIN_BATCH: 'nr' ranges are read
+ * from 'ranges' and handled as by ASHMEM_PIN or ASHMEM_UNPIN, in order. If
+ * 'status' is not zero, the result for each range is stored there, e.g.
+ * whether it was purged.
+ */
+struct ashmem_pin_batch {
+	__u32 nr;	/* number of ranges, at most ASHMEM_MAX_BATCH */
+	__u32 __pad;
+	__u64 ranges;	/* user pointer to struct ashmem_pin[nr] */
+	__u64 status;	/* user pointer to __s32[nr], or 0 */
+};
+
+#define ASHMEM_MAX_BATCH	256
+
 #define __ASHMEMIOC		0x77
 
 #define ASHMEM_SET_NAME		_IOW(__ASHMEMIOC, 1, char[ASHMEM_NAME_LEN])
@@ -47,6 +62,8 @@ struct ashmem_pin {
 #define ASHMEM_CACHE_FLUSH_RANGE	_IO(__ASHMEMIOC, 11)
 #define ASHMEM_CACHE_CLEAN_RANGE	_IO(__ASHMEMIOC, 12)
 #define ASHMEM_CACHE_INV_RANGE		_IO(__ASHMEMIOC, 13)
+#define ASHMEM_PIN_BATCH	_IOW(__ASHMEMIOC, 14, struct ashmem_pin_batch)
+#define ASHMEM_UNPIN_BATCH	_IOW(__ASHMEMIOC, 15, struct ashmem_pin_batch)
 
 int get_ashmem_file(int fd, struct file **filp, struct file **vm_file,
 			unsigned long *len);
@@ -44,6 +44,36 @@ static inline void oom_killer_enable(void)
 
 extern struct task_struct *find_lock_task_mm(struct task_struct *p);
 
+/*
+ * The Android low memory killer keeps thread group leaders sorted by
+ * oom_adj. These are called under tasklist_lock when a task becomes or
+ * stops being a group leader, and after its oom_adj is changed.
+ */
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+extern void lowmem_adj_add(struct task_struct *p);
+extern void lowmem_adj_del(struct task_struct *p);
+extern void lowmem_adj_replace(struct task_struct *old,
+			       struct task_struct *new);
+extern void lowmem_adj_update(struct task_struct *p);
+#else
+static inline void lowmem_adj_add(struct task_struct *p)
+{
+}
+
+static inline void lowmem_adj_del(struct task_struct *p)
+{
+}
+
+static inline void lowmem_adj_replace(struct task_struct *old,
+				      struct task_struct *new)
+{
+}
+
+static inline void lowmem_adj_update(struct task_struct *p)
+{
+}
+#endif
+
 
 #endif /* __KERNEL__*/
 #endif /* _INCLUDE_LINUX_OOM_H */
@@ -1269,6 +1269,9 @@ struct task_struct {
 
 	struct list_head tasks;
 	struct plist_node pushable_tasks;
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+	struct hlist_node lowmem_adj_node;
+#endif
 
 	struct mm_struct *mm, *active_mm;
 
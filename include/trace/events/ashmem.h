@@ -0,0 +1,61 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ashmem
+
+#if !defined(_TRACE_ASHMEM_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_ASHMEM_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(ashmem_purge,
+	TP_PROTO(const char *name, pid_t owner, size_t pgstart, size_t pages),
+	TP_ARGS(name, owner, pgstart, pages),
+
+	TP_STRUCT__entry(
+	    __string(name,     name   )
+	    __field(pid_t,     owner  )
+	    __field(size_t,    pgstart)
+	    __field(size_t,    pages  )
+	),
+
+	TP_fast_assign(
+	    __assign_str(name, name);
+	    __entry->owner = owner;
+	    __entry->pgstart = pgstart;
+	    __entry->pages = pages;
+	),
+
+	TP_printk("%s owner=%d pgstart=%zu pages=%zu",
+	      __get_str(name), __entry->owner, __entry->pgstart,
+	      __entry->pages)
+);
+
+TRACE_EVENT(ashmem_pin,
+	TP_PROTO(const char *name, pid_t owner, size_t pgstart, size_t pages,
+		 int purged),
+	TP_ARGS(name, owner, pgstart, pages, purged),
+
+	TP_STRUCT__entry(
+	    __string(name,     name   )
+	    __field(pid_t,     owner  )
+	    __field(size_t,    pgstart)
+	    __field(size_t,    pages  )
+	    __field(int,       purged )
+	),
+
+	TP_fast_assign(
+	    __assign_str(name, name);
+	    __entry->owner = owner;
+	    __entry->pgstart = pgstart;
+	    __entry->pages = pages;
+	    __entry->purged = purged;
+	),
+
+	TP_printk("%s owner=%d pgstart=%zu pages=%zu purged=%d",
+	      __get_str(name), __entry->owner, __entry->pgstart,
+	      __entry->pages, __entry->purged)
+);
+
+#endif /* _TRACE_ASHMEM_H */
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
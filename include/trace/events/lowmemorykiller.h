@@ -0,0 +1,75 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM lowmemorykiller
+
+#if !defined(_TRACE_LOWMEMORYKILLER_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_LOWMEMORYKILLER_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(lowmemory_scan,
+	TP_PROTO(int min_adj, int nr_scanned, s64 scan_us),
+	TP_ARGS(min_adj, nr_scanned, scan_us),
+
+	TP_STRUCT__entry(
+	    __field(int, min_adj   )
+	    __field(int, nr_scanned)
+	    __field(s64, scan_us   )
+	),
+
+	TP_fast_assign(
+	    __entry->min_adj = min_adj;
+	    __entry->nr_scanned = nr_scanned;
+	    __entry->scan_us = scan_us;
+	),
+
+	TP_printk("min_adj=%d scanned=%d time=%lldus",
+	      __entry->min_adj, __entry->nr_scanned, __entry->scan_us)
+);
+
+TRACE_EVENT(lowmemory_kill,
+	TP_PROTO(struct task_struct *killed_task, int oom_adj, int tasksize),
+	TP_ARGS(killed_task, oom_adj, tasksize),
+
+	TP_STRUCT__entry(
+	    __array(char, comm, TASK_COMM_LEN)
+	    __field(pid_t, pid     )
+	    __field(int,   oom_adj )
+	    __field(int,   tasksize)
+	),
+
+	TP_fast_assign(
+	    memcpy(__entry->comm, killed_task->comm, TASK_COMM_LEN);
+	    __entry->pid = killed_task->pid;
+	    __entry->oom_adj = oom_adj;
+	    __entry->tasksize = tasksize;
+	),
+
+	TP_printk("%s (%d), adj %d, size %d",
+	      __entry->comm, __entry->pid, __entry->oom_adj,
+	      __entry->tasksize)
+);
+
+TRACE_EVENT(lowmemory_kill_done,
+	TP_PROTO(struct task_struct *killed_task, s64 latency_us),
+	TP_ARGS(killed_task, latency_us),
+
+	TP_STRUCT__entry(
+	    __array(char, comm, TASK_COMM_LEN)
+	    __field(pid_t, pid       )
+	    __field(s64,   latency_us)
+	),
+
+	TP_fast_assign(
+	    memcpy(__entry->comm, killed_task->comm, TASK_COMM_LEN);
+	    __entry->pid = killed_task->pid;
+	    __entry->latency_us = latency_us;
+	),
+
+	TP_printk("%s (%d) gone after %lldus",
+	      __entry->comm, __entry->pid, __entry->latency_us)
+);
+
+#endif /* _TRACE_LOWMEMORYKILLER_H */
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
@@ -15,6 +15,7 @@
 #define DEBUG
 
 #include <linux/file.h>
+#include <linux/hash.h>
 #include <linux/inetdevice.h>
 #include <linux/module.h>
 #include <linux/netfilter/x_tables.h>
@@ -180,15 +181,19 @@ static struct proc_dir_entry *iface_stat_all_procfile;
  * qtaguid_mt()
  *   account_for_uid()
  *     if_tag_stat_update()
- *       get_sock_stat()
- *         sock_tag_list_lock
- *       struct iface_stat->tag_stat_list_lock
- *         tag_stat_update()
+ *       rcu_read_lock
+ *         get_iface_entry()
+ *         get_sock_stat()
+ *         sock_tag_read()
+ *         on a sock_tag cache miss:
+ *           tag_stat_hash_search()
  *           get_active_counter_set()
- *             tag_counter_set_list_lock
+ *           sock_tag_cache_update()
+ *             struct sock_tag->lock (trylock)
  *         tag_stat_update()
- *           get_active_counter_set()
- *             tag_counter_set_list_lock
+ *       only when a new tag stat is needed:
+ *       struct iface_stat->tag_stat_list_lock
+ *         create_if_tag_stat()
  *
  *
  * qtaguid_ctrl_parse()
@@ -203,6 +208,7 @@ static struct proc_dir_entry *iface_stat_all_procfile;
  *   ctrl_cmd_tag()
  *     sock_tag_list_lock
  *       (sock_tag_tree)
+ *       struct sock_tag->lock
  *       get_tag_ref()
  *         uid_tag_data_tree_lock
  *           (uid_tag_data_tree)
@@ -213,13 +219,22 @@ static struct proc_dir_entry *iface_stat_all_procfile;
  *     uid_tag_data_tree_lock
  *
  */
+/*
+ * The packet path does not take any of the locks above.
+ * The iface_stat_list and the *_hash tables are modified under their
+ * locks with the RCU list primitives, and entries that can go away
+ * (tag_stat, sock_tag, tag_counter_set) are freed after a grace period.
+ * iface_stat entries are never freed.
+ */
 static LIST_HEAD(iface_stat_list);
 static DEFINE_SPINLOCK(iface_stat_list_lock);
 
 static struct rb_root sock_tag_tree = RB_ROOT;
+static struct hlist_head sock_tag_hash[1 << SOCK_TAG_HASH_BITS];
 static DEFINE_SPINLOCK(sock_tag_list_lock);
 
 static struct rb_root tag_counter_set_tree = RB_ROOT;
+static struct hlist_head tag_counter_set_hash[1 << TAG_COUNTER_SET_HASH_BITS];
 static DEFINE_SPINLOCK(tag_counter_set_list_lock);
 
 static struct rb_root uid_tag_data_tree = RB_ROOT;
@@ -229,6 +244,26 @@ static struct rb_root proc_qtu_data_tree = RB_ROOT;
 /* No proc_qtu_data_tree_lock; use uid_tag_data_tree_lock */
 
 static struct qtaguid_event_counts qtu_events;
+static DEFINE_PER_CPU(struct qtaguid_cache_counts, qtu_cache_counts);
+
+/*
+ * Bumped whenever what a sock_tag has cached might have gone stale:
+ * tag stats being deleted, or counter sets changing.
+ */
+static atomic_t sock_tag_cache_gen = ATOMIC_INIT(0);
+static void qtu_sum_cache_counts(u64 *hits, u64 *misses)
+{
+	struct qtaguid_cache_counts *counts;
+	int cpu;
+
+	*hits = *misses = 0;
+	for_each_possible_cpu(cpu) {
+		counts = &per_cpu(qtu_cache_counts, cpu);
+		*hits += counts->sock_tag_cache_hits;
+		*misses += counts->sock_tag_cache_misses;
+	}
+}
+
 /*----------------------------------------------*/
 static bool can_manipulate_uids(void)
 {
@@ -260,6 +295,83 @@ static inline void dc_add_byte_packets(struct data_counters *counters, int set,
 	counters->bpc[set][direction][ifs_proto].packets += packets;
 }
 
+/*
+ * The per-cpu counters are only touched from the netfilter hooks, which run
+ * with BHs disabled, so the cpu can't change under us.
+ */
+static inline struct data_counters *dc_this_cpu(struct data_counters *dc)
+{
+	return &dc[smp_processor_id()];
+}
+
+/*
+ * A 32-bit cpu can't load or store a 64-bit counter in one go, so the
+ * updates of a per-cpu copy are wrapped in its seqcount and the readers
+ * retry on it, the same way u64_stats_sync does it. On 64-bit this all
+ * compiles away.
+ */
+static inline void dc_update_begin(struct data_counters *dc)
+{
+#if BITS_PER_LONG == 32
+	write_seqcount_begin(&dc->seq);
+#endif
+}
+
+static inline void dc_update_end(struct data_counters *dc)
+{
+#if BITS_PER_LONG == 32
+	write_seqcount_end(&dc->seq);
+#endif
+}
+
+static inline unsigned int dc_fetch_begin(struct data_counters *dc)
+{
+#if BITS_PER_LONG == 32
+	return read_seqcount_begin(&dc->seq);
+#else
+	return 0;
+#endif
+}
+
+static inline bool dc_fetch_retry(struct data_counters *dc,
+				  unsigned int start)
+{
+#if BITS_PER_LONG == 32
+	return read_seqcount_retry(&dc->seq, start);
+#else
+	return false;
+#endif
+}
+
+/*
+ * Add up the per-cpu copies of the counters into sum.
+ * Every counter is read whole, but the writers don't stop while this
+ * runs, so the counters are not all from the same instant.
+ */
+static void dc_sum_cpus(struct data_counters *sum, struct data_counters *dc)
+{
+	const int nr_bpc = sizeof(sum->bpc) / sizeof(sum->bpc[0][0][0]);
+	struct byte_packet_counters *from, *to;
+	uint64_t bytes, packets;
+	unsigned int start;
+	int cpu, i;
+
+	memset(sum, 0, sizeof(*sum));
+	to = &sum->bpc[0][0][0];
+	for_each_possible_cpu(cpu) {
+		from = &dc[cpu].bpc[0][0][0];
+		for (i = 0; i < nr_bpc; i++) {
+			do {
+				start = dc_fetch_begin(&dc[cpu]);
+				bytes = from[i].bytes;
+				packets = from[i].packets;
+			} while (dc_fetch_retry(&dc[cpu], start));
+			to[i].bytes += bytes;
+			to[i].packets += packets;
+		}
+	}
+}
+
 static inline uint64_t dc_sum_bytes(struct data_counters *counters,
 				    int set,
 				    enum ifs_tx_rx direction)
@@ -342,10 +454,42 @@ static struct tag_stat *tag_stat_tree_search(struct rb_root *root, tag_t tag)
 	return rb_entry(&node->node, struct tag_stat, tn.node);
 }
 
+/* iface_entry->tag_stat_list_lock or rcu_read_lock should be held. */
+static struct tag_stat *tag_stat_hash_search(struct iface_stat *iface_entry,
+					     tag_t tag)
+{
+	struct hlist_head *head;
+	struct hlist_node *pos;
+	struct tag_stat *ts_entry;
+
+	head = &iface_entry->tag_stat_hash[hash_64(tag, TAG_STAT_HASH_BITS)];
+	hlist_for_each_entry_rcu(ts_entry, pos, head, hash_node) {
+		if (ts_entry->tn.tag == tag)
+			return ts_entry;
+	}
+	return NULL;
+}
+
+static void tag_stat_free_rcu(struct rcu_head *head)
+{
+	struct tag_stat *ts_entry = container_of(head, struct tag_stat, rcu);
+
+	kfree(ts_entry->counters);
+	kfree(ts_entry);
+}
+
 static void tag_counter_set_tree_insert(struct tag_counter_set *data,
 					struct rb_root *root)
 {
 	tag_node_tree_insert(&data->tn, root);
+	hlist_add_head_rcu(&data->hash_node,
+			   &tag_counter_set_hash[hash_64(data->tn.tag,
+						 TAG_COUNTER_SET_HASH_BITS)]);
+}
+
+static void tag_counter_set_free_rcu(struct rcu_head *head)
+{
+	kfree(container_of(head, struct tag_counter_set, rcu));
 }
 
 static struct tag_counter_set *tag_counter_set_tree_search(struct rb_root *root,
@@ -389,6 +533,96 @@ static struct sock_tag *sock_tag_tree_search(struct rb_root *root,
 	return NULL;
 }
 
+/* sock_tag_list_lock or rcu_read_lock should be held. */
+static struct sock_tag *sock_tag_hash_search(const struct sock *sk)
+{
+	struct hlist_head *head;
+	struct hlist_node *pos;
+	struct sock_tag *st_entry;
+
+	head = &sock_tag_hash[hash_ptr((void *)sk, SOCK_TAG_HASH_BITS)];
+	hlist_for_each_entry_rcu(st_entry, pos, head, hash_node) {
+		if (st_entry->sk == sk)
+			return st_entry;
+	}
+	return NULL;
+}
+
+/* sock_tag_list_lock should be held. */
+static void sock_tag_hash_insert(struct sock_tag *data)
+{
+	hlist_add_head_rcu(&data->hash_node,
+			   &sock_tag_hash[hash_ptr(data->sk,
+						   SOCK_TAG_HASH_BITS)]);
+}
+
+/*
+ * Must be called after the stale tag stats or counter sets have been
+ * unlinked, and before they are freed.
+ */
+static void sock_tag_cache_invalidate_all(void)
+{
+	smp_wmb();
+	atomic_inc(&sock_tag_cache_gen);
+}
+
+/*
+ * Read the socket's tag, which can be changed by a re-tag while it is
+ * looked up under RCU.
+ * Returns the tag_stat the socket was last billed to on iface_entry, with
+ * its counter set, if the cache is still valid for gen.
+ * Caller must hold rcu_read_lock.
+ */
+static struct tag_stat *sock_tag_read(struct sock_tag *st_entry,
+				      unsigned int gen,
+				      struct iface_stat *iface_entry,
+				      tag_t *tag, int *active_set)
+{
+	unsigned seq;
+	struct tag_stat *ts_entry;
+
+	do {
+		seq = read_seqcount_begin(&st_entry->seq);
+		*tag = st_entry->tag;
+		ts_entry = st_entry->cached_ts;
+		if (st_entry->cache_gen != gen)
+			ts_entry = NULL;
+		*active_set = st_entry->cached_active_set;
+	} while (read_seqcount_retry(&st_entry->seq, seq));
+
+	if (ts_entry && ts_entry->iface_entry == iface_entry
+	    && ts_entry->tn.tag == *tag)
+		return ts_entry;
+	return NULL;
+}
+
+/*
+ * Remember what the socket's tag resolved to, as looked up after gen was
+ * read. Called with BHs disabled.
+ */
+static void sock_tag_cache_update(struct sock_tag *st_entry,
+				  unsigned int gen, tag_t tag,
+				  struct tag_stat *ts_entry, int active_set)
+{
+	/* Somebody else is at it, don't spin in the packet path. */
+	if (!spin_trylock(&st_entry->lock))
+		return;
+	/* Don't cache the old tag's resolution after a re-tag. */
+	if (st_entry->tag == tag) {
+		write_seqcount_begin(&st_entry->seq);
+		st_entry->cache_gen = gen;
+		st_entry->cached_ts = ts_entry;
+		st_entry->cached_active_set = active_set;
+		write_seqcount_end(&st_entry->seq);
+	}
+	spin_unlock(&st_entry->lock);
+}
+
+static void sock_tag_free_rcu(struct rcu_head *head)
+{
+	kfree(container_of(head, struct sock_tag, rcu));
+}
+
 static void sock_tag_tree_insert(struct sock_tag *data, struct rb_root *root)
 {
 	struct rb_node **new = &(root->rb_node), *parent = NULL;
@@ -427,7 +661,7 @@ static void sock_tag_tree_erase(struct rb_root *st_to_free_tree)
 			 get_uid_from_tag(st_entry->tag));
 		rb_erase(&st_entry->sock_node, st_to_free_tree);
 		sockfd_put(st_entry->socket);
-		kfree(st_entry);
+		call_rcu(&st_entry->rcu, sock_tag_free_rcu);
 	}
 }
 
@@ -742,23 +976,29 @@ static int get_active_counter_set(tag_t tag)
 {
 	int active_set = 0;
 	struct tag_counter_set *tcs;
+	struct hlist_head *head;
+	struct hlist_node *pos;
 
 	MT_DEBUG("qtaguid: get_active_counter_set(tag=0x%llx)"
 		 " (uid=%u)\n",
 		 tag, get_uid_from_tag(tag));
 	/* For now we only handle UID tags for active sets */
 	tag = get_utag_from_tag(tag);
-	spin_lock_bh(&tag_counter_set_list_lock);
-	tcs = tag_counter_set_tree_search(&tag_counter_set_tree, tag);
-	if (tcs)
-		active_set = tcs->active_set;
-	spin_unlock_bh(&tag_counter_set_list_lock);
+	head = &tag_counter_set_hash[hash_64(tag, TAG_COUNTER_SET_HASH_BITS)];
+	rcu_read_lock();
+	hlist_for_each_entry_rcu(tcs, pos, head, hash_node) {
+		if (tcs->tn.tag == tag) {
+			active_set = ACCESS_ONCE(tcs->active_set);
+			break;
+		}
+	}
+	rcu_read_unlock();
 	return active_set;
 }
 
 /*
  * Find the entry for tracking the specified interface.
- * Caller must hold iface_stat_list_lock
+ * Caller must hold iface_stat_list_lock or rcu_read_lock.
  */
 static struct iface_stat *get_iface_entry(const char *ifname)
 {
@@ -771,7 +1011,7 @@ static struct iface_stat *get_iface_entry(const char *ifname)
 	}
 
 	/* Iterate over interfaces */
-	list_for_each_entry(iface_entry, &iface_stat_list, list) {
+	list_for_each_entry_rcu(iface_entry, &iface_stat_list, list) {
 		if (!strcmp(ifname, iface_entry->ifname))
 			goto done;
 	}
@@ -907,6 +1147,7 @@ static struct iface_stat *iface_alloc(struct net_device *net_dev)
 {
 	struct iface_stat *new_iface;
 	struct iface_stat_work *isw;
+	int i;
 
 	new_iface = kzalloc(sizeof(*new_iface), GFP_ATOMIC);
 	if (new_iface == NULL) {
@@ -923,6 +1164,8 @@ static struct iface_stat *iface_alloc(struct net_device *net_dev)
 	}
 	spin_lock_init(&new_iface->tag_stat_list_lock);
 	new_iface->tag_stat_tree = RB_ROOT;
+	for (i = 0; i < ARRAY_SIZE(new_iface->tag_stat_hash); i++)
+		INIT_HLIST_HEAD(&new_iface->tag_stat_hash[i]);
 	_iface_stat_set_active(new_iface, net_dev, true);
 
 	/*
@@ -941,7 +1184,7 @@ static struct iface_stat *iface_alloc(struct net_device *net_dev)
 	isw->iface_entry = new_iface;
 	INIT_WORK(&isw->iface_work, iface_create_proc_worker);
 	schedule_work(&isw->iface_work);
-	list_add(&new_iface->list, &iface_stat_list);
+	list_add_rcu(&new_iface->list, &iface_stat_list);
 	return new_iface;
 }
 
@@ -1131,16 +1374,13 @@ static struct sock_tag *get_sock_stat_nl(const struct sock *sk)
 	return sock_tag_tree_search(&sock_tag_tree, sk);
 }
 
+/* Caller must hold rcu_read_lock */
 static struct sock_tag *get_sock_stat(const struct sock *sk)
 {
-	struct sock_tag *sock_tag_entry;
 	MT_DEBUG("qtaguid: get_sock_stat(sk=%p)\n", sk);
 	if (!sk)
 		return NULL;
-	spin_lock_bh(&sock_tag_list_lock);
-	sock_tag_entry = get_sock_stat_nl(sk);
-	spin_unlock_bh(&sock_tag_list_lock);
-	return sock_tag_entry;
+	return sock_tag_hash_search(sk);
 }
 
 static void
@@ -1216,29 +1456,36 @@ static void iface_stat_update(struct net_device *net_dev, bool stash_only)
 	spin_unlock_bh(&iface_stat_list_lock);
 }
 
-static void tag_stat_update(struct tag_stat *tag_entry,
+static void tag_stat_update(struct tag_stat *tag_entry, int active_set,
 			enum ifs_tx_rx direction, int proto, int bytes)
 {
-	int active_set;
-	active_set = get_active_counter_set(tag_entry->tn.tag);
+	struct data_counters *dc;
+
 	MT_DEBUG("qtaguid: tag_stat_update(tag=0x%llx (uid=%u) set=%d "
 		 "dir=%d proto=%d bytes=%d)\n",
 		 tag_entry->tn.tag, get_uid_from_tag(tag_entry->tn.tag),
 		 active_set, direction, proto, bytes);
-	data_counters_update(&tag_entry->counters, active_set, direction,
-			     proto, bytes);
-	if (tag_entry->parent_counters)
-		data_counters_update(tag_entry->parent_counters, active_set,
-				     direction, proto, bytes);
+	dc = dc_this_cpu(tag_entry->counters);
+	dc_update_begin(dc);
+	data_counters_update(dc, active_set, direction, proto, bytes);
+	dc_update_end(dc);
+	if (tag_entry->parent_counters) {
+		dc = dc_this_cpu(tag_entry->parent_counters);
+		dc_update_begin(dc);
+		data_counters_update(dc, active_set, direction, proto, bytes);
+		dc_update_end(dc);
+	}
 }
 
 /*
  * Create a new entry for tracking the specified {acct_tag,uid_tag} within
  * the interface.
+ * The entry is fully set up before it becomes visible to the RCU readers.
  * iface_entry->tag_stat_list_lock should be held.
  */
-static struct tag_stat *create_if_tag_stat(struct iface_stat *iface_entry,
-					   tag_t tag)
+static struct tag_stat *
+create_if_tag_stat(struct iface_stat *iface_entry, tag_t tag,
+		   struct data_counters *parent_counters)
 {
 	struct tag_stat *new_tag_stat_entry = NULL;
 	IF_DEBUG("qtaguid: iface_stat: %s(): ife=%p tag=0x%llx"
@@ -1249,8 +1496,22 @@ static struct tag_stat *create_if_tag_stat(struct iface_stat *iface_entry,
 		pr_err("qtaguid: iface_stat: tag stat alloc failed\n");
 		goto done;
 	}
+	new_tag_stat_entry->counters = kcalloc(nr_cpu_ids,
+					       sizeof(struct data_counters),
+					       GFP_ATOMIC);
+	if (!new_tag_stat_entry->counters) {
+		pr_err("qtaguid: iface_stat: tag stat counters alloc failed\n");
+		kfree(new_tag_stat_entry);
+		new_tag_stat_entry = NULL;
+		goto done;
+	}
 	new_tag_stat_entry->tn.tag = tag;
+	new_tag_stat_entry->iface_entry = iface_entry;
+	new_tag_stat_entry->parent_counters = parent_counters;
 	tag_stat_tree_insert(new_tag_stat_entry, &iface_entry->tag_stat_tree);
+	hlist_add_head_rcu(&new_tag_stat_entry->hash_node,
+			   &iface_entry->tag_stat_hash[hash_64(tag,
+						       TAG_STAT_HASH_BITS)]);
 done:
 	return new_tag_stat_entry;
 }
@@ -1266,29 +1527,43 @@ static void if_tag_stat_update(const char *ifname, uid_t uid,
 	struct sock_tag *sock_tag_entry;
 	struct iface_stat *iface_entry;
 	struct tag_stat *new_tag_stat;
+	unsigned int gen;
+	int active_set;
 	MT_DEBUG("qtaguid: if_tag_stat_update(ifname=%s "
 		"uid=%u sk=%p dir=%d proto=%d bytes=%d)\n",
 		 ifname, uid, sk, direction, proto, bytes);
 
-
+	rcu_read_lock();
 	iface_entry = get_iface_entry(ifname);
 	if (!iface_entry) {
 		pr_err("qtaguid: iface_stat: stat_update() %s not found\n",
 		       ifname);
-		return;
+		goto done;
 	}
 	/* It is ok to process data when an iface_entry is inactive */
 
 	MT_DEBUG("qtaguid: iface_stat: stat_update() dev=%s entry=%p\n",
 		 ifname, iface_entry);
 
+	/* Anything looked up after this can be cached under gen. */
+	gen = atomic_read(&sock_tag_cache_gen);
+	smp_rmb();
+
 	/*
 	 * Look for a tagged sock.
 	 * It will have an acct_uid.
 	 */
 	sock_tag_entry = get_sock_stat(sk);
 	if (sock_tag_entry) {
-		tag = sock_tag_entry->tag;
+		tag_stat_entry = sock_tag_read(sock_tag_entry, gen, iface_entry,
+					       &tag, &active_set);
+		if (tag_stat_entry) {
+			__get_cpu_var(qtu_cache_counts).sock_tag_cache_hits++;
+			tag_stat_update(tag_stat_entry, active_set, direction,
+					proto, bytes);
+			goto done;
+		}
+		__get_cpu_var(qtu_cache_counts).sock_tag_cache_misses++;
 		acct_tag = get_atag_from_tag(tag);
 		uid_tag = get_utag_from_tag(tag);
 	} else {
@@ -1299,42 +1574,59 @@ static void if_tag_stat_update(const char *ifname, uid_t uid,
 	MT_DEBUG("qtaguid: iface_stat: stat_update(): "
 		 " looking for tag=0x%llx (uid=%u) in ife=%p\n",
 		 tag, get_uid_from_tag(tag), iface_entry);
-	/* Loop over tag list under this interface for {acct_tag,uid_tag} */
-	spin_lock_bh(&iface_entry->tag_stat_list_lock);
-
-	tag_stat_entry = tag_stat_tree_search(&iface_entry->tag_stat_tree,
-					      tag);
+	/* Look for the {acct_tag,uid_tag} under this interface */
+	tag_stat_entry = tag_stat_hash_search(iface_entry, tag);
 	if (tag_stat_entry) {
 		/*
 		 * Updating the {acct_tag, uid_tag} entry handles both stats:
 		 * {0, uid_tag} will also get updated.
 		 */
-		tag_stat_update(tag_stat_entry, direction, proto, bytes);
-		spin_unlock_bh(&iface_entry->tag_stat_list_lock);
-		return;
+		goto update;
 	}
 
-	/* Loop over tag list under this interface for {0,uid_tag} */
-	tag_stat_entry = tag_stat_tree_search(&iface_entry->tag_stat_tree,
-					      uid_tag);
+	spin_lock_bh(&iface_entry->tag_stat_list_lock);
+	/* Someone else might have added it since the lookup above. */
+	tag_stat_entry = tag_stat_hash_search(iface_entry, tag);
+	if (tag_stat_entry)
+		goto update_unlock;
+
+	/* Look for the {0,uid_tag} under this interface */
+	tag_stat_entry = tag_stat_hash_search(iface_entry, uid_tag);
 	if (!tag_stat_entry) {
 		/* Here: the base uid_tag did not exist */
 		/*
 		 * No parent counters. So
 		 *  - No {0, uid_tag} stats and no {acc_tag, uid_tag} stats.
 		 */
-		new_tag_stat = create_if_tag_stat(iface_entry, uid_tag);
-		uid_tag_counters = &new_tag_stat->counters;
+		new_tag_stat = create_if_tag_stat(iface_entry, uid_tag, NULL);
+		if (!new_tag_stat)
+			goto done_unlock;
+		uid_tag_counters = new_tag_stat->counters;
 	} else {
-		uid_tag_counters = &tag_stat_entry->counters;
+		uid_tag_counters = tag_stat_entry->counters;
 	}
 
 	if (acct_tag) {
-		new_tag_stat = create_if_tag_stat(iface_entry, tag);
-		new_tag_stat->parent_counters = uid_tag_counters;
+		new_tag_stat = create_if_tag_stat(iface_entry, tag,
+						  uid_tag_counters);
+		if (!new_tag_stat)
+			goto done_unlock;
 	}
-	tag_stat_update(new_tag_stat, direction, proto, bytes);
+	tag_stat_entry = new_tag_stat;
+update_unlock:
+	spin_unlock_bh(&iface_entry->tag_stat_list_lock);
+update:
+	active_set = get_active_counter_set(tag);
+	tag_stat_update(tag_stat_entry, active_set, direction, proto, bytes);
+	if (sock_tag_entry)
+		sock_tag_cache_update(sock_tag_entry, gen, tag, tag_stat_entry,
+				      active_set);
+	goto done;
+
+done_unlock:
 	spin_unlock_bh(&iface_entry->tag_stat_list_lock);
+done:
+	rcu_read_unlock();
 }
 
 static int iface_netdev_event_handler(struct notifier_block *nb,
@@ -1763,6 +2055,7 @@ static int qtaguid_ctrl_proc_read(char *page, char **num_items_returned,
 	int item_index = 0;
 	int indent_level = 0;
 	long f_count;
+	u64 cache_hits, cache_misses;
 
 	if (unlikely(module_passive)) {
 		*eof = 1;
@@ -1810,6 +2103,7 @@ static int qtaguid_ctrl_proc_read(char *page, char **num_items_returned,
 	spin_unlock_bh(&sock_tag_list_lock);
 
 	if (item_index++ >= items_to_skip) {
+		qtu_sum_cache_counts(&cache_hits, &cache_misses);
 		len = snprintf(outp, char_count,
 			       "events: sockets_tagged=%llu "
 			       "sockets_untagged=%llu "
@@ -1821,7 +2115,9 @@ static int qtaguid_ctrl_proc_read(char *page, char **num_items_returned,
 			       "match_found_sk_in_ct=%llu "
 			       "match_found_no_sk_in_ct=%llu "
 			       "match_no_sk=%llu "
-			       "match_no_sk_file=%llu\n",
+			       "match_no_sk_file=%llu "
+			       "sock_tag_cache_hits=%llu "
+			       "sock_tag_cache_misses=%llu\n",
 			       atomic64_read(&qtu_events.sockets_tagged),
 			       atomic64_read(&qtu_events.sockets_untagged),
 			       atomic64_read(&qtu_events.counter_set_changes),
@@ -1833,7 +2129,8 @@ static int qtaguid_ctrl_proc_read(char *page, char **num_items_returned,
 			       atomic64_read(
 				       &qtu_events.match_found_no_sk_in_ct),
 			       atomic64_read(&qtu_events.match_no_sk),
-			       atomic64_read(&qtu_events.match_no_sk_file));
+			       atomic64_read(&qtu_events.match_no_sk_file),
+			       cache_hits, cache_misses);
 		if (len >= char_count) {
 			*outp = '\0';
 			return outp - page;
@@ -1916,6 +2213,7 @@ static int ctrl_cmd_delete(const char *input)
 
 		if (!acct_tag || st_entry->tag == tag) {
 			rb_erase(&st_entry->sock_node, &sock_tag_tree);
+			hlist_del_rcu(&st_entry->hash_node);
 			/* Can't sockfd_put() within spinlock, do it later. */
 			sock_tag_tree_insert(st_entry, &st_to_free_tree);
 			tr_entry = lookup_tag_ref(st_entry->tag, NULL);
@@ -1948,7 +2246,9 @@ static int ctrl_cmd_delete(const char *input)
 			 get_uid_from_tag(tcs_entry->tn.tag),
 			 tcs_entry->active_set);
 		rb_erase(&tcs_entry->tn.node, &tag_counter_set_tree);
-		kfree(tcs_entry);
+		hlist_del_rcu(&tcs_entry->hash_node);
+		sock_tag_cache_invalidate_all();
+		call_rcu(&tcs_entry->rcu, tag_counter_set_free_rcu);
 	}
 	spin_unlock_bh(&tag_counter_set_list_lock);
 
@@ -1979,7 +2279,9 @@ static int ctrl_cmd_delete(const char *input)
 					 entry_uid);
 				rb_erase(&ts_entry->tn.node,
 					 &iface_entry->tag_stat_tree);
-				kfree(ts_entry);
+				hlist_del_rcu(&ts_entry->hash_node);
+				sock_tag_cache_invalidate_all();
+				call_rcu(&ts_entry->rcu, tag_stat_free_rcu);
 			}
 		}
 		spin_unlock_bh(&iface_entry->tag_stat_list_lock);
@@ -2067,6 +2369,7 @@ static int ctrl_cmd_counter_set(const char *input)
 			 input, tag, get_uid_from_tag(tag), counter_set);
 	}
 	tcs->active_set = counter_set;
+	sock_tag_cache_invalidate_all();
 	spin_unlock_bh(&tag_counter_set_list_lock);
 	atomic64_inc(&qtu_events.counter_set_changes);
 	res = 0;
@@ -2160,7 +2463,12 @@ static int ctrl_cmd_tag(const char *input)
 		BUG_ON(IS_ERR_OR_NULL(prev_tag_ref_entry));
 		BUG_ON(prev_tag_ref_entry->num_sock_tags <= 0);
 		prev_tag_ref_entry->num_sock_tags--;
+		spin_lock(&sock_tag_entry->lock);
+		write_seqcount_begin(&sock_tag_entry->seq);
 		sock_tag_entry->tag = full_tag;
+		sock_tag_entry->cached_ts = NULL;
+		write_seqcount_end(&sock_tag_entry->seq);
+		spin_unlock(&sock_tag_entry->lock);
 	} else {
 		CT_DEBUG("qtaguid: ctrl_tag(%s): newtag for sk=%p\n",
 			 input, el_socket->sk);
@@ -2177,6 +2485,8 @@ static int ctrl_cmd_tag(const char *input)
 		sock_tag_entry->sk = el_socket->sk;
 		sock_tag_entry->socket = el_socket;
 		sock_tag_entry->pid = current->tgid;
+		spin_lock_init(&sock_tag_entry->lock);
+		seqcount_init(&sock_tag_entry->seq);
 		sock_tag_entry->tag = combine_atag_with_uid(acct_tag,
 							    uid);
 		spin_lock_bh(&uid_tag_data_tree_lock);
@@ -2198,6 +2508,7 @@ static int ctrl_cmd_tag(const char *input)
 		spin_unlock_bh(&uid_tag_data_tree_lock);
 
 		sock_tag_tree_insert(sock_tag_entry, &sock_tag_tree);
+		sock_tag_hash_insert(sock_tag_entry);
 		atomic64_inc(&qtu_events.sockets_tagged);
 	}
 	spin_unlock_bh(&sock_tag_list_lock);
@@ -2262,6 +2573,7 @@ static int ctrl_cmd_untag(const char *input)
 	 * so it can do whatever it wants to it.
 	 */
 	rb_erase(&sock_tag_entry->sock_node, &sock_tag_tree);
+	hlist_del_rcu(&sock_tag_entry->hash_node);
 
 	tag_ref_entry = lookup_tag_ref(sock_tag_entry->tag, &utd_entry);
 	BUG_ON(!tag_ref_entry);
@@ -2296,7 +2608,7 @@ static int ctrl_cmd_untag(const char *input)
 		 input, sock_tag_entry,
 		 atomic_long_read(&el_socket->file->f_count) - 1);
 	sockfd_put(el_socket);
-	kfree(sock_tag_entry);
+	call_rcu(&sock_tag_entry->rcu, sock_tag_free_rcu);
 	atomic64_inc(&qtu_events.sockets_untagged);
 
 	return 0;
@@ -2379,7 +2691,8 @@ struct proc_print_info {
 static int pp_stats_line(struct proc_print_info *ppi, int cnt_set)
 {
 	int len;
-	struct data_counters *cnts;
+	struct data_counters sum;
+	struct data_counters *cnts = &sum;
 
 	if (!ppi->item_index) {
 		if (ppi->item_index++ < ppi->items_to_skip)
@@ -2409,7 +2722,7 @@ static int pp_stats_line(struct proc_print_info *ppi, int cnt_set)
 		}
 		if (ppi->item_index++ < ppi->items_to_skip)
 			return 0;
-		cnts = &ppi->ts_entry->counters;
+		dc_sum_cpus(cnts, ppi->ts_entry->counters);
 		len = snprintf(
 			ppi->outp, ppi->char_count,
 			"%d %s 0x%llx %u %u "
@@ -2654,6 +2967,7 @@ static int qtudev_release(struct inode *inode, struct file *file)
 		free_tag_ref_from_utd_entry(tr, utd_entry);
 
 		rb_erase(&st_entry->sock_node, &sock_tag_tree);
+		hlist_del_rcu(&st_entry->hash_node);
 		list_del(&st_entry->list);
 		/* Can't sockfd_put() within spinlock, do it later. */
 		sock_tag_tree_insert(st_entry, &st_to_free_tree);
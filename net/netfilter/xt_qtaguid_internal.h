@@ -11,7 +11,10 @@
 #define __XT_QTAGUID_INTERNAL_H__
 
 #include <linux/types.h>
+#include <linux/list.h>
 #include <linux/rbtree.h>
+#include <linux/rcupdate.h>
+#include <linux/seqlock.h>
 #include <linux/spinlock_types.h>
 #include <linux/workqueue.h>
 
@@ -177,8 +180,21 @@ struct byte_packet_counters {
 
 struct data_counters {
 	struct byte_packet_counters bpc[IFS_MAX_COUNTER_SETS][IFS_MAX_DIRECTIONS][IFS_MAX_PROTOS];
+#if BITS_PER_LONG == 32
+	/* lets readers of a per-cpu copy see whole 64-bit counters */
+	seqcount_t seq;
+#endif
 };
 
+/*
+ * The packet path looks things up through hashes walked under RCU.
+ * The rb trees are still the ordered index used by the ctrl and stats
+ * procfs code, under the usual locks.
+ */
+#define TAG_STAT_HASH_BITS 8
+#define SOCK_TAG_HASH_BITS 10
+#define TAG_COUNTER_SET_HASH_BITS 6
+
 /* Generic X based nodes used as a base for rb_tree ops */
 struct tag_node {
 	struct rb_node node;
@@ -187,12 +203,19 @@ struct tag_node {
 
 struct tag_stat {
 	struct tag_node tn;
-	struct data_counters counters;
+	struct hlist_node hash_node;  /* in iface_stat.tag_stat_hash */
+	struct iface_stat *iface_entry;  /* the iface this is tracked under */
+	/*
+	 * One data_counters per possible cpu, indexed by cpu id.
+	 * They are only summed up when the stats are read.
+	 */
+	struct data_counters *counters;
 	/*
 	 * If this tag is acct_tag based, we need to count against the
 	 * matching parent uid_tag.
 	 */
 	struct data_counters *parent_counters;
+	struct rcu_head rcu;
 };
 
 struct iface_stat {
@@ -218,6 +241,7 @@ struct iface_stat {
 	struct proc_dir_entry *proc_ptr;
 
 	struct rb_root tag_stat_tree;
+	struct hlist_head tag_stat_hash[1 << TAG_STAT_HASH_BITS];
 	spinlock_t tag_stat_list_lock;
 };
 
@@ -235,6 +259,7 @@ struct iface_stat_work {
  */
 struct sock_tag {
 	struct rb_node sock_node;
+	struct hlist_node hash_node;  /* in sock_tag_hash */
 	struct sock *sk;  /* Only used as a number, never dereferenced */
 	/* The socket is needed for sockfd_put() */
 	struct socket *socket;
@@ -242,7 +267,21 @@ struct sock_tag {
 	struct list_head list;   /* in proc_qtu_data.sock_tag_list */
 	pid_t pid;
 
+	/*
+	 * The tag, and what it last resolved to, are read by the packet
+	 * path under seq. Writers hold lock.
+	 */
+	spinlock_t lock;
+	seqcount_t seq;
 	tag_t tag;
+	/*
+	 * The tag_stat and counter set the socket's traffic was last billed
+	 * to. Only valid while cache_gen matches sock_tag_cache_gen.
+	 */
+	unsigned int cache_gen;
+	struct tag_stat *cached_ts;
+	int cached_active_set;
+	struct rcu_head rcu;
 };
 
 struct qtaguid_event_counts {
@@ -275,10 +314,22 @@ struct qtaguid_event_counts {
 	atomic64_t match_no_sk_file;
 };
 
+/*
+ * For tagged sockets: whether the tag_stat and counter set cached on the
+ * sock_tag could be used, or had to be looked up. These are counted on
+ * every packet, so they are kept per cpu and only summed when read.
+ */
+struct qtaguid_cache_counts {
+	unsigned long sock_tag_cache_hits;
+	unsigned long sock_tag_cache_misses;
+};
+
 /* Track the set active_set for the given tag. */
 struct tag_counter_set {
 	struct tag_node tn;
+	struct hlist_node hash_node;  /* in tag_counter_set_hash */
 	int active_set;
+	struct rcu_head rcu;
 };
 
 /*----------------------------------------------*/
@@ -162,7 +162,7 @@ char *pp_tag_stat(struct tag_stat *ts)
 		return res;
 	}
 	tn_str = pp_tag_node(&ts->tn);
-	counters_str = pp_data_counters(&ts->counters, true);
+	counters_str = pp_data_counters(ts->counters, true);
 	parent_counters_str = pp_data_counters(ts->parent_counters, false);
 	res = kasprintf(GFP_ATOMIC,
 			"tag_stat@%p{%s, counters=%s, parent_counters=%s}",
@@ -0,0 +1,423 @@
+/*
+ * binder-pingpong - binder round trip rate with independent process pairs
+ *
+ *   binder-pingpong [-p pairs] [-s size] [-t seconds]
+ *
+ * Forks one server and one client process per pair. The parent makes
+ * itself the context manager, collects a binder object from each server
+ * and hands server i's object to client i, so every pair talks over its
+ * own node and the only thing they share is the driver. Each client
+ * then sends size-byte transactions to its server, which echoes them
+ * back, for the given number of seconds. The total round trip rate is
+ * printed, along with the mean round trip time.
+ *
+ * With one global binder lock the total rate stays flat as pairs are
+ * added; it should grow with the number of CPUs as the lock is split.
+ *
+ * Needs the context manager slot, so stop servicemanager (and with it
+ * the framework) first, e.g. "stop; stop servicemanager" from adb shell.
+ *
+ * Build with the target's userspace toolchain:
+ *
+ *   $(CROSS_COMPILE)gcc -static -O2 -Idrivers/staging/android \
+ *	-o binder-pingpong tools/bench/binder-pingpong.c
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "binder.h"
+
+#define MAP_SIZE	(128 * 1024)
+#define MAX_PAIRS	64
+#define MAX_SIZE	4096
+
+enum {
+	CODE_PUBLISH = 1,	/* server -> parent: flat object + index */
+	CODE_LOOKUP,		/* client -> parent: index, reply is a handle */
+	CODE_PING,		/* client -> server: payload, echoed back */
+};
+
+struct publish {
+	struct flat_binder_object obj;
+	uint32_t index;
+};
+
+struct result {
+	unsigned long count;
+	double secs;
+};
+
+struct cmdbuf {
+	uint8_t buf[512];
+	size_t len;
+};
+
+static char payload[MAX_SIZE];
+
+static void die(const char *msg)
+{
+	perror(msg);
+	exit(1);
+}
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void put(struct cmdbuf *c, const void *data, size_t len)
+{
+	if (c->len + len > sizeof(c->buf)) {
+		fprintf(stderr, "command buffer overflow\n");
+		exit(1);
+	}
+	memcpy(c->buf + c->len, data, len);
+	c->len += len;
+}
+
+static void put32(struct cmdbuf *c, uint32_t v)
+{
+	put(c, &v, sizeof(v));
+}
+
+static void put_ptr(struct cmdbuf *c, const void *p)
+{
+	put(c, &p, sizeof(p));
+}
+
+static void put_txn(struct cmdbuf *c, uint32_t cmd, uint32_t handle,
+		    uint32_t code, const void *data, size_t size,
+		    const size_t *offs, size_t offs_size)
+{
+	struct binder_transaction_data tr;
+
+	memset(&tr, 0, sizeof(tr));
+	tr.target.handle = handle;
+	tr.code = code;
+	tr.data_size = size;
+	tr.offsets_size = offs_size;
+	tr.data.ptr.buffer = data;
+	tr.data.ptr.offsets = offs;
+	put32(c, cmd);
+	put(c, &tr, sizeof(tr));
+}
+
+static int binder_open(void)
+{
+	int fd = open("/dev/binder", O_RDWR);
+
+	if (fd < 0)
+		die("open /dev/binder");
+	if (mmap(NULL, MAP_SIZE, PROT_READ, MAP_PRIVATE, fd, 0) == MAP_FAILED)
+		die("mmap /dev/binder");
+	return fd;
+}
+
+/*
+ * Writes out whatever is queued in c and reads until a BR_TRANSACTION or
+ * BR_REPLY arrives, which must be 'want'. Reference count requests for
+ * our own nodes are acknowledged through c on the next call. Returns -1
+ * on a failed or dead reply.
+ */
+static int binder_wait(int fd, struct cmdbuf *c, uint32_t want,
+		       struct binder_transaction_data *tr)
+{
+	uint32_t rbuf[64];
+	struct binder_ptr_cookie pc;
+	struct binder_write_read bwr;
+	uint8_t *p, *end;
+	uint32_t cmd;
+
+	for (;;) {
+		memset(&bwr, 0, sizeof(bwr));
+		bwr.write_size = c->len;
+		bwr.write_buffer = (unsigned long)c->buf;
+		bwr.read_size = sizeof(rbuf);
+		bwr.read_buffer = (unsigned long)rbuf;
+		if (ioctl(fd, BINDER_WRITE_READ, &bwr) < 0)
+			die("BINDER_WRITE_READ");
+		c->len = 0;
+
+		p = (uint8_t *)rbuf;
+		end = p + bwr.read_consumed;
+		while (p < end) {
+			memcpy(&cmd, p, sizeof(cmd));
+			p += sizeof(cmd);
+			switch (cmd) {
+			case BR_NOOP:
+			case BR_TRANSACTION_COMPLETE:
+			case BR_SPAWN_LOOPER:
+				break;
+			case BR_INCREFS:
+			case BR_ACQUIRE:
+				memcpy(&pc, p, sizeof(pc));
+				p += sizeof(pc);
+				put32(c, cmd == BR_INCREFS ?
+				      BC_INCREFS_DONE : BC_ACQUIRE_DONE);
+				put(c, &pc, sizeof(pc));
+				break;
+			case BR_RELEASE:
+			case BR_DECREFS:
+				p += sizeof(pc);
+				break;
+			case BR_TRANSACTION:
+			case BR_REPLY:
+				memcpy(tr, p, sizeof(*tr));
+				if (cmd != want) {
+					fprintf(stderr, "unexpected %s\n",
+						cmd == BR_REPLY ? "reply" :
+						"transaction");
+					exit(1);
+				}
+				return 0;
+			default:
+				return -1;
+			}
+		}
+	}
+}
+
+static void wait_token(int fd)
+{
+	char token;
+
+	if (read(fd, &token, 1) != 1)
+		die("read token");
+}
+
+static void send_tokens(int fd, int n)
+{
+	while (n--)
+		if (write(fd, "x", 1) != 1)
+			die("write token");
+}
+
+static void server(int index, int go)
+{
+	static size_t offs[1] = { 0 };
+	struct binder_transaction_data tr;
+	struct cmdbuf c = { .len = 0 };
+	struct publish pub;
+	int fd;
+
+	wait_token(go);
+	fd = binder_open();
+
+	memset(&pub, 0, sizeof(pub));
+	pub.obj.type = BINDER_TYPE_BINDER;
+	pub.obj.flags = 0x7f | FLAT_BINDER_FLAG_ACCEPTS_FDS;
+	pub.obj.binder = (void *)(long)(index + 1);
+	pub.index = index;
+	put_txn(&c, BC_TRANSACTION, 0, CODE_PUBLISH, &pub, sizeof(pub),
+		offs, sizeof(offs));
+	if (binder_wait(fd, &c, BR_REPLY, &tr))
+		die("publish");
+	put32(&c, BC_FREE_BUFFER);
+	put_ptr(&c, tr.data.ptr.buffer);
+
+	put32(&c, BC_ENTER_LOOPER);
+	for (;;) {
+		if (binder_wait(fd, &c, BR_TRANSACTION, &tr))
+			exit(1);
+		put32(&c, BC_FREE_BUFFER);
+		put_ptr(&c, tr.data.ptr.buffer);
+		put_txn(&c, BC_REPLY, 0, 0, payload, tr.data_size, NULL, 0);
+	}
+}
+
+static void client(int index, int go, int start, size_t size, int secs,
+		   struct result *res)
+{
+	const struct flat_binder_object *obj;
+	struct binder_transaction_data tr;
+	struct cmdbuf c = { .len = 0 };
+	uint32_t idx = index;
+	uint32_t handle;
+	unsigned long count = 0;
+	double t0, t;
+	int fd;
+
+	wait_token(go);
+	fd = binder_open();
+
+	put_txn(&c, BC_TRANSACTION, 0, CODE_LOOKUP, &idx, sizeof(idx),
+		NULL, 0);
+	if (binder_wait(fd, &c, BR_REPLY, &tr) ||
+	    tr.data_size < sizeof(*obj))
+		die("lookup");
+	obj = tr.data.ptr.buffer;
+	handle = obj->handle;
+	put32(&c, BC_ACQUIRE);
+	put32(&c, handle);
+	put32(&c, BC_FREE_BUFFER);
+	put_ptr(&c, tr.data.ptr.buffer);
+
+	wait_token(start);
+	t0 = now();
+	do {
+		put_txn(&c, BC_TRANSACTION, handle, CODE_PING, payload, size,
+			NULL, 0);
+		if (binder_wait(fd, &c, BR_REPLY, &tr))
+			die("ping");
+		put32(&c, BC_FREE_BUFFER);
+		put_ptr(&c, tr.data.ptr.buffer);
+		count++;
+		t = (count & 63) ? t0 : now();
+	} while (t - t0 < secs);
+
+	res->count = count;
+	res->secs = t - t0;
+	exit(0);
+}
+
+/* Parent: context manager handing server objects out to clients. */
+static void broker(int fd, int pairs, int srv_go, int cli_go, int cli_start)
+{
+	static size_t offs[1] = { 0 };
+	struct binder_transaction_data tr;
+	struct cmdbuf c = { .len = 0 };
+	struct flat_binder_object reply;
+	uint32_t handles[MAX_PAIRS];
+	const struct publish *pub;
+	uint32_t idx;
+	int published = 0;
+	int looked_up = 0;
+
+	put32(&c, BC_ENTER_LOOPER);
+	send_tokens(srv_go, pairs);
+	while (looked_up < pairs) {
+		if (binder_wait(fd, &c, BR_TRANSACTION, &tr))
+			die("broker");
+		if (tr.code == CODE_PUBLISH) {
+			pub = tr.data.ptr.buffer;
+			handles[pub->index] = pub->obj.handle;
+			put32(&c, BC_ACQUIRE);
+			put32(&c, pub->obj.handle);
+			put32(&c, BC_FREE_BUFFER);
+			put_ptr(&c, tr.data.ptr.buffer);
+			put_txn(&c, BC_REPLY, 0, 0, NULL, 0, NULL, 0);
+			if (++published == pairs)
+				send_tokens(cli_go, pairs);
+		} else {
+			memcpy(&idx, tr.data.ptr.buffer, sizeof(idx));
+			memset(&reply, 0, sizeof(reply));
+			reply.type = BINDER_TYPE_HANDLE;
+			reply.handle = handles[idx];
+			put32(&c, BC_FREE_BUFFER);
+			put_ptr(&c, tr.data.ptr.buffer);
+			put_txn(&c, BC_REPLY, 0, 0, &reply, sizeof(reply),
+				offs, sizeof(offs));
+			looked_up++;
+		}
+	}
+	/* flush the last reply before letting the clients go */
+	if (c.len) {
+		struct binder_write_read bwr;
+
+		memset(&bwr, 0, sizeof(bwr));
+		bwr.write_size = c.len;
+		bwr.write_buffer = (unsigned long)c.buf;
+		if (ioctl(fd, BINDER_WRITE_READ, &bwr) < 0)
+			die("BINDER_WRITE_READ");
+	}
+	send_tokens(cli_start, pairs);
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: binder-pingpong [-p pairs] [-s size] [-t seconds]\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int pairs = 1, secs = 5;
+	size_t size = 32;
+	int srv_go[2], cli_go[2], cli_start[2];
+	pid_t servers[MAX_PAIRS];
+	struct result *res;
+	unsigned long total = 0;
+	double secs_sum = 0;
+	int fd, i, opt;
+
+	while ((opt = getopt(argc, argv, "p:s:t:")) != -1) {
+		switch (opt) {
+		case 'p':
+			pairs = atoi(optarg);
+			break;
+		case 's':
+			size = atoi(optarg);
+			break;
+		case 't':
+			secs = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (pairs < 1 || pairs > MAX_PAIRS || size > MAX_SIZE || secs < 1)
+		usage();
+
+	res = mmap(NULL, pairs * sizeof(*res), PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (res == MAP_FAILED)
+		die("mmap results");
+	if (pipe(srv_go) || pipe(cli_go) || pipe(cli_start))
+		die("pipe");
+
+	/* fork before opening binder so no child inherits the parent's fd */
+	for (i = 0; i < pairs; i++) {
+		servers[i] = fork();
+		if (servers[i] < 0)
+			die("fork");
+		if (!servers[i])
+			server(i, srv_go[0]);
+		if (fork() == 0)
+			client(i, cli_go[0], cli_start[0], size, secs,
+			       &res[i]);
+	}
+
+	fd = binder_open();
+	if (ioctl(fd, BINDER_SET_CONTEXT_MGR, 0) < 0)
+		die("BINDER_SET_CONTEXT_MGR (is servicemanager running?)");
+	broker(fd, pairs, srv_go[1], cli_go[1], cli_start[1]);
+
+	for (i = 0; i < pairs; i++) {
+		int status;
+		pid_t pid = wait(&status);
+
+		if (pid < 0)
+			die("wait");
+		if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+			fprintf(stderr, "child %d failed\n", (int)pid);
+			break;
+		}
+	}
+	for (i = 0; i < pairs; i++)
+		kill(servers[i], SIGKILL);
+
+	for (i = 0; i < pairs; i++) {
+		total += res[i].count;
+		secs_sum += res[i].secs;
+	}
+	printf("pairs %d size %u: %.0f round trips/s, %.1f us each\n",
+	       pairs, (unsigned int)size, total / (secs_sum / pairs),
+	       total ? secs_sum * 1e6 / total : 0.0);
+	return 0;
+}
@@ -0,0 +1,153 @@
+/*
+ * lmk-pressure - watch /dev/lowmemorykiller and measure allocation stalls
+ *
+ *   lmk-pressure [-a mb] [-s stall_ms]
+ *
+ * Prints every pressure level change reported by /dev/lowmemorykiller
+ * with a timestamp, so it can be checked that levels go up ahead of
+ * the shrinker's kills and come back down once memory is freed.
+ *
+ * With -a it also allocates and touches mb megabytes, 1MB at a time,
+ * the way an app launch grows its heap. Each chunk that took longer
+ * than stall_ms (default 10) to fault in is counted as a stall, and
+ * the stall count, the slowest chunk and the total time are printed.
+ * Run it with /sys/module/lowmemorykiller/parameters/kill_batch set to
+ * 1 and then to a larger value, with the same background apps loaded,
+ * to compare the two. The memory is freed again afterwards, and the
+ * watcher should then report the level dropping back.
+ *
+ * Build with the target's userspace toolchain:
+ *
+ *   $(CROSS_COMPILE)gcc -static -O2 -o lmk-pressure tools/bench/lmk-pressure.c
+ */
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define CHUNK	(1024 * 1024)
+
+static double t_start;
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void die(const char *msg)
+{
+	perror(msg);
+	exit(1);
+}
+
+static int read_level(int fd)
+{
+	int level;
+
+	if (read(fd, &level, sizeof(level)) != sizeof(level))
+		die("read /dev/lowmemorykiller");
+	return level;
+}
+
+static void watch(int fd)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+	printf("%10.3f level %d\n", now() - t_start, read_level(fd));
+	fflush(stdout);
+	for (;;) {
+		if (poll(&pfd, 1, -1) < 0)
+			die("poll");
+		printf("%10.3f level %d\n", now() - t_start, read_level(fd));
+		fflush(stdout);
+	}
+}
+
+static void allocate(int mb, double stall_ms)
+{
+	double t0, t, slowest = 0;
+	int stalls = 0;
+	char **chunks;
+	int i;
+
+	chunks = calloc(mb, sizeof(*chunks));
+	if (!chunks)
+		die("calloc");
+	t0 = now();
+	for (i = 0; i < mb; i++) {
+		t = now();
+		chunks[i] = malloc(CHUNK);
+		if (!chunks[i])
+			die("malloc");
+		memset(chunks[i], i, CHUNK);
+		t = (now() - t) * 1e3;
+		if (t > slowest)
+			slowest = t;
+		if (t > stall_ms)
+			stalls++;
+	}
+	printf("%10.3f allocated %d MB in %.1f ms, %d stalls > %.0f ms, "
+	       "slowest %.1f ms\n", now() - t_start, mb, (now() - t0) * 1e3,
+	       stalls, stall_ms, slowest);
+	fflush(stdout);
+
+	/* chunks this size are mmapped, so free() hands them straight back */
+	for (i = 0; i < mb; i++)
+		free(chunks[i]);
+	free(chunks);
+}
+
+int main(int argc, char **argv)
+{
+	double stall_ms = 10;
+	pid_t watcher;
+	int mb = 0;
+	int fd, opt;
+
+	while ((opt = getopt(argc, argv, "a:s:")) != -1) {
+		switch (opt) {
+		case 'a':
+			mb = atoi(optarg);
+			break;
+		case 's':
+			stall_ms = atof(optarg);
+			break;
+		default:
+			fprintf(stderr,
+				"usage: lmk-pressure [-a mb] [-s stall_ms]\n");
+			return 1;
+		}
+	}
+
+	fd = open("/dev/lowmemorykiller", O_RDONLY);
+	if (fd < 0)
+		die("open /dev/lowmemorykiller");
+	t_start = now();
+
+	if (!mb)
+		watch(fd);
+
+	watcher = fork();
+	if (watcher < 0)
+		die("fork");
+	if (!watcher)
+		watch(fd);
+	close(fd);
+
+	allocate(mb, stall_ms);
+	/* the level should drop back within a second of the free */
+	sleep(2);
+	kill(watcher, SIGTERM);
+	waitpid(watcher, NULL, 0);
+	return 0;
+}
@@ -0,0 +1,148 @@
+/*
+ * logger-writers - multi-writer throughput of an Android log device
+ *
+ *   logger-writers [-l log] [-w writers] [-n msg_len] [-t seconds]
+ *
+ * Starts the given number of threads, each writing messages to
+ * /dev/log/<log> (default "main") as fast as it can with writev(), in
+ * the same priority/tag/message layout liblog uses. Prints the total
+ * entries and megabytes written per second. A single writer gives the
+ * uncontended cost of a write; going up to the number of CPUs and
+ * beyond shows how much concurrent writers to one log hold each other
+ * up.
+ *
+ * Readers such as logcat can be left running to include their cost.
+ * Use a log nobody else writes to (e.g. "-l radio" on a device without
+ * a modem) to keep the numbers stable.
+ *
+ * Build with the target's userspace toolchain:
+ *
+ *   $(CROSS_COMPILE)gcc -static -O2 -pthread -o logger-writers \
+ *	tools/bench/logger-writers.c
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+
+#define MAX_WRITERS	64
+#define MAX_MSG		4000	/* below LOGGER_ENTRY_MAX_PAYLOAD */
+
+struct writer {
+	pthread_t thread;
+	int fd;
+	unsigned long count;
+};
+
+static int msg_len = 64;
+static volatile int go, stop;
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void *writer_fn(void *arg)
+{
+	static const char tag[] = "logbench";
+	struct writer *w = arg;
+	unsigned char prio = 4;	/* ANDROID_LOG_INFO */
+	char msg[MAX_MSG + 1];
+	struct iovec vec[3];
+
+	memset(msg, 'x', msg_len);
+	msg[msg_len] = '\0';
+	vec[0].iov_base = &prio;
+	vec[0].iov_len = 1;
+	vec[1].iov_base = (void *)tag;
+	vec[1].iov_len = sizeof(tag);
+	vec[2].iov_base = msg;
+	vec[2].iov_len = msg_len + 1;
+
+	while (!go)
+		sched_yield();
+	while (!stop) {
+		if (writev(w->fd, vec, 3) < 0 && errno != EINTR) {
+			perror("writev");
+			exit(1);
+		}
+		w->count++;
+	}
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	static struct writer writers[MAX_WRITERS];
+	const char *log = "main";
+	int nr_writers = 1, secs = 5;
+	unsigned long total = 0;
+	char path[64];
+	double t0, t;
+	int i, opt;
+
+	while ((opt = getopt(argc, argv, "l:w:n:t:")) != -1) {
+		switch (opt) {
+		case 'l':
+			log = optarg;
+			break;
+		case 'w':
+			nr_writers = atoi(optarg);
+			break;
+		case 'n':
+			msg_len = atoi(optarg);
+			break;
+		case 't':
+			secs = atoi(optarg);
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (nr_writers < 1 || nr_writers > MAX_WRITERS ||
+	    msg_len < 0 || msg_len > MAX_MSG || secs < 1)
+		goto usage;
+
+	snprintf(path, sizeof(path), "/dev/log/%s", log);
+	for (i = 0; i < nr_writers; i++) {
+		/* one fd per writer, like separate processes would have */
+		writers[i].fd = open(path, O_WRONLY);
+		if (writers[i].fd < 0) {
+			perror(path);
+			return 1;
+		}
+		pthread_create(&writers[i].thread, NULL, writer_fn,
+			       &writers[i]);
+	}
+
+	/* bionic has no barriers; release the writers with a flag */
+	t0 = now();
+	go = 1;
+	sleep(secs);
+	stop = 1;
+	for (i = 0; i < nr_writers; i++) {
+		pthread_join(writers[i].thread, NULL);
+		total += writers[i].count;
+	}
+	t = now() - t0;
+
+	printf("%d writers, %d byte messages: %.0f entries/s, %.2f MB/s\n",
+	       nr_writers, msg_len, total / t,
+	       total * (1.0 + sizeof("logbench") + msg_len + 1) / t / 1e6);
+	return 0;
+
+usage:
+	fprintf(stderr, "usage: logger-writers [-l log] [-w writers] "
+		"[-n msg_len] [-t seconds]\n");
+	return 1;
+}
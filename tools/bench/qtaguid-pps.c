@@ -0,0 +1,180 @@
+/*
+ * qtaguid-pps - loopback UDP packet rate, for xt_qtaguid overhead
+ *
+ *   qtaguid-pps [-p senders] [-s size] [-t seconds] [-T]
+ *
+ * Starts the given number of sender threads, each blasting size-byte
+ * UDP datagrams over its own socket to a receiver on 127.0.0.1. On
+ * loopback the receive side, INPUT hook included, runs in the sender's
+ * softirq, so the send rate covers both directions and scales with
+ * senders even once the single receiver falls behind. Both the send
+ * and the receive rate are printed. With -T every socket is tagged
+ * through /proc/net/xt_qtaguid/ctrl first, so the matches take the
+ * tagged-socket path.
+ *
+ * Run it once without any qtaguid rules and once with the matches the
+ * Android bandwidth controller installs, e.g.
+ *
+ *   iptables -I INPUT -m owner --socket-exists
+ *   iptables -I OUTPUT -m owner --socket-exists
+ *
+ * so each packet is matched on the way out and on the way in. The
+ * difference between the two rates is the cost of the match. Use -p
+ * up to the number of CPUs to see whether the accounting path
+ * serialises the senders.
+ *
+ * Build with the target's userspace toolchain:
+ *
+ *   $(CROSS_COMPILE)gcc -static -O2 -pthread -o qtaguid-pps \
+ *	tools/bench/qtaguid-pps.c
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#define MAX_SENDERS	32
+#define MAX_SIZE	1400
+
+struct sender {
+	pthread_t thread;
+	int fd;
+	unsigned long sent;
+};
+
+static struct sockaddr_in dest;
+static int size = 64;
+static volatile int stop;
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void die(const char *msg)
+{
+	perror(msg);
+	exit(1);
+}
+
+static void tag_socket(int fd, int tag)
+{
+	char cmd[64];
+	int ctrl, len;
+
+	ctrl = open("/proc/net/xt_qtaguid/ctrl", O_WRONLY);
+	if (ctrl < 0)
+		die("open /proc/net/xt_qtaguid/ctrl");
+	/* the accounting tag lives in the upper 32 bits */
+	len = snprintf(cmd, sizeof(cmd), "t %d %llu %u", fd,
+		       (unsigned long long)tag << 32, (unsigned int)getuid());
+	if (write(ctrl, cmd, len) != len)
+		die("tag socket");
+	close(ctrl);
+}
+
+static void *sender_fn(void *arg)
+{
+	struct sender *s = arg;
+	char buf[MAX_SIZE];
+
+	memset(buf, 0, size);
+	while (!stop)
+		/* the receiver can fall behind; drops are fine */
+		if (sendto(s->fd, buf, size, 0, (struct sockaddr *)&dest,
+			   sizeof(dest)) == size)
+			s->sent++;
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	static struct sender threads[MAX_SENDERS];
+	int senders = 1, secs = 5, tag = 0;
+	socklen_t alen = sizeof(dest);
+	struct timeval tv = { .tv_sec = 0, .tv_usec = 100000 };
+	unsigned long received = 0, sent = 0;
+	char buf[MAX_SIZE];
+	double t0, t;
+	int rx, i, opt;
+
+	while ((opt = getopt(argc, argv, "p:s:t:T")) != -1) {
+		switch (opt) {
+		case 'p':
+			senders = atoi(optarg);
+			break;
+		case 's':
+			size = atoi(optarg);
+			break;
+		case 't':
+			secs = atoi(optarg);
+			break;
+		case 'T':
+			tag = 1;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (senders < 1 || senders > MAX_SENDERS || size < 1 ||
+	    size > MAX_SIZE || secs < 1)
+		goto usage;
+
+	rx = socket(AF_INET, SOCK_DGRAM, 0);
+	if (rx < 0)
+		die("socket");
+	memset(&dest, 0, sizeof(dest));
+	dest.sin_family = AF_INET;
+	dest.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(rx, (struct sockaddr *)&dest, sizeof(dest)) ||
+	    getsockname(rx, (struct sockaddr *)&dest, &alen))
+		die("bind");
+	setsockopt(rx, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	if (tag)
+		tag_socket(rx, 1);
+
+	for (i = 0; i < senders; i++) {
+		threads[i].fd = socket(AF_INET, SOCK_DGRAM, 0);
+		if (threads[i].fd < 0)
+			die("socket");
+		if (tag)
+			tag_socket(threads[i].fd, i + 2);
+		pthread_create(&threads[i].thread, NULL, sender_fn,
+			       &threads[i]);
+	}
+
+	t0 = now();
+	do {
+		if (recv(rx, buf, sizeof(buf), 0) > 0)
+			received++;
+		else if (errno != EAGAIN && errno != EINTR)
+			die("recv");
+		t = now();
+	} while (t - t0 < secs);
+	stop = 1;
+	for (i = 0; i < senders; i++) {
+		pthread_join(threads[i].thread, NULL);
+		sent += threads[i].sent;
+	}
+
+	printf("%d senders, %d byte datagrams%s: %.0f packets/s sent, "
+	       "%.0f received\n", senders, size, tag ? ", tagged" : "",
+	       sent / (t - t0), received / (t - t0));
+	return 0;
+
+usage:
+	fprintf(stderr,
+		"usage: qtaguid-pps [-p senders] [-s size] [-t seconds] [-T]\n");
+	return 1;
+}